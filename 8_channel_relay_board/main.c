@@ -53,15 +53,33 @@ void led_blinking_task(void);
 /*------------- MAIN -------------*/
 int main(void)
 { 
+  timer_setup();  // boot timebase, still on OSC8M
+  gpio_setup();   // relays reach their power-on state before any clock setup
+  boot_mark(BOOT_GPIO);
   board_init();
-  gpio_setup();
+  timer_clock_dfll();
+  boot_mark(BOOT_BOARD);
   tusb_init();
+  boot_mark(BOOT_TUSB);
 
+  bool deferred_init = false;
   while (1)
   {
     tud_task(); // tinyusb device task
+    if (!deferred_init && tud_mounted())
+    {
+      pwm_setup(); // not needed to enumerate, done once the host has configured us
+      adc_setup();
+      dac_setup();
+      input_setup();
+      trigger_setup();
+      deferred_init = true;
+    }
     led_blinking_task();
     usbtmc_app_task_iter();
+    hid_task();
+    adc_task();
+    nvm_task();
   }
 
   return 0;
@@ -74,6 +92,7 @@ int main(void)
 // Invoked when device is mounted
 void tud_mount_cb(void)
 {
+  boot_mark(BOOT_MOUNT);
   blink_interval_ms = BLINK_MOUNTED;
 }
 
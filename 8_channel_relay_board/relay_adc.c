@@ -0,0 +1,272 @@
+#define ADC_AIN_FIRST    1
+// PA pins of the scanned inputs AIN1: A1 PA03
+#define ADC_AIN_PINS     3
+// { channel, coil sense AIN, sense resistor mOhm, contact sense AIN }, -1 = not fitted
+#define ADC_SENSE_MAP    { { 1, -1, 0, 1 } }
+
+#include <stdio.h>      /* sprintf */
+#include "tusb.h"
+#include "bsp/board.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* ADC, PORT pin multiplexer */
+
+// Analog sensing. The ADC runs free with INPUTSCAN over consecutive inputs,
+// every result is moved by DMA into one half of a double buffer. The CPU only
+// sees an interrupt per half, when ADC_SCANS scans are complete. Coil current
+// is read across a sense resistor in the coil return, a contact sense input
+// sees the switched side of the contact through a divider.
+#define ADC_SCANS          8u       // scans per buffer half, about 6 ms
+#define ADC_FULL_SCALE_MV  3300u    // VDDANA/2 reference with 1/2 gain
+#define ADC_CONTACT_LEVEL  2048u    // contact sense above half scale = closed
+#define ADC_VERIFY_MS      20u      // pull-in and bounce time before a contact is checked
+
+typedef struct
+{
+  uint8_t  channel;      // RELAYn
+  int8_t   coil_ain;     // coil sense input, -1 = none
+  uint32_t coil_mohm;    // coil sense resistor
+  int8_t   contact_ain;  // contact sense input, -1 = none
+} adc_sense_map_t;
+
+static const uint8_t         adc_ain_pins[]  = { ADC_AIN_PINS };
+static const adc_sense_map_t adc_sense_map[] = ADC_SENSE_MAP;
+#define ADC_AIN_COUNT   (sizeof(adc_ain_pins))
+TU_VERIFY_STATIC(!(PA_MASK(ADC_AIN_PINS) & BUS_PINS),
+                 "the shift register chain or the expander bus has a pin of ADC_AIN_PINS, move it");
+#define ADC_SENSE_LEN   (sizeof(adc_sense_map) / sizeof(adc_sense_map[0]))
+
+static volatile uint16_t adc_buf[2][ADC_SCANS][ADC_AIN_COUNT];
+static DmacDescriptor    adc_desc_b __attribute__((aligned(16)));
+static volatile uint8_t  adc_ready;      // buffer half the DMA has completed
+static volatile uint32_t adc_seq;        // completed buffer halves
+static volatile uint32_t adc_ready_us;   // timer_us() when adc_ready completed
+
+TU_VERIFY_STATIC(2u + 4u + 12u + sizeof(adc_buf[0]) + 1u <= BLOCK_OUT_LEN, "FETC? block does not fit");
+
+static bool              adc_verify;
+static uint32_t          adc_verify_mask;
+static uint32_t          adc_verify_ms;
+static uint32_t          adc_verify_seq;
+static uint32_t          adc_verify_fail;
+
+static void adc_sync(void)
+{
+  while (ADC->STATUS.bit.SYNCBUSY);
+}
+
+static void adc_descriptor(DmacDescriptor *desc, volatile uint16_t *dst, DmacDescriptor *next)
+{
+  desc->BTCTRL.reg   = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_HWORD | DMAC_BTCTRL_DSTINC |
+                       DMAC_BTCTRL_BLOCKACT_INT;
+  desc->BTCNT.reg    = ADC_SCANS * ADC_AIN_COUNT;
+  desc->SRCADDR.reg  = (uint32_t)(uintptr_t)&ADC->RESULT.reg;
+  desc->DSTADDR.reg  = (uint32_t)(uintptr_t)(dst + ADC_SCANS * ADC_AIN_COUNT); // end address when incrementing
+  desc->DESCADDR.reg = (uint32_t)(uintptr_t)next;
+}
+
+void adc_setup(void)
+{
+  dma_setup();
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_ADC | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN;
+  while (GCLK->STATUS.bit.SYNCBUSY);
+  PM->APBCMASK.reg |= PM_APBCMASK_ADC;
+
+  for (uint8_t i = 0; i < ADC_AIN_COUNT; i++)
+  {
+    uint8_t pin = adc_ain_pins[i];
+    if (pin & 1u)
+    {
+      PORT->Group[0].PMUX[pin >> 1].bit.PMUXO = 1; // function B, analog
+    }
+    else
+    {
+      PORT->Group[0].PMUX[pin >> 1].bit.PMUXE = 1;
+    }
+    PORT->Group[0].PINCFG[pin].bit.PMUXEN = 1;
+  }
+
+  uint32_t bias      = (*(uint32_t *)ADC_FUSES_BIASCAL_ADDR & ADC_FUSES_BIASCAL_Msk) >> ADC_FUSES_BIASCAL_Pos;
+  uint32_t linearity = (*(uint32_t *)ADC_FUSES_LINEARITY_0_ADDR & ADC_FUSES_LINEARITY_0_Msk) >> ADC_FUSES_LINEARITY_0_Pos;
+  linearity |= ((*(uint32_t *)ADC_FUSES_LINEARITY_1_ADDR & ADC_FUSES_LINEARITY_1_Msk) >> ADC_FUSES_LINEARITY_1_Pos) << 5;
+  ADC->CALIB.reg    = ADC_CALIB_BIAS_CAL(bias) | ADC_CALIB_LINEARITY_CAL(linearity);
+  ADC->REFCTRL.reg  = ADC_REFCTRL_REFSEL_INTVCC1;
+  ADC->AVGCTRL.reg  = ADC_AVGCTRL_SAMPLENUM_16 | ADC_AVGCTRL_ADJRES(4); // 12 bit result
+  ADC->SAMPCTRL.reg = ADC_SAMPCTRL_SAMPLEN(5);
+  ADC->CTRLB.reg    = ADC_CTRLB_PRESCALER_DIV64 | ADC_CTRLB_RESSEL_16BIT | ADC_CTRLB_FREERUN;
+  adc_sync();
+  ADC->INPUTCTRL.reg = ADC_INPUTCTRL_MUXPOS(ADC_AIN_FIRST) | ADC_INPUTCTRL_MUXNEG_GND |
+                       ADC_INPUTCTRL_INPUTSCAN(ADC_AIN_COUNT - 1u) | ADC_INPUTCTRL_GAIN_DIV2;
+  adc_sync();
+
+  adc_descriptor(dma_descriptor(DMA_CH_ADC), &adc_buf[0][0][0], &adc_desc_b);
+  adc_descriptor(&adc_desc_b, &adc_buf[1][0][0], dma_descriptor(DMA_CH_ADC));
+  dma_channel_start(DMA_CH_ADC, DMAC_CHCTRLB_TRIGSRC(ADC_DMAC_ID_RESRDY) | DMAC_CHCTRLB_TRIGACT_BEAT);
+
+  ADC->CTRLA.reg = ADC_CTRLA_ENABLE;
+  adc_sync();
+  ADC->SWTRIG.reg = ADC_SWTRIG_START; // free running from here on
+}
+
+// DMAC_Handler, a buffer half is complete and the DMA moved on to the other
+void adc_dma_block_done(void)
+{
+  adc_ready    = (uint8_t)(adc_seq & 1u);
+  adc_ready_us = timer_us();
+  adc_seq++;
+}
+
+// Average of the completed buffer half for an input, 12 bit
+static uint32_t adc_average(int8_t ain)
+{
+  uint32_t sum = 0;
+  uint8_t  half = adc_ready;
+  for (uint8_t i = 0; i < ADC_SCANS; i++)
+  {
+    sum += adc_buf[half][i][ain - ADC_AIN_FIRST];
+  }
+  return sum / ADC_SCANS;
+}
+
+// Channels with a coil current sense
+uint32_t adc_coil_mask(void)
+{
+  uint32_t mask = 0;
+  for (uint8_t i = 0; i < ADC_SENSE_LEN; i++)
+  {
+    if (adc_sense_map[i].coil_ain >= 0)
+    {
+      mask |= 1u << (adc_sense_map[i].channel - 1);
+    }
+  }
+  return mask;
+}
+
+// Channels with a contact sense
+uint32_t adc_contact_mask(void)
+{
+  uint32_t mask = 0;
+  for (uint8_t i = 0; i < ADC_SENSE_LEN; i++)
+  {
+    if (adc_sense_map[i].contact_ain >= 0)
+    {
+      mask |= 1u << (adc_sense_map[i].channel - 1);
+    }
+  }
+  return mask;
+}
+
+// Coil current in 0.1 mA units, 0 before the first scan
+uint32_t adc_coil_current(uint8_t channel)
+{
+  for (uint8_t i = 0; i < ADC_SENSE_LEN; i++)
+  {
+    adc_sense_map_t const *map = &adc_sense_map[i];
+    if (map->channel == channel && map->coil_ain >= 0 && adc_seq)
+    {
+      uint32_t uv = adc_average(map->coil_ain) * (ADC_FULL_SCALE_MV * 1000u / 4096u);
+      return (uint32_t)(((uint64_t)uv * 10u) / map->coil_mohm);
+    }
+  }
+  return 0;
+}
+
+// Channels whose contact sense reads closed
+uint32_t adc_contact_state(void)
+{
+  uint32_t mask = 0;
+  for (uint8_t i = 0; i < ADC_SENSE_LEN && adc_seq; i++)
+  {
+    if (adc_sense_map[i].contact_ain >= 0 && adc_average(adc_sense_map[i].contact_ain) > ADC_CONTACT_LEVEL)
+    {
+      mask |= 1u << (adc_sense_map[i].channel - 1);
+    }
+  }
+  return mask;
+}
+
+// FETC?, the newest buffer half as a definite length block in a BLOCK_OUT_LEN
+// buffer, empty when no half completed since the last FETC? of the caller,
+// *seq keeps its count of halves. Data, little endian:
+//   uint32 buffer sequence number, gaps mean halves the host missed
+//   uint32 timer_us() when the half completed
+//   uint8  first AIN, uint8 inputs, uint16 scans
+//   uint16 samples[scans][inputs], 12 bit
+size_t adc_fetch(uint8_t *block, uint32_t *seq_seen)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t seq  = adc_seq;
+  uint32_t us   = adc_ready_us;
+  uint8_t  half = adc_ready;
+  __set_PRIMASK(primask);
+
+  size_t len = 0;
+  if (seq != *seq_seen)
+  {
+    len = 12u + sizeof(adc_buf[0]);
+  }
+  size_t   hdr  = (size_t)sprintf((char *)&block[2], "%u", (unsigned int)len);
+  uint8_t *data = &block[2u + hdr];
+  block[0] = '#';
+  block[1] = (uint8_t)('0' + hdr);
+  if (len)
+  {
+    uint32_t head[3] = { seq - 1u, us, ADC_AIN_FIRST | (ADC_AIN_COUNT << 8) | (ADC_SCANS << 16) };
+    memcpy(data, head, sizeof(head));
+    memcpy(&data[12], (void const *)adc_buf[half], sizeof(adc_buf[0])); // 6 ms before the DMA is back
+    *seq_seen = seq;
+  }
+  data[len] = '\n';
+  return 2u + hdr + len + 1u;
+}
+
+void adc_verify_set(bool on)
+{
+  adc_verify = on;
+  adc_verify_mask = ~0u; // restart the settle time
+}
+
+bool adc_verify_get(void)
+{
+  return adc_verify;
+}
+
+// Channels whose contact did not follow the relay, until *CLS
+uint32_t adc_verify_failed(void)
+{
+  return adc_verify_fail;
+}
+
+void adc_verify_clear(void)
+{
+  adc_verify_fail = 0;
+}
+
+// Called from the main loop. With verification on, once the relays have been
+// stable for ADC_VERIFY_MS every new scan compares the contact sense inputs
+// with the relay state. PWM channels are not checked.
+void adc_task(void)
+{
+  if (!adc_verify)
+  {
+    return;
+  }
+  uint32_t mask = relay_read_mask();
+  if (mask != adc_verify_mask || relay_schedule_pending())
+  {
+    adc_verify_mask = mask;
+    adc_verify_ms   = board_millis();
+    return;
+  }
+  if ((board_millis() - adc_verify_ms) < ADC_VERIFY_MS)
+  {
+    adc_verify_seq = adc_seq;
+    return;
+  }
+  if ((adc_seq - adc_verify_seq) < 2u)
+  {
+    return; // wait for a buffer half that started after the settle time
+  }
+  adc_verify_seq   = adc_seq;
+  adc_verify_fail |= (adc_contact_state() ^ mask) & adc_contact_mask() & ~relay_pwm_active();
+}
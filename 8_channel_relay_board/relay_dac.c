@@ -0,0 +1,274 @@
+#include "tusb.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* DAC, TC3, EVSYS, PORT pin multiplexer */
+
+// DAC output on A0 (PA02), 10 bit with the 3.3 V supply as reference.
+//
+// SOUR:VOLT writes the DAC directly. Waveforms run without the CPU: TC3
+// overflows at the sample rate and its event starts a conversion of
+// DATABUF through EVSYS, the DAC then asks the DMA for the next sample. The
+// first sample is output one sample period after the start.
+//
+// SOUR:WAV:DATA blocks are received into the half of wave_buf that is not
+// playing, the halves swap when the command is executed.
+#define DAC_PIN            2u          // PA02
+#define DAC_FULL_SCALE_MV  3300u
+#define DAC_CODE_MAX       1023u
+#define DAC_RATE_CLOCK     48000000u   // GCLK0
+#define DAC_RATE_DEFAULT   1000u
+#define DAC_EVSYS_CHANNEL  0u
+
+static const uint16_t dac_prescaler[] = { 1, 2, 4, 8, 16, 64, 256, 1024 };
+
+static uint16_t         wave_buf[2][DAC_WAVE_LEN];
+static uint8_t          wave_play;            // half of wave_buf used for playback
+static uint16_t         wave_len;             // samples in the playback half
+static uint16_t         wave_staged;          // samples in the other half, from dac_wave_end
+static uint32_t         wave_rx_len;          // block length announced by the header
+static uint32_t         wave_rx_count;        // block bytes received so far
+static bool             wave_rx_bad;          // sample above DAC_CODE_MAX
+static uint32_t         wave_rate = DAC_RATE_DEFAULT;
+static bool             wave_cont = true;
+static volatile uint8_t wave_state;           // DAC_WAVE_*
+
+static bool             dac_ready;
+static uint32_t         dac_mv;
+
+static void dac_sync(void)
+{
+  while (DAC->STATUS.bit.SYNCBUSY);
+}
+
+static void tc3_sync(void)
+{
+  while (TC3->COUNT16.STATUS.bit.SYNCBUSY);
+}
+
+void dac_setup(void)
+{
+  dma_setup();
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_DAC | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN;
+  while (GCLK->STATUS.bit.SYNCBUSY);
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_TC3_TCC2 | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN; // shared with TCC2 PWM
+  while (GCLK->STATUS.bit.SYNCBUSY);
+  PM->APBCMASK.reg |= PM_APBCMASK_DAC | PM_APBCMASK_TC3 | PM_APBCMASK_EVSYS;
+
+  PORT->Group[0].PMUX[DAC_PIN >> 1].bit.PMUXE = 1; // function B, VOUT
+  PORT->Group[0].PINCFG[DAC_PIN].bit.PMUXEN = 1;
+
+  // TC3 overflow -> DAC start, asynchronous path, no event clock needed
+  EVSYS->USER.reg    = EVSYS_USER_USER(EVSYS_ID_USER_DAC_START) | EVSYS_USER_CHANNEL(DAC_EVSYS_CHANNEL + 1u);
+  EVSYS->CHANNEL.reg = EVSYS_CHANNEL_CHANNEL(DAC_EVSYS_CHANNEL) | EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_TC3_OVF) |
+                       EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+
+  DAC->CTRLB.reg  = DAC_CTRLB_EOEN | DAC_CTRLB_REFSEL_AVCC;
+  DAC->EVCTRL.reg = DAC_EVCTRL_STARTEI;   // DATABUF is converted on the TC3 event
+  DAC->DATA.reg   = 0;
+  DAC->CTRLA.reg  = DAC_CTRLA_ENABLE;
+  dac_sync();
+  dac_ready = true;
+}
+
+void dac_set_mv(uint32_t mv)
+{
+  dac_wave_stop();
+  dac_mv = mv;
+  if (dac_ready)
+  {
+    DAC->DATA.reg = (uint16_t)((mv * DAC_CODE_MAX + DAC_FULL_SCALE_MV / 2u) / DAC_FULL_SCALE_MV);
+    dac_sync();
+  }
+}
+
+uint32_t dac_get_mv(void)
+{
+  return dac_mv;
+}
+
+// *RST, 0 V and no waveform. The uploaded waveform and its settings stay.
+void dac_reset(void)
+{
+  dac_set_mv(0);
+}
+
+// Start of a SOUR:WAV:DATA block, len bytes follow
+void dac_wave_begin(uint32_t len)
+{
+  wave_rx_len   = len;
+  wave_rx_count = 0;
+  wave_rx_bad   = false;
+}
+
+// Block data as it arrives from the bulk endpoint, bytes past the announced
+// length (the write termination) are dropped
+void dac_wave_rx(uint8_t const *data, size_t len)
+{
+  uint8_t *dst = (uint8_t *)wave_buf[wave_play ^ 1u];
+  for (size_t i = 0; i < len && wave_rx_count < wave_rx_len; i++, wave_rx_count++)
+  {
+    if (wave_rx_count < sizeof(wave_buf[0]))
+    {
+      dst[wave_rx_count] = data[i];
+    }
+    if ((wave_rx_count & 1u) && data[i] > (DAC_CODE_MAX >> 8))
+    {
+      wave_rx_bad = true; // high byte of a little endian sample
+    }
+  }
+}
+
+// Stages the received block when SOUR:WAV:DATA runs, false when the block was
+// short, too long, had an odd length or samples out of range
+bool dac_wave_end(void)
+{
+  if (wave_rx_count != wave_rx_len || wave_rx_len == 0 || (wave_rx_len & 1u) ||
+      wave_rx_len > sizeof(wave_buf[0]) || wave_rx_bad)
+  {
+    return false;
+  }
+  wave_staged = (uint16_t)(wave_rx_len / 2u);
+  return true;
+}
+
+// A waveform is loaded or staged
+bool dac_wave_ready(void)
+{
+  return wave_len || wave_staged;
+}
+
+// Executes SOUR:WAV:DATA, playback stops and the DAC holds its last value
+void dac_wave_load(void)
+{
+  if (!wave_staged)
+  {
+    return;
+  }
+  dac_wave_stop();
+  wave_play  ^= 1u;
+  wave_len    = wave_staged;
+  wave_staged = 0;
+}
+
+uint16_t dac_wave_samples(void)
+{
+  return wave_len;
+}
+
+// Sample rate in Hz, the rate the timer can make is used, see dac_wave_get_rate
+void dac_wave_set_rate(uint32_t hz)
+{
+  wave_rate = hz;
+}
+
+static uint8_t dac_wave_timing(uint32_t hz, uint32_t *per)
+{
+  uint8_t presc = 0;
+  while (presc < sizeof(dac_prescaler) / sizeof(dac_prescaler[0]) - 1u &&
+         DAC_RATE_CLOCK / dac_prescaler[presc] / hz > 65536u)
+  {
+    presc++;
+  }
+  uint32_t clock = DAC_RATE_CLOCK / dac_prescaler[presc];
+  *per = (clock + hz / 2u) / hz;
+  if (*per < 1u)
+  {
+    *per = 1u;
+  }
+  return presc;
+}
+
+uint32_t dac_wave_get_rate(void)
+{
+  uint32_t per;
+  uint8_t  presc = dac_wave_timing(wave_rate, &per);
+  uint32_t clock = DAC_RATE_CLOCK / dac_prescaler[presc];
+  return (clock + per / 2u) / per;
+}
+
+void dac_wave_set_cont(bool on)
+{
+  wave_cont = on;
+}
+
+bool dac_wave_get_cont(void)
+{
+  return wave_cont;
+}
+
+uint8_t dac_wave_state(void)
+{
+  return wave_state;
+}
+
+// Starts the loaded waveform now, or with arm at the next relay transition.
+// TC3 is enabled and stopped before the DMA channel, a stray overflow then
+// finds an empty DATABUF and does not convert.
+void dac_wave_start(bool arm)
+{
+  uint32_t per;
+  uint8_t  presc = dac_wave_timing(wave_rate, &per);
+
+  dac_wave_stop();
+  if (!dac_ready || !wave_len)
+  {
+    return;
+  }
+  TC3->COUNT16.CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_WAVEGEN_MFRQ |
+                           TC_CTRLA_PRESCALER(presc) | TC_CTRLA_PRESCSYNC_PRESC;
+  tc3_sync();
+  TC3->COUNT16.CC[0].reg  = (uint16_t)(per - 1u);
+  TC3->COUNT16.EVCTRL.reg = TC_EVCTRL_OVFEO;
+  TC3->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+  tc3_sync();
+  TC3->COUNT16.CTRLBSET.reg = TC_CTRLBSET_CMD_STOP;
+  tc3_sync();
+
+  DmacDescriptor *desc = dma_descriptor(DMA_CH_DAC);
+  desc->BTCTRL.reg   = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_HWORD | DMAC_BTCTRL_SRCINC |
+                       (wave_cont ? DMAC_BTCTRL_BLOCKACT_NOACT : DMAC_BTCTRL_BLOCKACT_INT);
+  desc->BTCNT.reg    = wave_len;
+  desc->SRCADDR.reg  = (uint32_t)(uintptr_t)&wave_buf[wave_play][wave_len]; // end address when incrementing
+  desc->DSTADDR.reg  = (uint32_t)(uintptr_t)&DAC->DATABUF.reg;
+  desc->DESCADDR.reg = wave_cont ? (uint32_t)(uintptr_t)desc : 0u;         // loop on itself
+  dma_channel_start(DMA_CH_DAC, DMAC_CHCTRLB_TRIGSRC(DAC_DMAC_ID_EMPTY) | DMAC_CHCTRLB_TRIGACT_BEAT);
+
+  wave_state = DAC_WAVE_ARMED;
+  if (!arm)
+  {
+    dac_relay_edge();
+  }
+}
+
+// Called from relay_update_mask with interrupts disabled, a single register
+// write so the waveform starts with the relay pins
+void dac_relay_edge(void)
+{
+  if (wave_state == DAC_WAVE_ARMED)
+  {
+    TC3->COUNT16.CTRLBSET.reg = TC_CTRLBSET_CMD_RETRIGGER;
+    wave_state = DAC_WAVE_RUNNING;
+  }
+}
+
+// Stops playback, the DAC holds the last sample
+void dac_wave_stop(void)
+{
+  if (!dac_ready)
+  {
+    return;
+  }
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  wave_state = DAC_WAVE_STOPPED;
+  __set_PRIMASK(primask);
+  dma_channel_stop(DMA_CH_DAC);
+  TC3->COUNT16.CTRLA.reg &= (uint16_t)~TC_CTRLA_ENABLE;
+  tc3_sync();
+}
+
+// DMAC_Handler, a single pass waveform has moved its last sample into DATABUF.
+// TC3 keeps running until the next start so that the last sample is converted.
+void dac_dma_block_done(void)
+{
+  wave_state = DAC_WAVE_STOPPED;
+}
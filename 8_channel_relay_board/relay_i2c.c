@@ -0,0 +1,196 @@
+// 7 bit addresses of the BOARD_RELAY_EXPANDERS expanders, EXP1 first
+#define EXP_ADDRS        { 0x20, 0x21 }
+#define EXP_CHIP         EXP_MCP23017   // EXP_MCP23017 or EXP_PCA9555
+
+#include "tusb.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* SERCOM1, PORT pin multiplexer */
+
+#if BOARD_RELAY_EXPANDERS
+
+// Relays on I2C GPIO expanders behind the STEMMA QT port, SDA PA16 and SCL
+// PA17 as SERCOM1 PAD0 and PAD1. Each expander has 16 outputs, its channels
+// follow the RELAY_PORTS ones: EXP1 port A bit 0 is RELAY_PORTS + 1.
+//
+// relay_update_mask only stores the new expander state. Every expander that
+// differs from what it was last sent gets one write transaction, register
+// address and both output bytes, moved into the SERCOM by DMA. The SERCOM
+// sends the STOP itself after ADDR.LEN bytes. MB is the DMA trigger, so its
+// interrupt is only enabled once the DMA has moved the last byte, it then
+// marks the end of the transaction and starts the next expander. The outputs
+// are written before the pins are made outputs, so an expander powers up with
+// the state of gpio_setup.
+//
+// SERCOM1 runs from GCLK generator 4, which stays at 1 MHz through the clock
+// switch in main (relay_timer.c), for 100 kHz with BAUD = 0.
+#define EXP_MCP23017     0
+#define EXP_PCA9555      1
+#define EXP_PIN_SDA      16u            // PA16, SERCOM1 PAD0
+#define EXP_PIN_SCL      17u            // PA17, SERCOM1 PAD1
+#define EXP_WRITE_LEN    3u             // register, port A/0, port B/1
+TU_VERIFY_STATIC(EXP_PINS == PA_MASK(EXP_PIN_SDA, EXP_PIN_SCL),
+                 "EXP_PINS in usbtmc_app.h is not the expander bus pins");
+
+#if EXP_CHIP == EXP_MCP23017
+#define EXP_REG_OUTPUT   0x14u          // OLATA, OLATB follows with IOCON.BANK = 0
+#define EXP_REG_DIR      0x00u          // IODIRA, IODIRB
+#else
+#define EXP_REG_OUTPUT   0x02u          // output port 0, port 1
+#define EXP_REG_DIR      0x06u          // configuration port 0, port 1
+#endif
+
+static const uint8_t exp_addrs[] = EXP_ADDRS;
+TU_VERIFY_STATIC(sizeof(exp_addrs) == BOARD_RELAY_EXPANDERS, "EXP_ADDRS needs an address per expander");
+
+static uint8_t           exp_buf[EXP_WRITE_LEN];
+static volatile uint32_t exp_want;      // expander channels, bit 0 = EXP1 port A bit 0
+static uint16_t          exp_sent[BOARD_RELAY_EXPANDERS];
+static uint8_t           exp_out_done;  // output registers written, bit per expander
+static uint8_t           exp_dir_done;  // pins made outputs, bit per expander
+static uint8_t           exp_failed;    // last write not acknowledged, bit per expander
+static int8_t            exp_busy = -1; // expander being written, -1 = bus idle
+static uint8_t           exp_last;      // round robin start
+
+static void exp_sync(void)
+{
+  while (SERCOM1->I2CM.SYNCBUSY.reg);
+}
+
+void expander_setup(void)
+{
+  dma_setup();
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_SERCOM1_CORE | GCLK_CLKCTRL_GEN_GCLK4 | GCLK_CLKCTRL_CLKEN;
+  while (GCLK->STATUS.bit.SYNCBUSY);
+  PM->APBCMASK.reg |= PM_APBCMASK_SERCOM1;
+
+  PORT->Group[0].PMUX[EXP_PIN_SDA >> 1].reg = PORT_PMUX_PMUXE_C | PORT_PMUX_PMUXO_C;
+  PORT->Group[0].PINCFG[EXP_PIN_SDA].reg    = PORT_PINCFG_PMUXEN;
+  PORT->Group[0].PINCFG[EXP_PIN_SCL].reg    = PORT_PINCFG_PMUXEN;
+
+  SERCOM1->I2CM.CTRLA.reg = SERCOM_I2CM_CTRLA_MODE_I2C_MASTER | SERCOM_I2CM_CTRLA_SDAHOLD(2);
+  SERCOM1->I2CM.CTRLB.reg = SERCOM_I2CM_CTRLB_SMEN;
+  SERCOM1->I2CM.BAUD.reg  = 0;
+  exp_sync();
+  SERCOM1->I2CM.CTRLA.reg |= SERCOM_I2CM_CTRLA_ENABLE;
+  exp_sync();
+  SERCOM1->I2CM.STATUS.reg = SERCOM_I2CM_STATUS_BUSSTATE(1); // force the bus state to idle
+  exp_sync();
+
+  NVIC_SetPriority(SERCOM1_IRQn, 2); // like the DMA, below the relay edges
+  NVIC_EnableIRQ(SERCOM1_IRQn);
+}
+
+// Write the three bytes of exp_buf to expander n
+static void exp_start(uint8_t n, uint8_t reg, uint16_t value)
+{
+  exp_buf[0] = reg;
+  exp_buf[1] = (uint8_t)value;
+  exp_buf[2] = (uint8_t)(value >> 8);
+  exp_busy   = (int8_t)n;
+
+  DmacDescriptor *desc = dma_descriptor(DMA_CH_EXP);
+  desc->BTCTRL.reg   = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | DMAC_BTCTRL_SRCINC |
+                       DMAC_BTCTRL_BLOCKACT_INT;
+  desc->BTCNT.reg    = EXP_WRITE_LEN;
+  desc->SRCADDR.reg  = (uint32_t)(uintptr_t)&exp_buf[EXP_WRITE_LEN]; // end address when incrementing
+  desc->DSTADDR.reg  = (uint32_t)(uintptr_t)&SERCOM1->I2CM.DATA.reg;
+  desc->DESCADDR.reg = 0;
+  dma_channel_start(DMA_CH_EXP, DMAC_CHCTRLB_TRIGSRC(SERCOM1_DMAC_ID_TX) | DMAC_CHCTRLB_TRIGACT_BEAT);
+
+  SERCOM1->I2CM.INTENSET.reg = SERCOM_I2CM_INTENSET_ERROR; // NACK ends the transaction early with LENERR
+  SERCOM1->I2CM.ADDR.reg = SERCOM_I2CM_ADDR_ADDR((uint32_t)exp_addrs[n] << 1) |
+                           SERCOM_I2CM_ADDR_LENEN | SERCOM_I2CM_ADDR_LEN(EXP_WRITE_LEN);
+}
+
+// Starts the next write the expanders are missing, round robin so a busy
+// expander does not hold up the others. Called with interrupts disabled.
+static void exp_next(void)
+{
+  uint32_t want = exp_want;
+  exp_busy = -1;
+  for (uint8_t i = 1; i <= BOARD_RELAY_EXPANDERS; i++)
+  {
+    uint8_t  n   = (uint8_t)((exp_last + i) % BOARD_RELAY_EXPANDERS);
+    uint16_t out = (uint16_t)(want >> (16u * n));
+    if (!(exp_out_done & (1u << n)) || out != exp_sent[n])
+    {
+      exp_sent[n]   = out;
+      exp_out_done |= (uint8_t)(1u << n);
+      exp_last      = n;
+      exp_start(n, EXP_REG_OUTPUT, out);
+      return;
+    }
+  }
+  for (uint8_t n = 0; n < BOARD_RELAY_EXPANDERS; n++)
+  {
+    if (!(exp_dir_done & (1u << n)) && !(exp_failed & (1u << n)))
+    {
+      exp_dir_done |= (uint8_t)(1u << n);
+      exp_start(n, EXP_REG_DIR, 0x0000u); // all outputs
+      return;
+    }
+  }
+}
+
+// Called from relay_update_mask with interrupts disabled. Channels that
+// change again while their expander is being written go out with the next
+// transaction, only the latest state is sent.
+void expander_write(uint32_t mask)
+{
+  exp_want = mask;
+  if (exp_busy < 0)
+  {
+    exp_next();
+  }
+}
+
+// Expander channels whose expander did not acknowledge its last write, bit 0
+// = EXP1 port A bit 0. The write is repeated with the next change.
+uint32_t expander_failed(void)
+{
+  uint32_t mask = 0;
+  for (uint8_t n = 0; n < BOARD_RELAY_EXPANDERS; n++)
+  {
+    if (exp_failed & (1u << n))
+    {
+      mask |= 0xFFFFu << (16u * n);
+    }
+  }
+  return mask;
+}
+
+// DMAC_Handler, the last byte is in DATA
+void expander_dma_done(void)
+{
+  SERCOM1->I2CM.INTENSET.reg = SERCOM_I2CM_INTENSET_MB;
+}
+
+void SERCOM1_Handler(void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq(); // exp_next is shared with relay_update_mask
+  uint8_t flags = SERCOM1->I2CM.INTFLAG.reg;
+  SERCOM1->I2CM.INTENCLR.reg = SERCOM_I2CM_INTENCLR_MB | SERCOM_I2CM_INTENCLR_ERROR;
+  if (exp_busy >= 0 && (flags & (SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_ERROR)))
+  {
+    uint8_t n = (uint8_t)exp_busy;
+    dma_channel_stop(DMA_CH_EXP);
+    if ((flags & SERCOM_I2CM_INTFLAG_ERROR) || SERCOM1->I2CM.STATUS.bit.RXNACK)
+    {
+      exp_failed   |= (uint8_t)(1u << n); // exp_sent stays, so it is sent again with the next change
+      exp_dir_done &= (uint8_t)~(1u << n);
+      SERCOM1->I2CM.CTRLB.reg |= SERCOM_I2CM_CTRLB_CMD(3); // STOP
+      SERCOM1->I2CM.STATUS.reg = SERCOM_I2CM_STATUS_BUSERR | SERCOM_I2CM_STATUS_ARBLOST;
+      SERCOM1->I2CM.INTFLAG.reg = SERCOM_I2CM_INTFLAG_ERROR;
+      exp_sync();
+    }
+    else
+    {
+      exp_failed &= (uint8_t)~(1u << n);
+    }
+    exp_next();
+  }
+  __set_PRIMASK(primask);
+}
+
+#endif
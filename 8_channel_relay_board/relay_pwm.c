@@ -0,0 +1,237 @@
+#define ACTIVE_LEVEL     0
+// { channel, PA pin, TCC, WO output, PMUX function }
+// RELAY1 PA10 TCC0/WO[2] (F), RELAY2 PA09 TCC0/WO[1] (E), RELAY3 PA11 TCC0/WO[3] (F), RELAY4 PA07 TCC1/WO[1] (E)
+// RELAY5 PA06 TCC1/WO[0] (E), RELAY6 PA17 TCC2/WO[1] (E), RELAY7 PA16 TCC2/WO[0] (E)
+// RELAY8 PA05 only has TCC0/WO[1], which RELAY2 already uses
+#define RELAY_PWM_MAP    { { 1, 10, 0, 2, 5 }, { 2, 9, 0, 1, 4 }, { 3, 11, 0, 3, 5 }, { 4, 7, 1, 1, 4 }, { 5, 6, 1, 0, 4 }, { 6, 17, 2, 1, 4 }, { 7, 16, 2, 0, 4 } }
+
+#include "tusb.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* TCC, PORT pin multiplexer */
+
+// Relays that drive solid-state relays can be switched over from their GPIO to
+// a TCC waveform output, the PWM then runs in hardware. Channels on the same
+// TCC share its frequency. Duty updates go through the buffered CCB registers
+// and take effect at the end of the current period.
+#define PWM_TCC_COUNT     3u
+#define PWM_DEFAULT_HZ    100u
+#define PWM_CLOCK_HZ      48000000u   // GCLK0
+
+typedef struct
+{
+  uint8_t channel;  // RELAYn
+  uint8_t pin;      // PA pin number
+  uint8_t tcc;      // TCC instance
+  uint8_t wo;       // waveform output
+  uint8_t mux;      // pin multiplexer function
+} relay_pwm_map_t;
+
+static const relay_pwm_map_t relay_pwm_map[] = RELAY_PWM_MAP;
+#define RELAY_PWM_MAP_LEN (sizeof(relay_pwm_map) / sizeof(relay_pwm_map[0]))
+
+static const uint16_t pwm_prescalers[] = { 1, 2, 4, 8, 16, 64, 256, 1024 };
+
+static uint32_t pwm_freq[PWM_TCC_COUNT];
+static uint32_t pwm_per[PWM_TCC_COUNT];
+static uint8_t  pwm_presc[PWM_TCC_COUNT];
+static uint16_t pwm_duty[RELAY_PWM_MAP_LEN];   // 0.1 % units
+static uint32_t pwm_active;                    // logical mask of channels in PWM mode
+
+static Tcc * pwm_tcc(uint8_t tcc)
+{
+  switch (tcc)
+  {
+    case 0:  return TCC0;
+    case 1:  return TCC1;
+    default: return TCC2;
+  }
+}
+
+// TCC0 has four compare channels, TCC1 and TCC2 have two
+static uint8_t pwm_cc(relay_pwm_map_t const *map)
+{
+  return (uint8_t)(map->wo % (map->tcc == 0 ? 4u : 2u));
+}
+
+static uint32_t pwm_max_per(uint8_t tcc)
+{
+  return tcc == 2 ? 0xFFFFu : 0xFFFFFFu;
+}
+
+static int pwm_index(uint8_t channel)
+{
+  for (uint8_t i = 0; i < RELAY_PWM_MAP_LEN; i++)
+  {
+    if (relay_pwm_map[i].channel == channel)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static uint32_t pwm_cc_value(uint8_t tcc, uint16_t duty)
+{
+  return (uint32_t)(((uint64_t)(pwm_per[tcc] + 1u) * duty) / 1000u);
+}
+
+static void pwm_sync(Tcc *inst)
+{
+  while (inst->SYNCBUSY.reg);
+}
+
+// Pick the smallest prescaler whose period fits the counter, for the best duty resolution
+static void pwm_configure(uint8_t tcc, uint32_t hz)
+{
+  Tcc *inst = pwm_tcc(tcc);
+  uint8_t presc = 0;
+  uint32_t per;
+  while (true)
+  {
+    per = PWM_CLOCK_HZ / pwm_prescalers[presc] / hz;
+    if (per <= pwm_max_per(tcc) + 1u || presc == sizeof(pwm_prescalers)/sizeof(pwm_prescalers[0]) - 1u)
+    {
+      break;
+    }
+    presc++;
+  }
+  per = per > 1u ? per - 1u : 1u;
+  if (per > pwm_max_per(tcc))
+  {
+    per = pwm_max_per(tcc);
+  }
+
+  bool restart = (presc != pwm_presc[tcc]) || !(inst->CTRLA.reg & TCC_CTRLA_ENABLE);
+  pwm_freq[tcc]  = hz;
+  pwm_per[tcc]   = per;
+  pwm_presc[tcc] = presc;
+
+  if (restart)
+  {
+    // the prescaler is enable protected
+    inst->CTRLA.reg &= ~TCC_CTRLA_ENABLE;
+    pwm_sync(inst);
+    inst->CTRLA.reg = TCC_CTRLA_PRESCALER(presc) | TCC_CTRLA_PRESCSYNC_PRESC;
+    inst->PER.reg   = per;
+    for (uint8_t i = 0; i < RELAY_PWM_MAP_LEN; i++)
+    {
+      if (relay_pwm_map[i].tcc == tcc)
+      {
+        inst->CC[pwm_cc(&relay_pwm_map[i])].reg = pwm_cc_value(tcc, pwm_duty[i]);
+      }
+    }
+    pwm_sync(inst);
+    inst->CTRLA.reg |= TCC_CTRLA_ENABLE;
+    pwm_sync(inst);
+  }
+  else
+  {
+    // same prescaler, period and duties change together at the next update
+    inst->PERB.reg = per;
+    for (uint8_t i = 0; i < RELAY_PWM_MAP_LEN; i++)
+    {
+      if (relay_pwm_map[i].tcc == tcc)
+      {
+        inst->CCB[pwm_cc(&relay_pwm_map[i])].reg = pwm_cc_value(tcc, pwm_duty[i]);
+      }
+    }
+  }
+}
+
+void pwm_setup(void)
+{
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_TCC0_TCC1 | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN;
+  while (GCLK->STATUS.bit.SYNCBUSY);
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_TC3_TCC2 | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN;
+  while (GCLK->STATUS.bit.SYNCBUSY);
+  PM->APBCMASK.reg |= PM_APBCMASK_TCC0 | PM_APBCMASK_TCC1 | PM_APBCMASK_TCC2;
+
+  for (uint8_t tcc = 0; tcc < PWM_TCC_COUNT; tcc++)
+  {
+    Tcc *inst = pwm_tcc(tcc);
+    uint32_t drvctrl = 0;
+    for (uint8_t i = 0; i < RELAY_PWM_MAP_LEN; i++)
+    {
+      if (relay_pwm_map[i].tcc == tcc && ACTIVE_LEVEL == 0)
+      {
+        drvctrl |= TCC_DRVCTRL_INVEN0 << relay_pwm_map[i].wo; // active low relay, invert the output
+      }
+    }
+    inst->DRVCTRL.reg = drvctrl;
+    inst->WAVE.reg    = TCC_WAVE_WAVEGEN_NPWM;
+    pwm_sync(inst);
+    pwm_presc[tcc] = 0xFF; // force a restart
+    pwm_configure(tcc, PWM_DEFAULT_HZ);
+  }
+}
+
+bool relay_pwm_capable(uint8_t channel)
+{
+  return pwm_index(channel) >= 0;
+}
+
+// Duty in 0.1 % units, connects the relay pin to its TCC output
+void relay_pwm_set_duty(uint8_t channel, uint16_t duty)
+{
+  int i = pwm_index(channel);
+  if (i < 0)
+  {
+    return;
+  }
+  relay_pwm_map_t const *map = &relay_pwm_map[i];
+  pwm_duty[i] = duty;
+  pwm_tcc(map->tcc)->CCB[pwm_cc(map)].reg = pwm_cc_value(map->tcc, duty);
+  if (!(pwm_active & (1u << (channel - 1))))
+  {
+    if (map->pin & 1u)
+    {
+      PORT->Group[0].PMUX[map->pin >> 1].bit.PMUXO = map->mux;
+    }
+    else
+    {
+      PORT->Group[0].PMUX[map->pin >> 1].bit.PMUXE = map->mux;
+    }
+    PORT->Group[0].PINCFG[map->pin].bit.PMUXEN = 1;
+    pwm_active |= 1u << (channel - 1);
+  }
+}
+
+uint16_t relay_pwm_get_duty(uint8_t channel)
+{
+  int i = pwm_index(channel);
+  return (i < 0 || !(pwm_active & (1u << (channel - 1)))) ? 0 : pwm_duty[i];
+}
+
+void relay_pwm_set_freq(uint8_t channel, uint32_t hz)
+{
+  int i = pwm_index(channel);
+  if (i >= 0)
+  {
+    pwm_configure(relay_pwm_map[i].tcc, hz);
+  }
+}
+
+uint32_t relay_pwm_get_freq(uint8_t channel)
+{
+  int i = pwm_index(channel);
+  return i < 0 ? 0 : pwm_freq[relay_pwm_map[i].tcc];
+}
+
+// Hand the pins back to the GPIO OUT register
+void relay_pwm_stop(uint32_t mask)
+{
+  for (uint8_t i = 0; i < RELAY_PWM_MAP_LEN; i++)
+  {
+    uint32_t bit = 1u << (relay_pwm_map[i].channel - 1);
+    if (mask & pwm_active & bit)
+    {
+      PORT->Group[0].PINCFG[relay_pwm_map[i].pin].bit.PMUXEN = 0;
+      pwm_active &= ~bit;
+    }
+  }
+}
+
+uint32_t relay_pwm_active(void)
+{
+  return pwm_active;
+}
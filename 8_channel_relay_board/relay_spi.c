@@ -0,0 +1,147 @@
+#define SHIFT_PIN_LATCH  7              // PA07, RCLK of every register in the chain
+#define SHIFT_PIN_OE     6              // PA06, /OE of every register, pulled up on the board
+
+#include "tusb.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* SERCOM0, PORT pin multiplexer */
+
+#if BOARD_RELAY_SHIFT_CHANNELS
+
+// Relays on a chain of 74HC595 shift registers, MOSI PA10 and SCK PA11 as
+// SERCOM0 PAD2 and PAD3. Their channels are the last ones, after the
+// RELAY_PORTS and expander ones: the register next to the QT PY has the
+// first eight on QA..QH, the next register the following eight. The chain
+// has the 32 channel limit of the relay mask, chains for 64 and more
+// channels would need a wider relay state first.
+//
+// relay_update_mask only stores the new chain state. The whole chain is
+// shifted out by DMA, the last register's byte first, and once the SERCOM
+// has sent the last bit the latch pin is pulsed, so all outputs of the chain
+// change together. A change that arrives while a frame is shifted goes out
+// with the next frame. /OE keeps the outputs off from reset until the first
+// frame, the power-on state, has been latched.
+//
+// SERCOM0 runs from GCLK generator 4, 1 MHz before and after the clock
+// switch in main, so SCK is 500 kHz with BAUD = 0.
+#define SHIFT_PIN_MOSI   10u            // PA10, SERCOM0 PAD2
+#define SHIFT_PIN_SCK    11u            // PA11, SERCOM0 PAD3
+#define SHIFT_BYTES      ((BOARD_RELAY_SHIFT_CHANNELS + 7u) / 8u)
+TU_VERIFY_STATIC(SHIFT_PINS == PA_MASK(SHIFT_PIN_MOSI, SHIFT_PIN_SCK, SHIFT_PIN_OE, SHIFT_PIN_LATCH),
+                 "SHIFT_PINS in usbtmc_app.h is not the chain's pins");
+
+static uint8_t           shift_buf[SHIFT_BYTES];
+static volatile uint32_t shift_want;    // chain channels, bit 0 = QA of the first register
+static uint32_t          shift_sent;
+static uint8_t           shift_len = SHIFT_BYTES; // registers in the chain, SYST:CHAN:COUN
+static bool              shift_busy;
+static bool              shift_stale = true; // shift_sent is not what the chain holds
+static bool              shift_enabled; // /OE released
+
+static void shift_sync(void)
+{
+  while (SERCOM0->SPI.SYNCBUSY.reg);
+}
+
+void shift_setup(void)
+{
+  PORT->Group[0].OUTSET.reg = 1u << SHIFT_PIN_OE;       // outputs off until the first latch
+  PORT->Group[0].OUTCLR.reg = 1u << SHIFT_PIN_LATCH;
+  PORT->Group[0].DIRSET.reg = (1u << SHIFT_PIN_OE) | (1u << SHIFT_PIN_LATCH);
+
+  dma_setup();
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_SERCOM0_CORE | GCLK_CLKCTRL_GEN_GCLK4 | GCLK_CLKCTRL_CLKEN;
+  while (GCLK->STATUS.bit.SYNCBUSY);
+  PM->APBCMASK.reg |= PM_APBCMASK_SERCOM0;
+
+  PORT->Group[0].PMUX[SHIFT_PIN_MOSI >> 1].reg = PORT_PMUX_PMUXE_C | PORT_PMUX_PMUXO_C;
+  PORT->Group[0].PINCFG[SHIFT_PIN_MOSI].reg    = PORT_PINCFG_PMUXEN;
+  PORT->Group[0].PINCFG[SHIFT_PIN_SCK].reg     = PORT_PINCFG_PMUXEN;
+
+  SERCOM0->SPI.CTRLA.reg = SERCOM_SPI_CTRLA_MODE_SPI_MASTER | SERCOM_SPI_CTRLA_DOPO(1); // DO PAD2, SCK PAD3, MSB first
+  SERCOM0->SPI.CTRLB.reg = 0;           // transmit only
+  SERCOM0->SPI.BAUD.reg  = 0;
+  SERCOM0->SPI.CTRLA.reg |= SERCOM_SPI_CTRLA_ENABLE;
+  shift_sync();
+
+  NVIC_SetPriority(SERCOM0_IRQn, 2); // like the DMA, below the relay edges
+  NVIC_EnableIRQ(SERCOM0_IRQn);
+}
+
+// Shifts the chain state out, the register furthest from the QT PY first.
+// Called with interrupts disabled.
+static void shift_start(uint32_t mask)
+{
+  for (uint8_t i = 0; i < shift_len; i++)
+  {
+    shift_buf[i] = (uint8_t)(mask >> (8u * (shift_len - 1u - i)));
+  }
+  shift_sent  = mask;
+  shift_stale = false;
+  shift_busy  = true;
+
+  DmacDescriptor *desc = dma_descriptor(DMA_CH_SHIFT);
+  desc->BTCTRL.reg   = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | DMAC_BTCTRL_SRCINC |
+                       DMAC_BTCTRL_BLOCKACT_INT;
+  desc->BTCNT.reg    = shift_len;
+  desc->SRCADDR.reg  = (uint32_t)(uintptr_t)&shift_buf[shift_len]; // end address when incrementing
+  desc->DSTADDR.reg  = (uint32_t)(uintptr_t)&SERCOM0->SPI.DATA.reg;
+  desc->DESCADDR.reg = 0;
+  dma_channel_start(DMA_CH_SHIFT, DMAC_CHCTRLB_TRIGSRC(SERCOM0_DMAC_ID_TX) | DMAC_CHCTRLB_TRIGACT_BEAT);
+}
+
+// Called from relay_update_mask with interrupts disabled
+void shift_write(uint32_t mask)
+{
+  shift_want = mask;
+  if (!shift_busy && shift_len && (shift_stale || mask != shift_sent))
+  {
+    shift_start(mask);
+  }
+}
+
+// SYST:CHAN:COUN, channels fitted on the chain. The next frame has the new
+// length, it is sent right away once the power-on state is out.
+void shift_set_channels(uint8_t channels)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  shift_len   = (uint8_t)((channels + 7u) / 8u);
+  shift_stale = true;
+  if (shift_len && !shift_busy && shift_enabled)
+  {
+    shift_start(shift_want);
+  }
+  __set_PRIMASK(primask);
+}
+
+// DMAC_Handler, the last byte is in DATA, TXC follows once it is sent
+void shift_dma_done(void)
+{
+  SERCOM0->SPI.INTENSET.reg = SERCOM_SPI_INTENSET_TXC;
+}
+
+void SERCOM0_Handler(void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq(); // shift_start is shared with relay_update_mask
+  if (SERCOM0->SPI.INTFLAG.reg & SERCOM_SPI_INTFLAG_TXC)
+  {
+    SERCOM0->SPI.INTENCLR.reg = SERCOM_SPI_INTENCLR_TXC;
+    SERCOM0->SPI.INTFLAG.reg  = SERCOM_SPI_INTFLAG_TXC;
+    PORT->Group[0].OUTSET.reg = 1u << SHIFT_PIN_LATCH; // 20 ns at least, two bus writes are more
+    PORT->Group[0].OUTCLR.reg = 1u << SHIFT_PIN_LATCH;
+    if (!shift_enabled)
+    {
+      PORT->Group[0].OUTCLR.reg = 1u << SHIFT_PIN_OE;
+      shift_enabled = true;
+    }
+    shift_busy = false;
+    if (shift_len && (shift_stale || shift_want != shift_sent))
+    {
+      shift_start(shift_want);
+    }
+  }
+  __set_PRIMASK(primask);
+}
+
+#endif
@@ -0,0 +1,317 @@
+#include "tusb.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* TC4/TC5, GCLK, USB frame interrupt */
+
+// TC4+TC5 run as one free-running 32-bit counter clocked at 1 MHz, it is the
+// microsecond timebase for the firmware. CC0 is the deadline of the next
+// scheduled relay edge (pulse return edges, staggered switch-on steps).
+#define TIMER_GCLK_GEN    4u
+#define EDGE_SLOTS        64u    // an on and an off edge per channel
+#define SOF_LOCK_FRAMES   16u    // SOFs in a row before the frame timebase is used
+#define SOF_LOST_US       3000u  // no SOF for this long, suspended or unplugged
+#define SOF_LEAK_SHIFT    4u     // a late SOF moves the frame start by 1/16 of its delay
+
+typedef struct
+{
+  uint32_t clear;     // channels to turn off at the deadline
+  uint32_t set;       // channels to turn on at the deadline
+  uint32_t deadline;  // timer_us() value of the edge
+  uint8_t  cause;     // TRACE_*, recorded with the transition
+} edge_slot_t;
+
+static edge_slot_t       edge_slots[EDGE_SLOTS];
+static volatile uint32_t edge_pending;     // union of all slot masks
+static volatile uint32_t edge_pending_set; // union of all slot set masks
+static volatile uint32_t sof_us;          // timer_us() estimate of the start of sof_frame
+static volatile uint32_t sof_last;        // timer_us() of the last SOF callback
+static volatile uint16_t sof_frame;       // USB frame number of the last SOF
+static volatile uint8_t  sof_seen;        // SOFs in a row, up to SOF_LOCK_FRAMES
+static uint32_t          boot_us[BOOT_PHASES];
+static uint8_t           boot_marked;   // bit per phase
+
+static void timer_arm_next(void);
+
+// Runs first thing in main, before board_init. The CPU is still on OSC8M, its
+// /8 prescaler is dropped so the rest of early boot runs at 8 MHz, and the
+// timebase counts from OSC8M / 8 until timer_clock_dfll.
+void timer_setup(void)
+{
+  SYSCTRL->OSC8M.bit.PRESC = 0;
+  GCLK->GENDIV.reg  = GCLK_GENDIV_ID(TIMER_GCLK_GEN) | GCLK_GENDIV_DIV(8);
+  GCLK->GENCTRL.reg = GCLK_GENCTRL_ID(TIMER_GCLK_GEN) | GCLK_GENCTRL_SRC_OSC8M | GCLK_GENCTRL_GENEN;
+  while (GCLK->STATUS.bit.SYNCBUSY);
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_TC4_TC5 | GCLK_CLKCTRL_GEN_GCLK4 | GCLK_CLKCTRL_CLKEN;
+  PM->APBCMASK.reg |= PM_APBCMASK_TC4 | PM_APBCMASK_TC5;
+
+  TC4->COUNT32.CTRLA.reg = TC_CTRLA_MODE_COUNT32 | TC_CTRLA_WAVEGEN_NFRQ | TC_CTRLA_PRESCALER_DIV1;
+  while (TC4->COUNT32.STATUS.bit.SYNCBUSY);
+  TC4->COUNT32.READREQ.reg = TC_READREQ_RCONT | TC_READREQ_ADDR(TC_COUNT32_COUNT_OFFSET); // COUNT always readable
+  TC4->COUNT32.CTRLA.reg |= TC_CTRLA_ENABLE;
+  while (TC4->COUNT32.STATUS.bit.SYNCBUSY);
+
+  NVIC_SetPriority(TC4_IRQn, 0); // edges are time critical, above USB
+  NVIC_EnableIRQ(TC4_IRQn);
+}
+
+// After board_init, GCLK generator 4 = DFLL48M / 48 = 1 MHz, the DFLL is
+// locked to USB so pulse widths are as accurate as the host's frame clock
+void timer_clock_dfll(void)
+{
+  GCLK->GENDIV.reg  = GCLK_GENDIV_ID(TIMER_GCLK_GEN) | GCLK_GENDIV_DIV(48);
+  GCLK->GENCTRL.reg = GCLK_GENCTRL_ID(TIMER_GCLK_GEN) | GCLK_GENCTRL_SRC_DFLL48M | GCLK_GENCTRL_GENEN;
+  while (GCLK->STATUS.bit.SYNCBUSY);
+}
+
+uint32_t timer_us(void)
+{
+  return TC4->COUNT32.COUNT.reg;
+}
+
+// Input capture for the trigger input. An EVSYS event into TC4 copies COUNT
+// into CC1 in hardware, so the edge time does not depend on interrupt latency.
+void timer_capture_setup(void)
+{
+  TC4->COUNT32.EVCTRL.reg = TC_EVCTRL_TCEI | TC_EVCTRL_EVACT_OFF;
+  TC4->COUNT32.CTRLC.reg  = TC_CTRLC_CPTEN1;
+  while (TC4->COUNT32.STATUS.bit.SYNCBUSY);
+}
+
+// timer_us() value of the last captured event. CC1 needs its own read
+// request, COUNT is continuously readable again afterwards.
+uint32_t timer_capture(void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq(); // timer_us() is not valid until RCONT is back
+  TC4->COUNT32.READREQ.reg = TC_READREQ_RREQ | TC_READREQ_ADDR(TC_COUNT32_CC_OFFSET + 4u);
+  while (TC4->COUNT32.STATUS.bit.SYNCBUSY);
+  uint32_t us = TC4->COUNT32.CC[1].reg;
+  TC4->COUNT32.READREQ.reg = TC_READREQ_RCONT | TC_READREQ_ADDR(TC_COUNT32_COUNT_OFFSET);
+  while (TC4->COUNT32.STATUS.bit.SYNCBUSY);
+  __set_PRIMASK(primask);
+  return us;
+}
+
+// USB frame timebase. Every device on a host controller sees the same SOF
+// and frame number, so a frame number and a microsecond offset name the same
+// instant on all of them. The DFLL is locked to the SOF, the timer already
+// counts TIMER_FRAME_US per frame, the SOF callback only has to find the
+// phase. It runs in the USB interrupt a few microseconds after the SOF, later
+// when a higher priority interrupt was running, so a timestamp earlier than
+// predicted is taken at once and a later one only moves the estimate by a
+// fraction of its delay. The interrupt latency then mostly drops out.
+//
+// The DCD only enables the SOF interrupt when a consumer asks for it, the
+// SOF driver in usbtmc_app.c enables it on every bus reset.
+void timer_sof_enable(void)
+{
+  USB->DEVICE.INTENSET.reg = USB_DEVICE_INTENSET_SOF;
+}
+
+// SOF callback, in the USB interrupt
+void timer_sof(uint32_t frame)
+{
+  uint32_t now    = timer_us();
+  uint16_t number = (uint16_t)(frame & TIMER_FRAME_MASK);
+  if (sof_seen == 0 || now - sof_last > SOF_LOST_US)
+  {
+    sof_us   = now;
+    sof_seen = 1;
+  }
+  else
+  {
+    uint32_t predicted = sof_us + (uint32_t)((number - sof_frame) & TIMER_FRAME_MASK) * TIMER_FRAME_US;
+    int32_t  late      = (int32_t)(now - predicted);
+    sof_us = late < 0 ? now : predicted + ((uint32_t)late >> SOF_LEAK_SHIFT);
+    if (sof_seen < SOF_LOCK_FRAMES)
+    {
+      sof_seen++;
+    }
+  }
+  sof_frame = number;
+  sof_last  = now;
+}
+
+// SOFs are coming in and the frame start is settled
+bool timer_sof_locked(void)
+{
+  return sof_seen >= SOF_LOCK_FRAMES && timer_us() - sof_last <= SOF_LOST_US;
+}
+
+// SYST:TIME?, the current frame number and microseconds into the frame
+void timer_frame_now(uint16_t *frame, uint16_t *us)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t since  = timer_us() - sof_us;
+  uint16_t number = sof_frame;
+  __set_PRIMASK(primask);
+  *frame = (uint16_t)((number + since / TIMER_FRAME_US) & TIMER_FRAME_MASK);
+  *us    = (uint16_t)(since % TIMER_FRAME_US);
+}
+
+// timer_us() value of us into frame. The frame is taken as the next one with
+// that number, false when it is more than half the frame number range ahead,
+// which means it has already passed, or the instant is not in the future.
+bool timer_frame_deadline(uint16_t frame, uint16_t us, uint32_t *deadline)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t now    = timer_us();
+  uint32_t start  = sof_us;
+  uint16_t number = sof_frame;
+  __set_PRIMASK(primask);
+  uint32_t ahead = (uint32_t)((frame - number) & TIMER_FRAME_MASK);
+  if (ahead > TIMER_FRAME_MASK / 2u)
+  {
+    return false;
+  }
+  *deadline = start + ahead * TIMER_FRAME_US + us;
+  return (int32_t)(*deadline - now) > 0;
+}
+
+// Only the first mark of each phase is kept
+void boot_mark(uint8_t phase)
+{
+  if (!(boot_marked & (1u << phase)))
+  {
+    boot_us[phase] = timer_us();
+    boot_marked   |= (uint8_t)(1u << phase);
+  }
+}
+
+// Microseconds since timer_setup, 0 when the phase has not been reached
+uint32_t boot_time(uint8_t phase)
+{
+  return boot_us[phase];
+}
+
+// Apply relay_update_mask(clear, set, cause) at deadline. Callers cancel the
+// channels first, so a channel waits for at most one on and one off edge.
+void relay_schedule(uint32_t clear, uint32_t set, uint32_t deadline, uint8_t cause)
+{
+  if ((clear | set) == 0)
+  {
+    return;
+  }
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  for (uint8_t i = 0; i < EDGE_SLOTS; i++)
+  {
+    if ((edge_slots[i].clear | edge_slots[i].set) == 0)
+    {
+      edge_slots[i].clear    = clear;
+      edge_slots[i].set      = set;
+      edge_slots[i].deadline = deadline;
+      edge_slots[i].cause    = cause;
+      break;
+    }
+  }
+  edge_pending     |= clear | set;
+  edge_pending_set |= set;
+  timer_arm_next();
+  __set_PRIMASK(primask);
+}
+
+// Drop the scheduled edges of the channels in mask, they keep their current state
+void relay_schedule_cancel(uint32_t mask)
+{
+  if ((edge_pending & mask) == 0)
+  {
+    return;
+  }
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  for (uint8_t i = 0; i < EDGE_SLOTS; i++)
+  {
+    edge_slots[i].clear &= ~mask;
+    edge_slots[i].set   &= ~mask;
+  }
+  edge_pending     &= ~mask;
+  edge_pending_set &= ~mask;
+  timer_arm_next();
+  __set_PRIMASK(primask);
+}
+
+// Channels with an edge still to come
+uint32_t relay_schedule_pending(void)
+{
+  return edge_pending;
+}
+
+// Channels waiting to be turned on
+uint32_t relay_schedule_pending_set(void)
+{
+  return edge_pending_set;
+}
+
+// Whether an edge scheduled with cause is still to come
+bool relay_schedule_has(uint8_t cause)
+{
+  bool has = false;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  for (uint8_t i = 0; i < EDGE_SLOTS; i++)
+  {
+    if ((edge_slots[i].clear | edge_slots[i].set) && edge_slots[i].cause == cause)
+    {
+      has = true;
+    }
+  }
+  __set_PRIMASK(primask);
+  return has;
+}
+
+// Called with interrupts disabled. Applies the edges that are due and
+// programs CC0 with the earliest remaining deadline.
+static void timer_arm_next(void)
+{
+  uint32_t now;
+  uint32_t next;
+  bool     armed;
+
+  do
+  {
+    now   = timer_us();
+    armed = false;
+    next  = 0;
+    for (uint8_t i = 0; i < EDGE_SLOTS; i++)
+    {
+      edge_slot_t *slot = &edge_slots[i];
+      if ((slot->clear | slot->set) == 0)
+      {
+        continue;
+      }
+      if ((int32_t)(slot->deadline - now) <= 0)
+      {
+        relay_update_mask(slot->clear, slot->set, slot->cause);
+        edge_pending_set &= ~slot->set;
+        slot->clear = 0;
+        slot->set   = 0;
+      }
+      else if (!armed || (int32_t)(slot->deadline - next) < 0)
+      {
+        next  = slot->deadline;
+        armed = true;
+      }
+    }
+    edge_pending = edge_pending_set;
+    for (uint8_t i = 0; i < EDGE_SLOTS; i++)
+    {
+      edge_pending |= edge_slots[i].clear;
+    }
+    if (!armed)
+    {
+      TC4->COUNT32.INTENCLR.reg = TC_INTENCLR_MC0;
+      return;
+    }
+    TC4->COUNT32.CC[0].reg     = next;
+    TC4->COUNT32.INTFLAG.reg   = TC_INTFLAG_MC0;
+    TC4->COUNT32.INTENSET.reg  = TC_INTENSET_MC0;
+  } while ((int32_t)(next - timer_us()) <= 0); // deadline passed while programming CC0
+}
+
+void TC4_Handler(void)
+{
+  TC4->COUNT32.INTFLAG.reg = TC_INTFLAG_MC0;
+  timer_arm_next();
+}
@@ -31,39 +31,117 @@
 #define RELAY6_PORT      PORT_PA17
 #define RELAY7_PORT      PORT_PA16
 #define RELAY8_PORT      PORT_PA05
-#define IDN              "RELAY1:EN 1\nRELAY1:EN?\nhttps://github.com/charkster/relay_usbtmc"
+#define RELAY_COUNT      8
+#define RELAY_PORTS      RELAY1_PORT, RELAY2_PORT, RELAY3_PORT, RELAY4_PORT, RELAY5_PORT, RELAY6_PORT, RELAY7_PORT, RELAY8_PORT
+#define IDN              "RELAY1:EN 1, RELAY1:EN?, https://github.com/charkster/relay_usbtmc"
+#define USBTMC_CHANNELS  { RELAY_ALL_MASK, 0x0Fu, 0xF0u } // whole board, bank 1 RELAY1..4, bank 2 RELAY5..8
 #define IDN_QUERY        "*idn?"
 #define RST_CMD          "*rst"
-#define RELAY1_EN_CMD    "relay1:en "    // RELAY1:EN ON OFF 1 0
-#define RELAY1_EN_QUERY  "relay1:en?"    // RELAY1:EN?
-#define RELAY2_EN_CMD    "relay2:en "    // RELAY2:EN ON OFF 1 0
-#define RELAY2_EN_QUERY  "relay2:en?"    // RELAY2:EN?
-#define RELAY3_EN_CMD    "relay3:en "    // RELAY3:EN ON OFF 1 0
-#define RELAY3_EN_QUERY  "relay3:en?"    // RELAY3:EN?
-#define RELAY4_EN_CMD    "relay4:en "    // RELAY4:EN ON OFF 1 0
-#define RELAY4_EN_QUERY  "relay4:en?"    // RELAY4:EN?
-#define RELAY5_EN_CMD    "relay5:en "    // RELAY5:EN ON OFF 1 0
-#define RELAY5_EN_QUERY  "relay5:en?"    // RELAY5:EN?
-#define RELAY6_EN_CMD    "relay6:en "    // RELAY6:EN ON OFF 1 0
-#define RELAY6_EN_QUERY  "relay6:en?"    // RELAY6:EN?
-#define RELAY7_EN_CMD    "relay7:en "    // RELAY7:EN ON OFF 1 0
-#define RELAY7_EN_QUERY  "relay7:en?"    // RELAY7:EN?
-#define RELAY8_EN_CMD    "relay8:en "    // RELAY8:EN ON OFF 1 0
-#define RELAY8_EN_QUERY  "relay8:en?"    // RELAY8:EN?
-
-#define END_RESPONSE     "\n"            // USB488
+#define RELAY_CMD        "relay"         // RELAYn:EN ON OFF 1 0
+#define EN_CMD           ":en "
+#define EN_QUERY         ":en?"          // RELAYn:EN?
+#define PULS_CMD         ":puls "        // RELAYn:PULS <ms>, RELAY:PULS <mask>,<ms>
+#define PULS_MAX_MS      2000000u        // keeps the deadline within half the timer range
+#define MASK_CMD         ":mask "        // RELAY:MASK <mask>, bit 0 = RELAY1
+#define MASK_QUERY       ":mask?"
+#define MASK_AT_CMD      ":mask:at "     // RELAY:MASK:AT <frame>,<us>,<mask> at a USB frame instant
+#define GEN_QUERY        ":gen?"         // RELAY:GEN? relay changes since power-on
+#define POW_CMD          ":pow "         // RELAYn:POW <pull-in mA>,<hold mA>,<pull-in ms>
+#define POW_QUERY        ":pow?"
+#define POW_MAX_MA       5000u
+#define POW_MAX_MS       1000u
+#define PWM_FREQ_CMD     ":pwm:freq "    // RELAYn:PWM:FREQ <Hz>
+#define PWM_FREQ_QUERY   ":pwm:freq?"
+#define PWM_DUTY_CMD     ":pwm:duty "    // RELAYn:PWM:DUTY <percent>, 0.1 % resolution
+#define PWM_DUTY_QUERY   ":pwm:duty?"
+#define PWM_FREQ_MAX     100000u
+#define ROUT_CLOS_CMD    "rout:clos "    // ROUT:CLOS (@1,3,5:8)
+#define ROUT_CLOS_QUERY  "rout:clos? "   // ROUT:CLOS? (@list), 1 or 0 per channel
+#define ROUT_OPEN_CMD    "rout:open "    // ROUT:OPEN (@list)
+#define ROUT_GRP_CMD     "rout:grp:def " // ROUT:GRP:DEF <n>,(@list), (@) removes group n
+#define ROUT_GRP_QUERY   "rout:grp:def? " // ROUT:GRP:DEF? <n>
+#define ROUT_GROUPS      4u
+#define ESR_QUERY        "*esr?"
+#define ESE_QUERY        "*ese?"
+#define ESE_CMD          "*ese "         // *ESE <mask>
+#define SRE_QUERY        "*sre?"
+#define SRE_CMD          "*sre "         // *SRE <mask>
+#define STB_QUERY        "*stb?"
+#define CLS_CMD          "*cls"
+#define DMC_CMD          "*dmc "         // *DMC "name",#<block> of ';' separated commands
+#define PMC_CMD          "*pmc"          // *PMC removes all macros of the interface
+#define EMC_CMD          "*emc "         // *EMC 0|1, macro names are recognised
+#define EMC_QUERY        "*emc?"
+#define LMC_QUERY        "*lmc?"         // *LMC? names of the defined macros
+#define GMC_QUERY        "*gmc? "        // *GMC? "name", the macro body as a block
+#define SAV_CMD          "*sav "         // *SAV <n> relay configuration into preset n
+#define RCL_CMD          "*rcl "         // *RCL <n>
+#define SDS_CMD          "*sds "         // *SDS <n> sets preset n to the power-on defaults
+#define MEM_NST_QUERY    "mem:nst?"      // MEM:NST? number of presets
+#define MEAS_CURR_QUERY  "meas:curr? "   // MEAS:CURR? (@list) coil current in mA
+#define SENS_STAT_QUERY  "sens:stat?"    // SENS:STAT? mask of contacts that read closed
+#define SENS_VER_CMD     "sens:ver "     // SENS:VER ON|OFF, check contacts against the relay state
+#define SENS_VER_QUERY   "sens:ver?"
+#define SENS_FAIL_QUERY  "sens:ver:fail?" // mask of channels whose contact did not follow, until *CLS
+#define FETC_QUERY       "fetc?"         // FETC? newest ADC buffer as a definite length block
+#define SOUR_VOLT_CMD    "sour:volt "    // SOUR:VOLT <V> DAC output on A0, 0 to 3.3
+#define SOUR_VOLT_QUERY  "sour:volt?"
+#define SOUR_VOLT_MAX_MV 3300u
+#define WAV_DATA_CMD     "sour:wav:data " // SOUR:WAV:DATA #<block>, uint16 DAC codes 0..1023, little endian
+#define WAV_DATA_LEN     14u
+#define WAV_POIN_QUERY   "sour:wav:poin?" // samples of the loaded waveform
+#define WAV_RATE_CMD     "sour:wav:rate " // SOUR:WAV:RATE <Hz> sample rate
+#define WAV_RATE_QUERY   "sour:wav:rate?" // rate the timer makes of it
+#define WAV_RATE_MAX     350000u
+#define WAV_CONT_CMD     "sour:wav:cont " // SOUR:WAV:CONT ON|OFF, repeat or play once
+#define WAV_CONT_QUERY   "sour:wav:cont?"
+#define WAV_STAR_CMD     "sour:wav:star"  // start now
+#define WAV_ARM_CMD      "sour:wav:arm"   // start with the next relay transition
+#define WAV_STOP_CMD     "sour:wav:stop"
+#define WAV_STAT_QUERY   "sour:wav:stat?" // 0 stopped, 1 running, 2 armed
+#define INP_STAT_QUERY   "inp:stat?"     // INP:STAT? capture input levels, bit 0 = INP1
+#define INP_DATA_QUERY   "inp:data?"     // INP:DATA? captured edges as a definite length block
+#define INP_COUN_QUERY   "inp:coun?"     // INP:COUN? edges since INP:CLE, including overwritten ones
+#define INP_CLE_CMD      "inp:cle"
+#define INP_LAT_QUERY    "inp:lat? "     // INP:LAT? <n> us from the last relay transition to the next edge of INPn
+#define TRIG_SOUR_CMD    "trig:sour "    // TRIG:SOUR BUS|EXT, USB488 TRIGGER message or trigger pin
+#define TRIG_SOUR_QUERY  "trig:sour?"
+#define TRIG_SLOP_CMD    "trig:slop "    // TRIG:SLOP POS|NEG, edge of the trigger pin
+#define TRIG_SLOP_QUERY  "trig:slop?"
+#define TRIG_DEL_CMD     "trig:del "     // TRIG:DEL <us> from the trigger to the relay change
+#define TRIG_DEL_QUERY   "trig:del?"
+#define TRIG_DEL_MAX     (PULS_MAX_MS * 1000u)
+#define TRIG_MASK_CMD    "trig:mask "    // TRIG:MASK <mask>, relay state the trigger applies
+#define TRIG_MASK_QUERY  "trig:mask?"
+#define TRIG_LAT_QUERY   "trig:lat?"     // TRIG:LAT? us from the last trigger to its relay change, TRIG:DEL 0
+#define INIT_CMD         "init"          // arm for one trigger
+#define ABOR_CMD         "abor"
+#define TRAC_DATA_QUERY  "trac:data?"    // TRAC:DATA? relay transitions as a definite length block
+#define TRAC_CLE_CMD     "trac:cle"
+#define SYST_ERR_QUERY   "syst:err?"     // SYST:ERR? pops the oldest error
+#define SYST_QUE_QUERY   "syst:que?"     // SYST:QUE? command queue depth,high water mark,size
+#define SYST_BOOT_QUERY  "syst:boot?"    // SYST:BOOT? boot phase timestamps in us
+#define SYST_BUDG_CMD    "syst:pow:budg " // SYST:POW:BUDG <mA>, 0 = no limit
+#define SYST_BUDG_QUERY  "syst:pow:budg?"
+#define SYST_STEP_QUERY  "syst:pow:step?" // sub-steps used by the last relay change
+#define SYST_PON_CMD     "syst:pon:mask " // SYST:PON:MASK <mask>|LAST, relay state applied at power-on
+#define SYST_PON_QUERY   "syst:pon:mask?"
+#define SYST_CHAN_CMD    "syst:chan:coun " // SYST:CHAN:COUN <n> channels fitted, shift register chain length
+#define SYST_CHAN_QUERY  "syst:chan:coun?"
+#define SYST_TIME_QUERY  "syst:time?"    // SYST:TIME? USB frame number,us into the frame
+#define DELAY_CMD        "delay "        // delay <ms>, test aid, responses wait two times ms
+#define END_RESPONSE     "\n"            // USB488, ends every response, also the TermChar hosts ask for
 
 #include <strings.h>
-#include <stdlib.h>     /* atoi */
+#include <stdlib.h>     /* atoi, strtol */
 #include <stdio.h>      /* fprintf */
 #include "tusb.h"
+#include "device/usbd_pvt.h" /* usbd_class_driver_t */
 #include "bsp/board.h"
 #include "main.h"
+#include "usbtmc_app.h"
 #include "sam.h" /* GPIO */
 
-char * get_value(char *in_string);
-void samd21_unique_id( char * id_buff );
-
 #if (CFG_TUD_USBTMC_ENABLE_488)
 static usbtmc_response_capabilities_488_t const
 #else
@@ -80,7 +158,7 @@ tud_usbtmc_app_capabilities  =
         .supportsIndicatorPulse = 1
     },
     .bmDevCapabilities = {
-        .canEndBulkInOnTermChar = 0
+        .canEndBulkInOnTermChar = 1
     },
 
 #if (CFG_TUD_USBTMC_ENABLE_488)
@@ -94,59 +172,310 @@ tud_usbtmc_app_capabilities  =
     .bmDevCapabilities488 =
     {
       .SCPI = 1,
-      .SR1 = 0,
+      .SR1 = CFG_TUD_USBTMC_ENABLE_INT_EP, // SRQ notifications
       .RL1 = 0,
       .DT1 =0,
     }
 #endif
 };
 
+#define IEEE4882_STB_TRIG         (0x01u) // device specific, an armed trigger fired, until *CLS
+#define IEEE4882_STB_RELAY        (0x02u) // device specific, the relays changed, until RELAY:GEN? or *CLS
+#define IEEE4882_STB_EAV          (0x04u)
 #define IEEE4882_STB_QUESTIONABLE (0x08u)
 #define IEEE4882_STB_MAV          (0x10u)
 #define IEEE4882_STB_SER          (0x20u)
 #define IEEE4882_STB_SRQ          (0x40u)
 
-static volatile uint8_t status;
-
-// 0=not query, 1=queried, 2=delay,set(MAV), 3=delay 4=ready?
-// (to simulate delay)
-static volatile uint16_t queryState = 0;
-static volatile uint32_t queryDelayStart;
-static volatile uint32_t bulkInStarted;
-
-static volatile bool idnQuery;
-static volatile bool rst_cmd;
-static volatile bool relay1_en_cmd;
-static volatile bool relay1_en_query;
-static volatile bool relay2_en_cmd;
-static volatile bool relay2_en_query;
-static volatile bool relay3_en_cmd;
-static volatile bool relay3_en_query;
-static volatile bool relay4_en_cmd;
-static volatile bool relay4_en_query;
-static volatile bool relay5_en_cmd;
-static volatile bool relay5_en_query;
-static volatile bool relay6_en_cmd;
-static volatile bool relay6_en_query;
-static volatile bool relay7_en_cmd;
-static volatile bool relay7_en_query;
-static volatile bool relay8_en_cmd;
-static volatile bool relay8_en_query;
-
-static uint32_t resp_delay = 125u; // Adjustable delay, to allow for better testing
-static size_t   buffer_len;
-static size_t   buffer_tx_ix;      // for transmitting using multiple transfers
-static uint8_t  buffer[225];       // A few packets long should be enough.
-
-char relay1_en_str[2];
-char relay2_en_str[2];
-char relay3_en_str[2];
-char relay4_en_str[2];
-char relay5_en_str[2];
-char relay6_en_str[2];
-char relay7_en_str[2];
-char relay8_en_str[2];
+#define USB488_NOTIFY_SRQ         (0x81u) // bNotify1 of an SRQ on the interrupt endpoint
+
+#define IEEE4882_ESR_OPC          (0x01u)
+#define IEEE4882_ESR_QYE          (0x04u)
+#define IEEE4882_ESR_DDE          (0x08u)
+#define IEEE4882_ESR_EXE          (0x10u)
+#define IEEE4882_ESR_CME          (0x20u)
+#define IEEE4882_ESR_PON          (0x80u)
+
+#define SCPI_ERROR_NONE             (0)
+#define SCPI_ERROR_DATA_TYPE        (-104)
+#define SCPI_ERROR_UNDEFINED_HEADER (-113)
+#define SCPI_ERROR_SUFFIX_RANGE     (-114)
+#define SCPI_ERROR_BLOCK_DATA       (-161)
+#define SCPI_ERROR_MACRO_DEFINITION (-183)
+#define SCPI_ERROR_SETTINGS_CONFLICT (-221)
+#define SCPI_ERROR_DATA_OUT_OF_RANGE (-222)
+#define SCPI_ERROR_OUT_OF_MEMORY    (-225)
+#define SCPI_ERROR_HARDWARE_MISSING (-241)
+#define SCPI_ERROR_QUEUE_OVERFLOW   (-350)
+#define SCPI_ERROR_INPUT_OVERRUN    (-363)
+#define SCPI_ERROR_QUERY_INTERRUPTED (-410)
+
+// Error/event queue. Errors are pushed by cmd_execute, in the order of the
+// messages, and read by SYST:ERR?, both in usbtmc_app_task_iter. The USB
+// callbacks never push: an error they find travels through the command queue
+// as an OP_ERROR entry, and the READ_STATUS_BYTE callback only compares head
+// and tail. When full, new errors are counted as overflows and reported as
+// -350 once the queue has been drained.
+#define ERROR_QUEUE_LEN  8u             // must be a power of two
+
+// Commands decoded by tud_usbtmc_msg_data_cb and executed by usbtmc_app_task_iter
+enum
+{
+  OP_IDN_QUERY = 1,
+  OP_RST,
+  OP_RELAY_EN,
+  OP_RELAY_EN_QUERY,
+  OP_RELAY_PULS,
+  OP_RELAY_MASK,
+  OP_RELAY_MASK_QUERY,
+  OP_RELAY_MASK_AT,
+  OP_RELAY_GEN_QUERY,
+  OP_RELAY_POW,
+  OP_RELAY_POW_QUERY,
+  OP_ROUT_CLOS,
+  OP_ROUT_CLOS_QUERY,
+  OP_ROUT_OPEN,
+  OP_ROUT_GRP,
+  OP_ROUT_GRP_QUERY,
+  OP_SYST_BUDG,
+  OP_SYST_BUDG_QUERY,
+  OP_SYST_STEP_QUERY,
+  OP_SYST_TIME_QUERY,
+  OP_PWM_FREQ,
+  OP_PWM_FREQ_QUERY,
+  OP_PWM_DUTY,
+  OP_PWM_DUTY_QUERY,
+  OP_ESR_QUERY,
+  OP_ESE,
+  OP_ESE_QUERY,
+  OP_SRE,
+  OP_SRE_QUERY,
+  OP_STB_QUERY,
+  OP_CLS,
+  OP_MEAS_CURR_QUERY,
+  OP_SENS_STAT_QUERY,
+  OP_SENS_VER,
+  OP_SENS_VER_QUERY,
+  OP_SENS_FAIL_QUERY,
+  OP_FETC_QUERY,
+  OP_SOUR_VOLT,
+  OP_SOUR_VOLT_QUERY,
+  OP_WAV_DATA,
+  OP_WAV_POIN_QUERY,
+  OP_WAV_RATE,
+  OP_WAV_RATE_QUERY,
+  OP_WAV_CONT,
+  OP_WAV_CONT_QUERY,
+  OP_WAV_STAR,
+  OP_WAV_ARM,
+  OP_WAV_STOP,
+  OP_WAV_STAT_QUERY,
+  OP_INP_STAT_QUERY,
+  OP_INP_DATA_QUERY,
+  OP_INP_COUN_QUERY,
+  OP_INP_CLE,
+  OP_INP_LAT_QUERY,
+  OP_TRIG_SOUR,
+  OP_TRIG_SOUR_QUERY,
+  OP_TRIG_SLOP,
+  OP_TRIG_SLOP_QUERY,
+  OP_TRIG_DEL,
+  OP_TRIG_DEL_QUERY,
+  OP_TRIG_MASK,
+  OP_TRIG_MASK_QUERY,
+  OP_TRIG_LAT_QUERY,
+  OP_INIT,
+  OP_ABOR,
+  OP_TRAC_DATA_QUERY,
+  OP_TRAC_CLE,
+  OP_SYST_ERR_QUERY,
+  OP_SYST_QUE_QUERY,
+  OP_SYST_BOOT_QUERY,
+  OP_SYST_PON,
+  OP_SYST_PON_QUERY,
+  OP_SYST_CHAN,
+  OP_SYST_CHAN_QUERY,
+  OP_SAV,
+  OP_RCL,
+  OP_SDS,
+  OP_MEM_NST_QUERY,
+  OP_DMC,
+  OP_PMC,
+  OP_EMC,
+  OP_EMC_QUERY,
+  OP_LMC_QUERY,
+  OP_GMC_QUERY,
+  OP_MACRO,
+  OP_DELAY,
+  OP_ERROR,           // value is the error of a rejected message
+};
+
+#define MACRO_NAME_LEN   12u
+
+typedef struct
+{
+  uint8_t  op;
+  uint8_t  channel;   // 1..RELAY_COUNT, for RELAYn commands
+  int32_t  value;
+  union
+  {
+    struct
+    {
+      uint32_t mask;  // channels the command applies to
+      uint32_t arg[2];
+    };
+    char     name[MACRO_NAME_LEN]; // OP_MACRO and OP_GMC_QUERY, no terminator at full length
+  };
+} usbtmc_cmd_t;
+
+// *DMC macros are kept decoded: invoking one replays the usbtmc_cmd_t records
+// cmd_decode made of its body when it was defined, the text is only kept for
+// *GMC?. Slots and text are shared by all interfaces, each interface sees its
+// own macros. *DMC, *PMC and *EMC take effect when they are executed, and a
+// macro name is looked up when its invocation is executed, so macros change
+// in message order for the queries and invocations queued around them.
+#define MACRO_SLOTS      8u
+#define MACRO_LEN        8u             // commands per macro
+#define MACRO_TEXT_LEN   512u           // *GMC? responses of all macros
+
+typedef struct
+{
+  char         name[MACRO_NAME_LEN + 1u]; // "" while the slot is free
+  uint8_t      session;                 // index into sessions[]
+  uint8_t      len;
+  uint16_t     text_ix;                 // *GMC? response in macro_text
+  uint16_t     text_len;
+  usbtmc_cmd_t cmds[MACRO_LEN];
+} macro_t;
+
+static macro_t  macros[MACRO_SLOTS];
+static char     macro_text[MACRO_TEXT_LEN];
+static uint16_t macro_text_used;
+
+// Command queue, the single producer/single consumer queue between the USB
+// callbacks, which decode messages and queue errors, and usbtmc_app_task_iter,
+// which executes them. cmd_head is only written by the callbacks and cmd_tail
+// by usbtmc_app_task_iter, except for a device clear, so neither side locks.
+// When it fills up the Bulk-OUT endpoint is not re-armed, so the host is NAKed
+// until usbtmc_app_task_iter has made room.
+#define CMD_QUEUE_LEN    8u             // must be a power of two
+
+#define MSG_BUFFER_LEN   225u           // A few packets long should be enough.
+
+// One USBTMC interface. The first one sees the whole board, each bank
+// interface a subset of the channels (USBTMC_CHANNELS), numbered from 1.
+// Parser, command queue, response and status registers are kept per
+// interface, so a host process on one bank never waits for another.
+typedef struct
+{
+  usbtmc_transport_t const *io;         // driver instance that opened the interface
+  uint32_t          channels;           // physical channels, bit n-1 = RELAYn
+
+  volatile uint8_t  status;
+  volatile uint8_t  esr;                // standard event status register
+  volatile uint8_t  ese;                // standard event status enable
+  volatile uint8_t  sre;                // service request enable
+
+  volatile int16_t  error_queue[ERROR_QUEUE_LEN];
+  volatile uint8_t  error_head;         // error_push only
+  volatile uint8_t  error_tail;         // error_pop and *CLS only
+  volatile uint8_t  error_overflows;      // error_push only
+  volatile uint8_t  error_overflows_seen; // error_pop and *CLS only
+
+  usbtmc_cmd_t      cmd_queue[CMD_QUEUE_LEN];
+  volatile uint8_t  cmd_head;           // USB callbacks only
+  volatile uint8_t  cmd_tail;           // usbtmc_app_task_iter, and device clear
+  volatile uint8_t  cmd_high_water;
+  volatile bool     bus_read_stalled;
+  uint32_t          trig_seen;          // trigger_count() at the last *CLS
+  uint32_t          gen_seen;           // relay_gen at the last RELAY:GEN? or *CLS
+  bool              srq_sent;           // SRQ notified, until the summary bit drops
+  uint8_t           srq_msg[2];         // SRQ notification being sent
+  bool              macros_disabled;    // *EMC 0
+
+  // 0=idle, 1=executed, 2=delay,set(MAV), 3=delay 4=ready?
+  // (1 to 3 only with the delay test aid, resp_delay)
+  volatile uint16_t queryState;
+  volatile uint32_t queryDelayStart;
+  volatile uint32_t bulkInStarted;
+  uint8_t           bulk_in_head;       // cmd_head when the Bulk-IN request came
+
+  size_t            buffer_len;
+  uint8_t           buffer[MSG_BUFFER_LEN];
+  bool              macro_staged;       // a *DMC is queued, Bulk-OUT waits until it has run
+  macro_t           macro_def;          // its decoded commands, stored when it runs
+  char              macro_def_text[MSG_BUFFER_LEN + 1u]; // and its *GMC? response
+  bool              block_rx;           // SOUR:WAV:DATA block data goes to the DAC, not to buffer
+  bool              block_received;     // the message was a complete SOUR:WAV:DATA block
+  bool              rx_overrun;         // the message did not fit, -363 is queued
+
+  char              resp_buf[64 + 8 * RELAY_COUNT + MACRO_SLOTS * (MACRO_NAME_LEN + 3u)]; // room for ROUT:CLOS?, MEAS:CURR? and *LMC?
+  const uint8_t    *resp_ptr;           // response being sent, resp_buf, block_buf or a constant
+  size_t            resp_len;
+  size_t            resp_tx_ix;         // for transmitting using multiple transfers
+  uint8_t           block_buf[BLOCK_OUT_LEN]; // FETC?, TRAC:DATA? and INP:DATA? of this interface
+  uint32_t          fetch_seq;          // ADC buffer halves this interface has fetched
+
+  unsigned int      msgReqLen;
+  bool              termCharRequested;
+  uint8_t           termChar;
+} usbtmc_session_t;
+
+static uint32_t resp_delay = 0u; // "delay <ms>" holds back every response twice, a test aid only
+
+#define RELAY_ALL_MASK   (0xFFFFFFFFu >> (32u - RELAY_COUNT))
+static const uint32_t relay_ports[] = { RELAY_PORTS };
+#define RELAY_GPIO_COUNT (sizeof(relay_ports) / sizeof(relay_ports[0]))
+#define RELAY_FIXED_COUNT (RELAY_COUNT - BOARD_RELAY_SHIFT_CHANNELS) // all but the shift register ones
+// relay_mask, the trace, the NVM power-on state and RELAY:MASK are 32 bit
+TU_VERIFY_STATIC(RELAY_COUNT == RELAY_GPIO_COUNT + 16u * BOARD_RELAY_EXPANDERS + BOARD_RELAY_SHIFT_CHANNELS &&
+                 RELAY_COUNT <= 32u, "RELAY_COUNT is RELAY_PORTS, 16 per expander and the chain, at most 32");
+TU_VERIFY_STATIC(!(PORT_MASK(RELAY_PORTS) & BUS_PINS),
+                 "the shift register chain or the expander bus has a pin of RELAY_PORTS, move it");
+static volatile uint32_t relay_mask; // bit n-1 set when RELAYn is on
+static volatile uint32_t relay_gen;  // RELAY:GEN?, counts the changes of relay_mask
+static uint8_t  relay_channels = RELAY_COUNT;     // SYST:CHAN:COUN
+static uint32_t relay_fitted   = RELAY_ALL_MASK;  // channels below relay_channels
+static uint32_t route_groups[ROUT_GROUPS]; // exclusive groups, one closed member at a time
+
+// *SAV/*RCL presets, the whole relay configuration. They are kept in RAM, an
+// unsaved preset or one reset by *SDS holds the power-on defaults: all
+// relays off, no groups, no budget, no PWM.
+#define PRESET_SLOTS     16u
+
+typedef struct
+{
+  uint32_t mask;
+  uint32_t groups[ROUT_GROUPS];
+  uint32_t budget_ma;
+  uint16_t pull_ma[RELAY_COUNT];        // RELAYn:POW
+  uint16_t hold_ma[RELAY_COUNT];
+  uint32_t pull_us[RELAY_COUNT];
+  uint32_t pwm;                         // channels in PWM mode
+  uint16_t pwm_duty[RELAY_GPIO_COUNT];
+  uint32_t pwm_freq[RELAY_GPIO_COUNT];
+} preset_t;
+
+static preset_t presets[PRESET_SLOTS];
+
+static const uint32_t   session_channels[] = USBTMC_CHANNELS;
+#define USBTMC_SESSIONS (sizeof(session_channels) / sizeof(session_channels[0]))
+static usbtmc_session_t sessions[USBTMC_SESSIONS];
+TU_VERIFY_STATIC(USBTMC_SESSIONS == 1 + BOARD_USBTMC_BANKS,
+                 "USBTMC_CHANNELS needs an entry per bank interface");
 
+static void error_push(usbtmc_session_t *s, int16_t code);
+static int16_t error_pop(usbtmc_session_t *s);
+static bool error_pending(usbtmc_session_t const *s);
+static uint8_t status_byte(usbtmc_session_t const *s);
+static const char * error_message(int16_t code);
+static void decode_error(usbtmc_cmd_t *cmd, int16_t code);
+static void cmd_decode(usbtmc_session_t *s, char *msg, usbtmc_cmd_t *cmd);
+static void cmd_execute(usbtmc_session_t *s, usbtmc_cmd_t const *cmd);
+static bool relay_set_mask_in(uint32_t scope, uint32_t mask, uint8_t cause);
+static void relay_set_channels(uint8_t count);
+static void preset_save(preset_t *p);
+static void preset_recall(usbtmc_session_t const *s, preset_t const *p);
 
 static usbtmc_msg_dev_dep_msg_in_header_t rspMsg = {
     .bmTransferAttributes =
@@ -156,10 +485,41 @@ static usbtmc_msg_dev_dep_msg_in_header_t rspMsg = {
     }
 };
 
-void tud_usbtmc_open_cb(uint8_t interface_id)
+// TinyUSB's own USBTMC driver, it serves whichever USBTMC interface the bank
+// drivers (usbtmc_bank.h) leave to it
+static usbtmc_transport_t const usbtmc_io =
+{
+  .start_bus_read = tud_usbtmc_start_bus_read,
+  .transmit       = tud_usbtmc_transmit_dev_msg_data,
+#if CFG_TUD_USBTMC_ENABLE_INT_EP
+  .notify         = tud_usbtmc_transmit_notification_data,
+#endif
+};
+
+// Session of the interface a driver instance opened
+static usbtmc_session_t * session_of(usbtmc_transport_t const *io)
+{
+  for(uint8_t i = 0; i < USBTMC_SESSIONS; i++)
+  {
+    if(sessions[i].io == io)
+    {
+      return &sessions[i];
+    }
+  }
+  return &sessions[0];
+}
+
+void usbtmc_app_open(usbtmc_transport_t const *io, uint8_t interface_id)
 {
-  (void)interface_id;
-  tud_usbtmc_start_bus_read();
+  uint8_t           ix = (interface_id == ITF_NUM_USBTMC) ? 0u : (uint8_t)(interface_id - ITF_NUM_BANK1 + 1u);
+  usbtmc_session_t *s  = &sessions[ix < USBTMC_SESSIONS ? ix : 0u];
+  if(!s->io)
+  {
+    s->esr = IEEE4882_ESR_PON; // first open after power-on
+  }
+  s->io       = io;
+  s->channels = session_channels[s - sessions] & relay_fitted;
+  io->start_bus_read();
 }
 
 #if (CFG_TUD_USBTMC_ENABLE_488)
@@ -167,447 +527,281 @@ usbtmc_response_capabilities_488_t const *
 #else
 usbtmc_response_capabilities_t const *
 #endif
-tud_usbtmc_get_capabilities_cb()
+usbtmc_app_capabilities(void)
 {
   return &tud_usbtmc_app_capabilities;
 }
 
-
-bool tud_usbtmc_msg_trigger_cb(usbtmc_msg_generic_t* msg) {
+bool usbtmc_app_msg_trigger(usbtmc_transport_t const *io, usbtmc_msg_generic_t* msg) {
   (void)msg;
-  // Let trigger set the SRQ
-  status |= IEEE4882_STB_SRQ;
+  (void)io;
+  trigger_bus();
   return true;
 }
 
-bool tud_usbtmc_msgBulkOut_start_cb(usbtmc_msg_request_dev_dep_out const * msgHeader)
+// Makes the entry at cmd_head visible to usbtmc_app_task_iter. True when the
+// queue is now full, the Bulk-OUT endpoint is then not re-armed until
+// usbtmc_app_task_iter has made room.
+static bool cmd_publish(usbtmc_session_t *s)
 {
-  (void)msgHeader;
-  buffer_len = 0;
-  if(msgHeader->TransferSize > sizeof(buffer))
+  uint8_t head  = ++s->cmd_head; // after the entry is written
+  uint8_t depth = (uint8_t)(head - s->cmd_tail);
+  if(depth > s->cmd_high_water)
   {
-
-    return false;
+    s->cmd_high_water = depth;
   }
-  return true;
+  if(depth == CMD_QUEUE_LEN)
+  {
+    s->bus_read_stalled = true; // re-armed by usbtmc_app_task_iter
+    return true;
+  }
+  return false;
 }
 
-bool tud_usbtmc_msg_data_cb(void *data, size_t len, bool transfer_complete)
+// Queues an error found before the message could be decoded. The endpoint
+// is only armed while the queue has room, so there is room for it.
+static void cmd_queue_error(usbtmc_session_t *s, int16_t code)
 {
-  // If transfer isn't finished, we just ignore it (for now)
+  decode_error(&s->cmd_queue[s->cmd_head & (CMD_QUEUE_LEN - 1u)], code);
+  cmd_publish(s);
+}
 
-  if(len + buffer_len < sizeof(buffer))
-  {
-    memcpy(&(buffer[buffer_len]), data, len);
-    buffer_len += len;
-  }
-  else
+bool usbtmc_app_msgBulkOut_start(usbtmc_transport_t const *io, usbtmc_msg_request_dev_dep_out const * msgHeader)
+{
+  usbtmc_session_t *s = session_of(io);
+  s->buffer_len     = 0;
+  s->block_rx       = false;
+  s->block_received = false;
+  s->rx_overrun     = false;
+  if(msgHeader->TransferSize > sizeof(s->buffer) + 2u * DAC_WAVE_LEN)
   {
-    return false; // buffer overflow!
+    cmd_queue_error(s, SCPI_ERROR_INPUT_OVERRUN);
+    return false;
   }
+  return true;
+}
 
-  queryState      = transfer_complete;
-  idnQuery        = false;
-  rst_cmd         = false;
-  relay1_en_cmd   = false;
-  relay1_en_query = false;
-  relay2_en_cmd   = false;
-  relay2_en_query = false;
-  relay3_en_cmd   = false;
-  relay3_en_query = false;
-  relay4_en_cmd   = false;
-  relay4_en_query = false;
-  relay5_en_cmd   = false;
-  relay5_en_query = false;
-  relay6_en_cmd   = false;
-  relay6_en_query = false;
-  relay7_en_cmd   = false;
-  relay7_en_query = false;
-  relay8_en_cmd   = false;
-  relay8_en_query = false;
-
-  if(transfer_complete && (len >=4) && !strncasecmp(IDN_QUERY,data,5))
-  {
-    idnQuery = true;
-  }
-  else if (transfer_complete && (len >=4) && !strncasecmp(RST_CMD,data,4))
-  {
-    rst_cmd = true;
-    DAC->DATA.reg = 0x0000;                // clear DAC value
-    PORT->Group[0].DIRSET.reg = RELAY1_PORT |  RELAY2_PORT | RELAY3_PORT | RELAY4_PORT | RELAY5_PORT | RELAY6_PORT | RELAY7_PORT | RELAY8_PORT; // as output
-    if ( ACTIVE_LEVEL == 1)
-    {
-      PORT->Group[0].OUTCLR.reg = RELAY1_PORT |  RELAY2_PORT | RELAY3_PORT | RELAY4_PORT | RELAY5_PORT | RELAY6_PORT | RELAY7_PORT | RELAY8_PORT; // drive low values
-    }
-    else
-    {
-      PORT->Group[0].OUTSET.reg = RELAY1_PORT |  RELAY2_PORT | RELAY3_PORT | RELAY4_PORT | RELAY5_PORT | RELAY6_PORT | RELAY7_PORT | RELAY8_PORT; // drive high values
-    }
-  }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY1_EN_CMD,data,10))
-  {
-    relay1_en_cmd = true;
-    char *ptr_value = get_value(data);
-    int relay1_en = atoi(ptr_value);
-    if ((relay1_en == 1 && ACTIVE_LEVEL == 1) || (relay1_en == 0 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTSET.reg = RELAY1_PORT; // drive high value
-    }
-    else if ((relay1_en == 0 && ACTIVE_LEVEL == 1) || ( relay1_en == 1 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTCLR.reg = RELAY1_PORT; // drive low value
-    }
-  }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY1_EN_QUERY,data,10))
-  {
-    relay1_en_query = true;
-    if ((PORT->Group[0].DIR.reg & RELAY1_PORT) && ((((PORT->Group[0].OUT.reg & RELAY1_PORT) && ACTIVE_LEVEL == 1)) || ((!(PORT->Group[0].OUT.reg & RELAY1_PORT) && ACTIVE_LEVEL == 0))))
-    {
-      strcpy(relay1_en_str,"1");
-    }
-    else
-    {
-      strcpy(relay1_en_str,"0");
-    }
-  }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY2_EN_CMD,data,10))
-  {
-    relay2_en_cmd = true;
-    char *ptr_value = get_value(data);
-    int relay2_en = atoi(ptr_value);
-    if ((relay2_en == 1 && ACTIVE_LEVEL == 1) || (relay2_en == 0 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTSET.reg =  RELAY2_PORT; // drive high value
-    }
-    else if ((relay2_en == 0 && ACTIVE_LEVEL == 1) || ( relay2_en == 1 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTCLR.reg =  RELAY2_PORT; // drive low value
-    }
-  }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY2_EN_QUERY,data,10))
-  {
-    relay2_en_query = true;
-    if ((PORT->Group[0].DIR.reg & RELAY2_PORT) && ((((PORT->Group[0].OUT.reg & RELAY2_PORT) && ACTIVE_LEVEL == 1)) || ((!(PORT->Group[0].OUT.reg & RELAY2_PORT) && ACTIVE_LEVEL == 0))))
-    {
-      strcpy(relay2_en_str,"1");
-    }
-    else
-    {
-      strcpy(relay2_en_str,"0");
-    }
-  }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY3_EN_CMD,data,10))
-  {
-    relay3_en_cmd = true;
-    char *ptr_value = get_value(data);
-    int relay3_en = atoi(ptr_value);
-    if ((relay3_en == 1 && ACTIVE_LEVEL == 1) || (relay3_en == 0 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTSET.reg = RELAY3_PORT; // drive high value
-    }
-    else if ((relay3_en == 0 && ACTIVE_LEVEL == 1) || ( relay3_en == 1 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTCLR.reg = RELAY3_PORT; // drive low value
-    }
-  }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY3_EN_QUERY,data,10))
-  {
-    relay3_en_query = true;
-    if ((PORT->Group[0].DIR.reg & RELAY3_PORT) && ((((PORT->Group[0].OUT.reg & RELAY3_PORT) && ACTIVE_LEVEL == 1)) || ((!(PORT->Group[0].OUT.reg & RELAY3_PORT) && ACTIVE_LEVEL == 0))))
-    {
-      strcpy(relay3_en_str,"1");
-    }
-    else
-    {
-      strcpy(relay3_en_str,"0");
-    }
-  }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY4_EN_CMD,data,10))
-  {
-    relay4_en_cmd = true;
-    char *ptr_value = get_value(data);
-    int relay4_en = atoi(ptr_value);
-    if ((relay4_en == 1 && ACTIVE_LEVEL == 1) || (relay4_en == 0 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTSET.reg =  RELAY4_PORT; // drive high value
-    }
-    else if ((relay4_en == 0 && ACTIVE_LEVEL == 1) || ( relay4_en == 1 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTCLR.reg =  RELAY4_PORT; // drive low value
-    }
-  }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY4_EN_QUERY,data,10))
+// SOUR:WAV:DATA #<digits><length><data>. Once the header is in the buffer the
+// data is passed to the DAC as it arrives, the buffer keeps the header only.
+static void block_rx_start(usbtmc_session_t *s)
+{
+  char const *hdr = (char const *)&s->buffer[WAV_DATA_LEN];
+  if(s->buffer_len < WAV_DATA_LEN + 2u || strncasecmp(WAV_DATA_CMD, (char const *)s->buffer, WAV_DATA_LEN) ||
+     hdr[0] != '#' || hdr[1] < '1' || hdr[1] > '9')
   {
-    relay4_en_query = true;
-    if ((PORT->Group[0].DIR.reg & RELAY4_PORT) && ((((PORT->Group[0].OUT.reg & RELAY4_PORT) && ACTIVE_LEVEL == 1)) || ((!(PORT->Group[0].OUT.reg & RELAY4_PORT) && ACTIVE_LEVEL == 0))))
-    {
-      strcpy(relay4_en_str,"1");
-    }
-    else
-    {
-      strcpy(relay4_en_str,"0");
-    }
+    return;
   }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY5_EN_CMD,data,10))
+  size_t   data_ix = WAV_DATA_LEN + 2u + (size_t)(hdr[1] - '0');
+  uint32_t length  = 0;
+  if(s->buffer_len < data_ix)
   {
-    relay5_en_cmd = true;
-    char *ptr_value = get_value(data);
-    int relay5_en = atoi(ptr_value);
-    if ((relay5_en == 1 && ACTIVE_LEVEL == 1) || (relay5_en == 0 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTSET.reg = RELAY5_PORT; // drive high value
-    }
-    else if ((relay5_en == 0 && ACTIVE_LEVEL == 1) || ( relay5_en == 1 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTCLR.reg = RELAY5_PORT; // drive low value
-    }
+    return; // length digits still to come
   }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY5_EN_QUERY,data,10))
+  for(size_t i = WAV_DATA_LEN + 2u; i < data_ix; i++)
   {
-    relay5_en_query = true;
-    if ((PORT->Group[0].DIR.reg & RELAY5_PORT) && ((((PORT->Group[0].OUT.reg & RELAY5_PORT) && ACTIVE_LEVEL == 1)) || ((!(PORT->Group[0].OUT.reg & RELAY5_PORT) && ACTIVE_LEVEL == 0))))
+    if(s->buffer[i] < '0' || s->buffer[i] > '9')
     {
-      strcpy(relay5_en_str,"1");
-    }
-    else
-    {
-      strcpy(relay5_en_str,"0");
+      return; // not a block, cmd_decode reports it
     }
+    length = length * 10u + (uint32_t)(s->buffer[i] - '0');
   }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY6_EN_CMD,data,10))
+  dac_wave_begin(length);
+  dac_wave_rx(&s->buffer[data_ix], s->buffer_len - data_ix);
+  s->buffer_len = data_ix;
+  s->buffer[s->buffer_len] = '\0';
+  s->block_rx = true;
+}
+
+// Only decodes and queues the command, it is executed by usbtmc_app_task_iter
+bool usbtmc_app_msg_data(usbtmc_transport_t const *io, void *data, size_t len, bool transfer_complete)
+{
+  usbtmc_session_t *s = session_of(io);
+  if(s->rx_overrun)
   {
-    relay6_en_cmd = true;
-    char *ptr_value = get_value(data);
-    int relay6_en = atoi(ptr_value);
-    if ((relay6_en == 1 && ACTIVE_LEVEL == 1) || (relay6_en == 0 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTSET.reg =  RELAY6_PORT; // drive high value
-    }
-    else if ((relay6_en == 0 && ACTIVE_LEVEL == 1) || ( relay6_en == 1 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTCLR.reg =  RELAY6_PORT; // drive low value
-    }
+    // the rest of a message that did not fit, its error is queued
   }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY6_EN_QUERY,data,10))
+  else if(s->block_rx)
   {
-    relay6_en_query = true;
-    if ((PORT->Group[0].DIR.reg & RELAY6_PORT) && ((((PORT->Group[0].OUT.reg & RELAY6_PORT) && ACTIVE_LEVEL == 1)) || ((!(PORT->Group[0].OUT.reg & RELAY6_PORT) && ACTIVE_LEVEL == 0))))
-    {
-      strcpy(relay6_en_str,"1");
-    }
-    else
-    {
-      strcpy(relay6_en_str,"0");
-    }
+    dac_wave_rx(data, len);
   }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY7_EN_CMD,data,10))
+  else if(len + s->buffer_len < sizeof(s->buffer))
   {
-    relay7_en_cmd = true;
-    char *ptr_value = get_value(data);
-    int relay7_en = atoi(ptr_value);
-    if ((relay7_en == 1 && ACTIVE_LEVEL == 1) || (relay7_en == 0 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTSET.reg = RELAY7_PORT; // drive high value
-    }
-    else if ((relay7_en == 0 && ACTIVE_LEVEL == 1) || ( relay7_en == 1 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTCLR.reg = RELAY7_PORT; // drive low value
-    }
+    memcpy(&(s->buffer[s->buffer_len]), data, len);
+    s->buffer_len += len;
+    s->buffer[s->buffer_len] = '\0';
+    block_rx_start(s);
   }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY7_EN_QUERY,data,10))
+  else
   {
-    relay7_en_query = true;
-    if ((PORT->Group[0].DIR.reg & RELAY7_PORT) && ((((PORT->Group[0].OUT.reg & RELAY7_PORT) && ACTIVE_LEVEL == 1)) || ((!(PORT->Group[0].OUT.reg & RELAY7_PORT) && ACTIVE_LEVEL == 0))))
-    {
-      strcpy(relay7_en_str,"1");
-    }
-    else
-    {
-      strcpy(relay7_en_str,"0");
-    }
+    cmd_queue_error(s, SCPI_ERROR_INPUT_OVERRUN);
+    s->rx_overrun = true;
+    return false; // buffer overflow!
   }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY8_EN_CMD,data,10))
+
+  if(transfer_complete && s->rx_overrun)
   {
-    relay8_en_cmd = true;
-    char *ptr_value = get_value(data);
-    int relay8_en = atoi(ptr_value);
-    if ((relay8_en == 1 && ACTIVE_LEVEL == 1) || ( relay8_en == 0 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTSET.reg =  RELAY8_PORT; // drive high value
-    }
-    else if ((relay8_en == 0 && ACTIVE_LEVEL == 1) || ( relay8_en == 1 && ACTIVE_LEVEL == 0))
-    {
-      PORT->Group[0].OUTCLR.reg =  RELAY8_PORT; // drive low value
-    }
+    s->rx_overrun = false;
+    s->buffer_len = 0;
   }
-  else if (transfer_complete && (len >= 12) && !strncasecmp(RELAY8_EN_QUERY,data,10))
+  else if(transfer_complete)
   {
-    relay8_en_query = true;
-    if ((PORT->Group[0].DIR.reg & RELAY8_PORT) && ((((PORT->Group[0].OUT.reg & RELAY8_PORT) && ACTIVE_LEVEL == 1)) || ((!(PORT->Group[0].OUT.reg & RELAY8_PORT) && ACTIVE_LEVEL == 0))))
-    {
-      strcpy(relay8_en_str,"1");
-    }
-    else
+    uint8_t head = s->cmd_head;
+    s->block_received = s->block_rx;
+    s->block_rx       = false;
+    cmd_decode(s, (char *)s->buffer, &s->cmd_queue[head & (CMD_QUEUE_LEN - 1u)]);
+    s->buffer_len = 0;
+    if(cmd_publish(s) || s->macro_staged)
     {
-      strcpy(relay8_en_str,"0");
+      s->bus_read_stalled = true; // a queued *DMC holds macro_def, one at a time
+      return true;
     }
   }
-
-  if(transfer_complete && !strncasecmp("delay ",data,5))
-  {
-    queryState = 0;
-    int d = atoi((char*)data + 5);
-    if(d > 10000)
-      d = 10000;
-    if(d<0)
-      d=0;
-    resp_delay = (uint32_t)d;
-  }
-  tud_usbtmc_start_bus_read();
+  io->start_bus_read();
   return true;
 }
 
-bool tud_usbtmc_msgBulkIn_complete_cb()
+bool usbtmc_app_msgBulkIn_complete(usbtmc_transport_t const *io)
 {
-  if((buffer_tx_ix == buffer_len) || idnQuery) // done
+  usbtmc_session_t *s = session_of(io);
+  if(s->resp_tx_ix == s->resp_len) // done
   {
-    status &= (uint8_t)~(IEEE4882_STB_MAV); // clear MAV
-    queryState = 0;
-    bulkInStarted = 0;
-    buffer_tx_ix = 0;
+    s->status &= (uint8_t)~(IEEE4882_STB_MAV); // clear MAV
+    s->queryState = 0;
+    s->bulkInStarted = 0;
+    s->resp_tx_ix = 0;
   }
-  tud_usbtmc_start_bus_read();
+  io->start_bus_read();
 
   return true;
 }
 
-static unsigned int msgReqLen;
+// Send the next part of the response, at most what the host asked for. When
+// the request has TermCharEnabled the transfer also ends after the first
+// TermChar, so the host read completes there instead of at its timeout.
+static void resp_transmit(usbtmc_session_t *s)
+{
+  size_t txlen = tu_min32(s->resp_len - s->resp_tx_ix, s->msgReqLen);
+  bool   term  = false;
+  if(s->termCharRequested)
+  {
+    uint8_t const *hit = memchr(&s->resp_ptr[s->resp_tx_ix], s->termChar, txlen);
+    if(hit)
+    {
+      txlen = (size_t)(hit - &s->resp_ptr[s->resp_tx_ix]) + 1u;
+      term  = true;
+    }
+  }
+  s->io->transmit(&s->resp_ptr[s->resp_tx_ix], txlen, (s->resp_tx_ix + txlen) == s->resp_len, term);
+  s->resp_tx_ix += txlen;
+}
 
-bool tud_usbtmc_msgBulkIn_request_cb(usbtmc_msg_request_dev_dep_in const * request)
+bool usbtmc_app_msgBulkIn_request(usbtmc_transport_t const *io, usbtmc_msg_request_dev_dep_in const * request)
 {
+  usbtmc_session_t *s = session_of(io);
   rspMsg.header.MsgID = request->header.MsgID,
   rspMsg.header.bTag = request->header.bTag,
   rspMsg.header.bTagInverse = request->header.bTagInverse;
-  msgReqLen = request->TransferSize;
+  s->msgReqLen = request->TransferSize;
+  s->termCharRequested = request->bmTransferAttributes.TermCharEnabled;
+  s->termChar = request->TermChar;
 
 #ifdef xDEBUG
   uart_tx_str_sync("MSG_IN_DATA: Requested!\r\n");
 #endif
-  if(queryState == 0 || (buffer_tx_ix == 0))
+  if(s->queryState == 0 || (s->resp_tx_ix == 0))
   {
-    TU_ASSERT(bulkInStarted == 0);
-    bulkInStarted = 1;
+    TU_ASSERT(s->bulkInStarted == 0);
+    s->bulkInStarted = 1;
+    s->bulk_in_head = s->cmd_head;
 
     // > If a USBTMC interface receives a Bulk-IN request prior to receiving a USBTMC command message
     //   that expects a response, the device must NAK the request (*not stall*)
   }
   else
   {
-    size_t txlen = tu_min32(buffer_len-buffer_tx_ix,msgReqLen);
-    tud_usbtmc_transmit_dev_msg_data(&buffer[buffer_tx_ix], txlen,
-        (buffer_tx_ix+txlen) == buffer_len, false);
-    buffer_tx_ix += txlen;
+    resp_transmit(s);
   }
   // Always return true indicating not to stall the EP.
   return true;
 }
 
-void usbtmc_app_task_iter(void) {
-  switch(queryState) {
+// Frees the entry at cmd_tail, a Bulk-OUT endpoint held back by a full
+// queue is armed again
+static void cmd_consume(usbtmc_session_t *s)
+{
+  s->cmd_tail++;
+  if(s->bus_read_stalled && !s->macro_staged)
+  {
+    s->bus_read_stalled = false;
+    s->buffer_len = 0;
+    s->io->start_bus_read();
+  }
+}
+
+static void session_task(usbtmc_session_t *s) {
+  usbtmc_cmd_t const *cmd;
+  bool cmd_waiting = (s->cmd_tail != s->cmd_head);
+
+  // A rejected message is not answered. Its error is queued in message
+  // order and a response still waiting to be read stays.
+  cmd = &s->cmd_queue[s->cmd_tail & (CMD_QUEUE_LEN - 1u)];
+  if(cmd_waiting && cmd->op == OP_ERROR)
+  {
+    error_push(s, (int16_t)cmd->value);
+    cmd_consume(s);
+    return;
+  }
+
+  // A newer command replaces a response that the host has not asked for. A
+  // Bulk-IN request that came before the newer command is for this response,
+  // it is sent first. Discarding the answer of a query, more than the bare
+  // terminator, is -410.
+  bool asked = s->bulkInStarted && s->bulk_in_head == s->cmd_tail;
+  if(cmd_waiting && s->queryState != 0 && !asked && s->resp_tx_ix == 0)
+  {
+    if(s->resp_len > sizeof(END_RESPONSE) - 1u)
+    {
+      error_push(s, SCPI_ERROR_QUERY_INTERRUPTED);
+    }
+    s->status &= (uint8_t)~(IEEE4882_STB_MAV);
+    s->queryState = 0;
+  }
+
+  switch(s->queryState) {
   case 0:
+    if(!cmd_waiting)
+    {
+      break;
+    }
+    cmd_execute(s, cmd);
+    cmd_consume(s);
+    if(resp_delay)
+    {
+      s->queryState = 1;
+      break;
+    }
+    s->status |= 0x10u; // MAV, the response is ready right away
+    s->queryState = 4;
     break;
   case 1:
-    queryDelayStart = board_millis();
-    queryState = 2;
+    s->queryDelayStart = board_millis();
+    s->queryState = 2;
     break;
   case 2:
-    if( (board_millis() - queryDelayStart) > resp_delay) {
-      queryDelayStart = board_millis();
-      queryState=3;
-      status |= 0x10u; // MAV
-      status |= 0x40u; // SRQ
+    if( (board_millis() - s->queryDelayStart) > resp_delay) {
+      s->queryDelayStart = board_millis();
+      s->queryState=3;
+      s->status |= 0x10u; // MAV
     }
     break;
   case 3:
-    if( (board_millis() - queryDelayStart) > resp_delay) {
-      queryState = 4;
+    if( (board_millis() - s->queryDelayStart) > resp_delay) {
+      s->queryState = 4;
     }
     break;
   case 4: // time to transmit;
-    if(bulkInStarted && (buffer_tx_ix == 0)) {
-      if(idnQuery)
-      {
-//        char unique_id[34] = "";
-//        char idn_str[52] = IDN;
-//        samd21_unique_id(unique_id);
-//        strcat(idn_str,unique_id);
-//        tud_usbtmc_transmit_dev_msg_data(idn_str, tu_min32(sizeof(idn_str)-1,msgReqLen),true,false);
-        tud_usbtmc_transmit_dev_msg_data(IDN, tu_min32(sizeof(IDN)-1,msgReqLen),true,false);
-        queryState    = 0;
-        bulkInStarted = 0;
-      }
-      else if (relay1_en_query)
-      {
-        tud_usbtmc_transmit_dev_msg_data(relay1_en_str, tu_min32(sizeof(relay1_en_str)-1,msgReqLen),true,false);
-        queryState    = 0;
-        bulkInStarted = 0;
-      }
-      else if (relay2_en_query)
-      {
-        tud_usbtmc_transmit_dev_msg_data(relay2_en_str, tu_min32(sizeof(relay2_en_str)-1,msgReqLen),true,false);
-        queryState    = 0;
-        bulkInStarted = 0;
-      }
-      else if (relay3_en_query)
-      {
-        tud_usbtmc_transmit_dev_msg_data(relay3_en_str, tu_min32(sizeof(relay3_en_str)-1,msgReqLen),true,false);
-        queryState    = 0;
-        bulkInStarted = 0;
-      }
-      else if (relay4_en_query)
-      {
-        tud_usbtmc_transmit_dev_msg_data(relay4_en_str, tu_min32(sizeof(relay4_en_str)-1,msgReqLen),true,false);
-        queryState    = 0;
-        bulkInStarted = 0;
-      }
-
-      else if (relay5_en_query)
-      {
-        tud_usbtmc_transmit_dev_msg_data(relay5_en_str, tu_min32(sizeof(relay5_en_str)-1,msgReqLen),true,false);
-        queryState    = 0;
-        bulkInStarted = 0;
-      }
-      else if (relay6_en_query)
-      {
-        tud_usbtmc_transmit_dev_msg_data(relay6_en_str, tu_min32(sizeof(relay6_en_str)-1,msgReqLen),true,false);
-        queryState    = 0;
-        bulkInStarted = 0;
-      }
-      else if (relay7_en_query)
-      {
-        tud_usbtmc_transmit_dev_msg_data(relay7_en_str, tu_min32(sizeof(relay7_en_str)-1,msgReqLen),true,false);
-        queryState    = 0;
-        bulkInStarted = 0;
-      }
-      else if (relay8_en_query)
-      {
-        tud_usbtmc_transmit_dev_msg_data(relay8_en_str, tu_min32(sizeof(relay8_en_str)-1,msgReqLen),true,false);
-        queryState    = 0;
-        bulkInStarted = 0;
-      }
-
-      else if (rst_cmd || relay1_en_cmd || relay2_en_cmd || relay3_en_cmd || relay4_en_cmd || relay5_en_cmd || relay6_en_cmd || relay7_en_cmd || relay8_en_cmd)
-      { 
-        tud_usbtmc_transmit_dev_msg_data(END_RESPONSE, tu_min32(sizeof(END_RESPONSE)-1,msgReqLen),true,false);
-        queryState    = 0;
-        bulkInStarted = 0;
-      }
-      else
-      {
-        buffer_tx_ix = tu_min32(buffer_len,msgReqLen);
-        tud_usbtmc_transmit_dev_msg_data(buffer, buffer_tx_ix, buffer_tx_ix == buffer_len, false);
-      }
-
+    if(s->bulkInStarted && (s->resp_tx_ix == 0)) {
+      resp_transmit(s);
       // MAV is cleared in the transfer complete callback.
     }
     break;
@@ -617,73 +811,113 @@ void usbtmc_app_task_iter(void) {
   }
 }
 
-bool tud_usbtmc_initiate_clear_cb(uint8_t *tmcResult)
+// USB488 SRQ notification on the interrupt endpoint, once each time the
+// master summary bit of the status byte comes up. An endpoint still busy
+// with an earlier notification is tried again on the next pass.
+static void srq_task(usbtmc_session_t *s)
+{
+#if CFG_TUD_USBTMC_ENABLE_INT_EP
+  uint8_t stb = status_byte(s);
+  if (!(stb & IEEE4882_STB_SRQ))
+  {
+    s->srq_sent = false;
+  }
+  else if (!s->srq_sent)
+  {
+    s->srq_msg[0] = USB488_NOTIFY_SRQ;
+    s->srq_msg[1] = stb;
+    s->srq_sent   = s->io->notify(s->srq_msg, sizeof(s->srq_msg));
+  }
+#else
+  (void)s;
+#endif
+}
+
+void usbtmc_app_task_iter(void) {
+  for(uint8_t i = 0; i < USBTMC_SESSIONS; i++)
+  {
+    if(sessions[i].io)
+    {
+      session_task(&sessions[i]);
+      srq_task(&sessions[i]);
+    }
+  }
+}
+
+bool usbtmc_app_initiate_clear(usbtmc_transport_t const *io, uint8_t *tmcResult)
 {
+  usbtmc_session_t *s = session_of(io);
   *tmcResult = USBTMC_STATUS_SUCCESS;
-  queryState = 0;
-  bulkInStarted = false;
-  status = 0;
+  s->queryState = 0;
+  s->bulkInStarted = false;
+  s->status = 0;
   return true;
 }
 
-bool tud_usbtmc_check_clear_cb(usbtmc_get_clear_status_rsp_t *rsp)
+bool usbtmc_app_check_clear(usbtmc_transport_t const *io, usbtmc_get_clear_status_rsp_t *rsp)
 {
-  queryState = 0;
-  bulkInStarted = false;
-  status = 0;
-  buffer_tx_ix = 0u;
-  buffer_len = 0u;
+  usbtmc_session_t *s = session_of(io);
+  s->queryState = 0;
+  s->bulkInStarted = false;
+  s->status = 0;
+  s->resp_tx_ix = 0u;
+  s->resp_len = 0u;
+  s->buffer_len = 0u;
+  s->macro_staged = false;
+  s->cmd_tail = s->cmd_head; // device clear discards queued commands
   rsp->USBTMC_status = USBTMC_STATUS_SUCCESS;
   rsp->bmClear.BulkInFifoBytes = 0u;
+  if(s->bus_read_stalled)
+  {
+    s->bus_read_stalled = false;
+    io->start_bus_read();
+  }
   return true;
 }
-bool tud_usbtmc_initiate_abort_bulk_in_cb(uint8_t *tmcResult)
+bool usbtmc_app_initiate_abort_bulk_in(usbtmc_transport_t const *io, uint8_t *tmcResult)
 {
-  bulkInStarted = 0;
+  session_of(io)->bulkInStarted = 0;
   *tmcResult = USBTMC_STATUS_SUCCESS;
   return true;
 }
-bool tud_usbtmc_check_abort_bulk_in_cb(usbtmc_check_abort_bulk_rsp_t *rsp)
+bool usbtmc_app_check_abort_bulk_in(usbtmc_transport_t const *io, usbtmc_check_abort_bulk_rsp_t *rsp)
 {
   (void)rsp;
-  tud_usbtmc_start_bus_read();
+  io->start_bus_read();
   return true;
 }
 
-bool tud_usbtmc_initiate_abort_bulk_out_cb(uint8_t *tmcResult)
+bool usbtmc_app_initiate_abort_bulk_out(usbtmc_transport_t const *io, uint8_t *tmcResult)
 {
+  (void)io;
   *tmcResult = USBTMC_STATUS_SUCCESS;
   return true;
 
 }
-bool tud_usbtmc_check_abort_bulk_out_cb(usbtmc_check_abort_bulk_rsp_t *rsp)
+bool usbtmc_app_check_abort_bulk_out(usbtmc_transport_t const *io, usbtmc_check_abort_bulk_rsp_t *rsp)
 {
   (void)rsp;
-  tud_usbtmc_start_bus_read();
+  io->start_bus_read();
   return true;
 }
 
-void tud_usbtmc_bulkIn_clearFeature_cb(void)
+void usbtmc_app_bulkIn_clearFeature(usbtmc_transport_t const *io)
 {
+  (void)io;
 }
-void tud_usbtmc_bulkOut_clearFeature_cb(void)
+void usbtmc_app_bulkOut_clearFeature(usbtmc_transport_t const *io)
 {
-  tud_usbtmc_start_bus_read();
+  io->start_bus_read();
 }
 
-// Return status byte, but put the transfer result status code in the rspResult argument.
-uint8_t tud_usbtmc_get_stb_cb(uint8_t *tmcResult)
+// READ_STATUS_BYTE, bit 6 is the summary of the enabled bits like in *STB?
+uint8_t usbtmc_app_get_stb(usbtmc_transport_t const *io, uint8_t *tmcResult)
 {
-  uint8_t old_status = status;
-  status = (uint8_t)(status & ~(IEEE4882_STB_SRQ)); // clear SRQ
-
   *tmcResult = USBTMC_STATUS_SUCCESS;
-  // Increment status so that we see different results on each read...
-
-  return old_status;
+  return status_byte(session_of(io));
 }
 
-bool tud_usbtmc_indicator_pulse_cb(tusb_control_request_t const * msg, uint8_t *tmcResult)
+bool usbtmc_app_indicator_pulse(tusb_control_request_t const * msg, uint8_t *tmcResult)
 {
   (void)msg;
   led_indicator_pulse();
@@ -691,18 +925,2045 @@ bool tud_usbtmc_indicator_pulse_cb(tusb_control_request_t const * msg, uint8_t *
   return true;
 }
 
-//---------------------------- New Code ----------------------------//
+// Callbacks of TinyUSB's USBTMC driver, the bank drivers have their own
+// copies that pass their transport instead
+void tud_usbtmc_open_cb(uint8_t interface_id)
+{
+  usbtmc_app_open(&usbtmc_io, interface_id);
+}
 
-void gpio_setup(void) {
-  PORT->Group[0].DIRSET.reg = RELAY1_PORT | RELAY2_PORT | RELAY3_PORT | RELAY4_PORT | RELAY5_PORT | RELAY6_PORT | RELAY7_PORT | RELAY8_PORT; // as output
-  if (ACTIVE_LEVEL == 1) 
+#if (CFG_TUD_USBTMC_ENABLE_488)
+usbtmc_response_capabilities_488_t const *
+#else
+usbtmc_response_capabilities_t const *
+#endif
+tud_usbtmc_get_capabilities_cb()
+{
+  return usbtmc_app_capabilities();
+}
+
+bool tud_usbtmc_msg_trigger_cb(usbtmc_msg_generic_t* msg)
+{
+  return usbtmc_app_msg_trigger(&usbtmc_io, msg);
+}
+
+bool tud_usbtmc_msgBulkOut_start_cb(usbtmc_msg_request_dev_dep_out const * msgHeader)
+{
+  return usbtmc_app_msgBulkOut_start(&usbtmc_io, msgHeader);
+}
+
+bool tud_usbtmc_msg_data_cb(void *data, size_t len, bool transfer_complete)
+{
+  return usbtmc_app_msg_data(&usbtmc_io, data, len, transfer_complete);
+}
+
+bool tud_usbtmc_msgBulkIn_complete_cb()
+{
+  return usbtmc_app_msgBulkIn_complete(&usbtmc_io);
+}
+
+bool tud_usbtmc_msgBulkIn_request_cb(usbtmc_msg_request_dev_dep_in const * request)
+{
+  return usbtmc_app_msgBulkIn_request(&usbtmc_io, request);
+}
+
+bool tud_usbtmc_initiate_clear_cb(uint8_t *tmcResult)
+{
+  return usbtmc_app_initiate_clear(&usbtmc_io, tmcResult);
+}
+
+bool tud_usbtmc_check_clear_cb(usbtmc_get_clear_status_rsp_t *rsp)
+{
+  return usbtmc_app_check_clear(&usbtmc_io, rsp);
+}
+
+bool tud_usbtmc_initiate_abort_bulk_in_cb(uint8_t *tmcResult)
+{
+  return usbtmc_app_initiate_abort_bulk_in(&usbtmc_io, tmcResult);
+}
+
+bool tud_usbtmc_check_abort_bulk_in_cb(usbtmc_check_abort_bulk_rsp_t *rsp)
+{
+  return usbtmc_app_check_abort_bulk_in(&usbtmc_io, rsp);
+}
+
+bool tud_usbtmc_initiate_abort_bulk_out_cb(uint8_t *tmcResult)
+{
+  return usbtmc_app_initiate_abort_bulk_out(&usbtmc_io, tmcResult);
+}
+
+bool tud_usbtmc_check_abort_bulk_out_cb(usbtmc_check_abort_bulk_rsp_t *rsp)
+{
+  return usbtmc_app_check_abort_bulk_out(&usbtmc_io, rsp);
+}
+
+void tud_usbtmc_bulkIn_clearFeature_cb(void)
+{
+  usbtmc_app_bulkIn_clearFeature(&usbtmc_io);
+}
+
+void tud_usbtmc_bulkOut_clearFeature_cb(void)
+{
+  usbtmc_app_bulkOut_clearFeature(&usbtmc_io);
+}
+
+uint8_t tud_usbtmc_get_stb_cb(uint8_t *tmcResult)
+{
+  return usbtmc_app_get_stb(&usbtmc_io, tmcResult);
+}
+
+bool tud_usbtmc_indicator_pulse_cb(tusb_control_request_t const * msg, uint8_t *tmcResult)
+{
+  return usbtmc_app_indicator_pulse(msg, tmcResult);
+}
+
+#if BOARD_USBTMC_BANKS
+USBTMC_BANK_DECLARE(1)
+#if BOARD_USBTMC_BANKS > 1
+USBTMC_BANK_DECLARE(2)
+#endif
+#endif
+
+// Driver without an interface, it is only there for the SOF callback, which
+// TinyUSB calls in the USB interrupt. It keeps the frame timebase of
+// relay_timer.c in step with the host.
+static void sof_driver_init(void)
+{
+}
+
+static void sof_driver_reset(uint8_t rhport)
+{
+  (void)rhport;
+  timer_sof_enable();
+}
+
+static uint16_t sof_driver_open(uint8_t rhport, tusb_desc_interface_t const *itf_desc, uint16_t max_len)
+{
+  (void)rhport;
+  (void)itf_desc;
+  (void)max_len;
+  return 0; // claims no interface
+}
+
+static bool sof_driver_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request)
+{
+  (void)rhport;
+  (void)stage;
+  (void)request;
+  return false;
+}
+
+static bool sof_driver_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
+{
+  (void)rhport;
+  (void)ep_addr;
+  (void)result;
+  (void)xferred_bytes;
+  return false;
+}
+
+static void sof_driver_sof(uint8_t rhport, uint32_t frame_count)
+{
+  (void)rhport;
+  timer_sof(frame_count);
+}
+
+// The bank interfaces are served by copies of TinyUSB's USBTMC driver,
+// registered as application drivers. These are offered every interface
+// before the built-in drivers, so the sessions go by interface number.
+static usbd_class_driver_t const app_drivers[] =
+{
+#if BOARD_USBTMC_BANKS
+  USBTMC_BANK_DRIVER(1),
+#if BOARD_USBTMC_BANKS > 1
+  USBTMC_BANK_DRIVER(2),
+#endif
+#endif
+  {
+#if CFG_TUSB_DEBUG >= 2
+    .name             = "SOF",
+#endif
+    .init             = sof_driver_init,
+    .reset            = sof_driver_reset,
+    .open             = sof_driver_open,
+    .control_xfer_cb  = sof_driver_control_xfer_cb,
+    .xfer_cb          = sof_driver_xfer_cb,
+    .sof              = sof_driver_sof
+  },
+};
+
+usbd_class_driver_t const * usbd_app_driver_get_cb(uint8_t *driver_count)
+{
+  *driver_count = (uint8_t)(sizeof(app_drivers) / sizeof(app_drivers[0]));
+  return app_drivers;
+}
+
+//---------------------------- New Code ----------------------------//
+
+// Parse "1"/"0"/"ON"/"OFF" into value, false if it is none of them
+static bool parse_bool(char const *str, int32_t *value)
+{
+  if (!strcasecmp(str,"1") || !strcasecmp(str,"on"))
+  {
+    *value = 1;
+  }
+  else if (!strcasecmp(str,"0") || !strcasecmp(str,"off"))
+  {
+    *value = 0;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+// Session channel n (bit n-1) to physical channels and back
+static uint32_t session_to_phys(usbtmc_session_t const *s, uint32_t mask)
+{
+  uint32_t phys = 0;
+  for (uint8_t i = 0; i < RELAY_COUNT && mask; i++)
+  {
+    if (s->channels & (1u << i))
+    {
+      phys |= (mask & 1u) << i;
+      mask >>= 1;
+    }
+  }
+  return phys;
+}
+
+static uint32_t session_from_phys(usbtmc_session_t const *s, uint32_t phys)
+{
+  uint32_t mask = 0;
+  uint8_t  n    = 0;
+  for (uint8_t i = 0; i < RELAY_COUNT; i++)
+  {
+    if (s->channels & (1u << i))
+    {
+      mask |= ((phys >> i) & 1u) << n++;
+    }
+  }
+  return mask;
+}
+
+static uint8_t session_count(usbtmc_session_t const *s)
+{
+  uint8_t n = 0;
+  for (uint32_t ch = s->channels; ch; ch &= ch - 1u)
+  {
+    n++;
+  }
+  return n;
+}
+
+// Parse a mask of session channels as decimal, 0x.., #H.. or #B.., the
+// result is physical
+static bool parse_mask(usbtmc_session_t const *s, char const *str, char **end, uint32_t *mask)
+{
+  int base = 0;
+  if (str[0] == '#' && (str[1] == 'h' || str[1] == 'H'))
+  {
+    base = 16;
+    str += 2;
+  }
+  else if (str[0] == '#' && (str[1] == 'b' || str[1] == 'B'))
+  {
+    base = 2;
+    str += 2;
+  }
+  unsigned long value = strtoul(str, end, base);
+  uint8_t       count = session_count(s);
+  if (*end == str || (count < 32u && (value >> count)))
+  {
+    return false;
+  }
+  *mask = session_to_phys(s, (uint32_t)value);
+  return true;
+}
+
+// Parse a decimal number scaled by 10^decimals, "12.5" with 1 decimal is 125.
+// Extra digits are truncated. max is for the integer part.
+static bool parse_fixed(char const *str, uint8_t decimals, uint32_t max, uint32_t *value)
+{
+  char *end;
+  unsigned long whole = strtoul(str, &end, 10);
+  uint32_t frac  = 0;
+  uint32_t scale = 1;
+  if (end == str || whole > max)
+  {
+    return false;
+  }
+  for (uint8_t i = 0; i < decimals; i++)
+  {
+    scale *= 10u;
+  }
+  if (*end == '.')
+  {
+    uint32_t digit = scale / 10u;
+    for (end++; *end >= '0' && *end <= '9'; end++)
+    {
+      frac += (uint32_t)(*end - '0') * digit;
+      digit /= 10u;
+    }
+  }
+  if (*end != '\0')
+  {
+    return false;
+  }
+  *value = (uint32_t)whole * scale + frac;
+  return true;
+}
+
+// Parse milliseconds with up to three decimals into microseconds
+static bool parse_ms_to_us(char const *str, uint32_t *us)
+{
+  return parse_fixed(str, 3, PULS_MAX_MS, us) && *us > 0;
+}
+
+// Parse a SCPI channel list "(@1,3,5:8)" of session channels into a
+// physical mask. Ranges may run downwards, "(@)" is the empty list.
+static bool parse_channel_list(usbtmc_session_t const *s, char const *str, char **end, uint32_t *mask)
+{
+  uint32_t list = 0;
+  while (*str == ' ') str++;
+  if (str[0] != '(' || str[1] != '@')
+  {
+    return false;
+  }
+  str += 2;
+  while (*str == ' ') str++;
+  while (*str != ')')
+  {
+    char *num_end;
+    unsigned long first = strtoul(str, &num_end, 10);
+    unsigned long last  = first;
+    if (num_end == str)
+    {
+      return false;
+    }
+    str = num_end;
+    if (*str == ':')
+    {
+      last = strtoul(str + 1, &num_end, 10);
+      if (num_end == str + 1)
+      {
+        return false;
+      }
+      str = num_end;
+    }
+    if (first > last)
+    {
+      unsigned long swap = first;
+      first = last;
+      last  = swap;
+    }
+    if (first < 1 || last > session_count(s))
+    {
+      return false;
+    }
+    for (unsigned long ch = first; ch <= last; ch++)
+    {
+      list |= 1u << (ch - 1);
+    }
+    while (*str == ' ') str++;
+    if (*str == ',')
+    {
+      str++;
+      while (*str == ' ') str++;
+    }
+    else if (*str != ')')
+    {
+      return false;
+    }
+  }
+  *end  = (char *)str + 1;
+  *mask = session_to_phys(s, list);
+  return true;
+}
+
+// Channel list with ranges in session numbering, "(@1:4,7)"
+static size_t format_channel_list(usbtmc_session_t const *s, char *out, uint32_t phys)
+{
+  size_t  len   = (size_t)sprintf(out, "(@");
+  uint32_t mask = session_from_phys(s, phys);
+  uint8_t count = session_count(s);
+  uint8_t ch    = 0;
+  while (ch < count)
+  {
+    if (!(mask & (1u << ch)))
+    {
+      ch++;
+      continue;
+    }
+    uint8_t first = ch;
+    while (ch + 1u < count && (mask & (1u << (ch + 1u))))
+    {
+      ch++;
+    }
+    len += (size_t)sprintf(&out[len], first == ch ? "%s%u" : "%s%u:%u",
+                           len > 2 ? "," : "", first + 1u, ch + 1u);
+    ch++;
+  }
+  len += (size_t)sprintf(&out[len], ")");
+  return len;
+}
+
+// True when mask closes more than one member of an exclusive group
+static bool route_conflict(uint32_t mask)
+{
+  for (uint8_t i = 0; i < ROUT_GROUPS; i++)
+  {
+    uint32_t members = mask & route_groups[i];
+    if (members & (members - 1u))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Channels to open when the channels in mask close
+static uint32_t route_exclusive(uint32_t mask)
+{
+  uint32_t open = 0;
+  for (uint8_t i = 0; i < ROUT_GROUPS; i++)
+  {
+    if (mask & route_groups[i])
+    {
+      open |= route_groups[i];
+    }
+  }
+  return open & ~mask;
+}
+
+// Slot of the macro name of this interface, -1 if there is none
+static int8_t macro_find(usbtmc_session_t const *s, char const *name)
+{
+  for (uint8_t i = 0; i < MACRO_SLOTS; i++)
+  {
+    if (macros[i].name[0] && macros[i].session == (uint8_t)(s - sessions) && !strcasecmp(macros[i].name, name))
+    {
+      return (int8_t)i;
+    }
+  }
+  return -1;
+}
+
+// Removes the name and text of a macro, its slot is free again
+static void macro_remove(macro_t *m)
+{
+  memmove(&macro_text[m->text_ix], &macro_text[m->text_ix + m->text_len],
+          macro_text_used - m->text_ix - m->text_len);
+  for (uint8_t i = 0; i < MACRO_SLOTS; i++)
+  {
+    if (macros[i].name[0] && macros[i].text_ix > m->text_ix)
+    {
+      macros[i].text_ix = (uint16_t)(macros[i].text_ix - m->text_len);
+    }
+  }
+  macro_text_used = (uint16_t)(macro_text_used - m->text_len);
+  m->name[0] = '\0';
+}
+
+// Macro name: a letter, then letters, digits and underscores. Returns its
+// length, 0 when str does not start with one. It ends at end.
+static uint8_t macro_label(char const *str, char end)
+{
+  uint8_t len = 0;
+  for (; *str != end; str++, len++)
+  {
+    bool alpha = (*str >= 'a' && *str <= 'z') || (*str >= 'A' && *str <= 'Z');
+    bool digit = *str >= '0' && *str <= '9';
+    if (*str == '\0' || len == MACRO_NAME_LEN || !(alpha || (len && (digit || *str == '_'))))
+    {
+      return 0;
+    }
+  }
+  return len;
+}
+
+// Quoted name of *DMC and *GMC?, "..." or '...'. Returns the character after
+// the closing quote, NULL when it is not a valid name.
+static char * macro_parse_name(char *str, char *name)
+{
+  char    quote = *str;
+  uint8_t len;
+  if ((quote != '"' && quote != '\'') || (len = macro_label(str + 1, quote)) == 0)
+  {
+    return NULL;
+  }
+  memcpy(name, str + 1, len);
+  name[len] = '\0';
+  return str + len + 2;
+}
+
+// The name a command record carries, terminated
+static void macro_cmd_name(usbtmc_cmd_t const *cmd, char *name)
+{
+  memcpy(name, cmd->name, MACRO_NAME_LEN);
+  name[MACRO_NAME_LEN] = '\0';
+}
+
+static void cmd_decode_header(usbtmc_session_t *s, char *msg, usbtmc_cmd_t *cmd);
+
+// *DMC "name",#<n><length><commands>. The commands are decoded now, like the
+// ones of a message, into macro_def, and macro_store keeps them when the *DMC
+// is executed. Decoding only checks the text, the checks against the board
+// state (cmd_check) run each time the macro is invoked. Queries and commands
+// whose decoding depends on the moment (block data, RELAY:MASK:AT) cannot be
+// part of a macro, nor can macros and the macro commands.
+static int16_t macro_decode(usbtmc_session_t *s, char *str)
+{
+  macro_t *m     = &s->macro_def;
+  char    *block = macro_parse_name(str, m->name);
+  m->len = 0;
+  if (!block || block[0] != ',' || block[1] != '#' || block[2] < '1' || block[2] > '9')
+  {
+    return SCPI_ERROR_DATA_OUT_OF_RANGE;
+  }
+  char    *body   = &block[3 + (block[2] - '0')];
+  uint32_t length = 0;
+  for (char *digit = &block[3]; digit < body; digit++)
+  {
+    if (*digit < '0' || *digit > '9')
+    {
+      return SCPI_ERROR_BLOCK_DATA;
+    }
+    length = length * 10u + (uint32_t)(*digit - '0');
+  }
+  if (strlen(body) != length || length == 0)
+  {
+    return SCPI_ERROR_BLOCK_DATA;
+  }
+
+  // The block and its terminator are the *GMC? response, kept before the
+  // body is split up
+  m->text_len = (uint16_t)((size_t)(body - &block[1]) + length + 1u);
+  memcpy(s->macro_def_text, &block[1], m->text_len - 1u);
+  s->macro_def_text[m->text_len - 1u] = '\n';
+
+  for (char *part = body, *next; part; part = next)
+  {
+    next = strpbrk(part, ";\n");
+    if (next)
+    {
+      *next++ = '\0';
+    }
+    while (*part == ' ')
+    {
+      part++;
+    }
+    if (*part == '\0')
+    {
+      continue;
+    }
+    if (m->len == MACRO_LEN)
+    {
+      return SCPI_ERROR_OUT_OF_MEMORY;
+    }
+    if (strchr(part, '?') || !strncasecmp(part, DMC_CMD, 4) || !strncasecmp(part, PMC_CMD, 4) ||
+        !strncasecmp(part, EMC_CMD, 4))
+    {
+      return SCPI_ERROR_MACRO_DEFINITION;
+    }
+    usbtmc_cmd_t *cmd = &m->cmds[m->len];
+    cmd_decode_header(s, part, cmd);
+    if (cmd->op == OP_ERROR)
+    {
+      // a name that is no command would be a macro
+      return cmd->value == SCPI_ERROR_UNDEFINED_HEADER && macro_label(part, '\0') ?
+             SCPI_ERROR_MACRO_DEFINITION : (int16_t)cmd->value;
+    }
+    if (cmd->op == OP_WAV_DATA || cmd->op == OP_RELAY_MASK_AT)
+    {
+      return SCPI_ERROR_MACRO_DEFINITION;
+    }
+    m->len++;
+  }
+  return SCPI_ERROR_NONE;
+}
+
+// Runs the queued *DMC: macro_def replaces a macro of the same name or takes
+// a free slot, if the text still fits.
+static int16_t macro_store(usbtmc_session_t *s)
+{
+  macro_t const *def   = &s->macro_def;
+  int8_t         old   = macro_find(s, def->name);
+  size_t         freed = old >= 0 ? macros[old].text_len : 0u;
+  uint8_t        slot  = 0;
+  if (macro_text_used + def->text_len > MACRO_TEXT_LEN + freed)
+  {
+    return SCPI_ERROR_OUT_OF_MEMORY;
+  }
+  if (old >= 0)
+  {
+    macro_remove(&macros[old]);
+  }
+  while (slot < MACRO_SLOTS && macros[slot].name[0])
+  {
+    slot++;
+  }
+  if (slot == MACRO_SLOTS)
+  {
+    return SCPI_ERROR_OUT_OF_MEMORY; // old was not there, nothing was removed
+  }
+  macro_t *m = &macros[slot];
+  memcpy(m, def, sizeof(*m));
+  m->session = (uint8_t)(s - sessions);
+  m->text_ix = macro_text_used;
+  memcpy(&macro_text[macro_text_used], s->macro_def_text, def->text_len);
+  macro_text_used = (uint16_t)(macro_text_used + def->text_len);
+  return SCPI_ERROR_NONE;
+}
+
+// A message the parser rejects becomes an OP_ERROR entry. Its error is pushed
+// when cmd_execute reaches it, so errors, *CLS and SYST:ERR? keep the order
+// of the messages.
+static void decode_error(usbtmc_cmd_t *cmd, int16_t code)
+{
+  cmd->op    = OP_ERROR;
+  cmd->value = code;
+}
+
+static void msg_trim(char *msg)
+{
+  size_t len = strlen(msg);
+  while (len > 0 && (msg[len-1] == '\n' || msg[len-1] == '\r' || msg[len-1] == ' '))
+  {
+    msg[--len] = '\0'; // drop the write termination
+  }
+}
+
+// Runs in USB callback context. Every message is queued, as a command or as
+// its error. A message that has the form of a macro name is an OP_MACRO,
+// cmd_execute looks the name up, so a macro can be invoked right after the
+// *DMC that defines it and a macro may be named like a command (INIT).
+static void cmd_decode(usbtmc_session_t *s, char *msg, usbtmc_cmd_t *cmd)
+{
+  msg_trim(msg);
+  uint8_t len = macro_label(msg, '\0');
+  if (len)
+  {
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->op = OP_MACRO;
+    memcpy(cmd->name, msg, len);
+    return;
+  }
+  cmd_decode_header(s, msg, cmd);
+}
+
+// A command, of a message or of a macro body
+static void cmd_decode_header(usbtmc_session_t *s, char *msg, usbtmc_cmd_t *cmd)
+{
+  msg_trim(msg);
+  cmd->op      = 0;
+  cmd->channel = 0;
+  cmd->value   = 0;
+  cmd->mask    = 0;
+  cmd->arg[0]  = 0;
+  cmd->arg[1]  = 0;
+
+  if (!strcasecmp(IDN_QUERY,msg))
+  {
+    cmd->op = OP_IDN_QUERY;
+  }
+  else if (!strcasecmp(RST_CMD,msg))
+  {
+    cmd->op = OP_RST;
+  }
+  else if (!strncasecmp(RELAY_CMD PULS_CMD,msg,11))
+  {
+    char *end;
+    uint32_t width_us;
+    if (!parse_mask(s, &msg[11], &end, &cmd->mask) || *end != ',' || !parse_ms_to_us(end + 1, &width_us))
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op    = OP_RELAY_PULS;
+    cmd->value = (int32_t)width_us;
+  }
+  else if (!strncasecmp(RELAY_CMD MASK_CMD,msg,11))
+  {
+    char *end;
+    if (!parse_mask(s, &msg[11], &end, &cmd->mask) || *end != '\0')
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op = OP_RELAY_MASK;
+  }
+  else if (!strcasecmp(RELAY_CMD MASK_QUERY,msg))
+  {
+    cmd->op = OP_RELAY_MASK_QUERY;
+  }
+  else if (!strcasecmp(RELAY_CMD GEN_QUERY,msg))
+  {
+    cmd->op = OP_RELAY_GEN_QUERY;
+  }
+  else if (!strncasecmp(RELAY_CMD MASK_AT_CMD,msg,14))
+  {
+    char *end;
+    unsigned long frame = strtoul(&msg[14], &end, 10);
+    unsigned long us    = 0;
+    bool          ok    = end != &msg[14] && *end == ',' && frame <= TIMER_FRAME_MASK;
+    if (ok)
+    {
+      char const *num = end + 1;
+      us = strtoul(num, &end, 10);
+      ok = end != num && *end == ',' && us < TIMER_FRAME_US;
+    }
+    if (!ok || !parse_mask(s, end + 1, &end, &cmd->mask) || *end != '\0')
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    if (!timer_sof_locked())
+    {
+      decode_error(cmd, SCPI_ERROR_SETTINGS_CONFLICT); // the frame can not be converted
+      return;
+    }
+    uint32_t deadline;
+    if (!timer_frame_deadline((uint16_t)frame, (uint16_t)us, &deadline))
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE); // already passed
+      return;
+    }
+    cmd->op    = OP_RELAY_MASK_AT;
+    cmd->value = (int32_t)deadline;
+  }
+  else if (!strncasecmp(RELAY_CMD,msg,5))
+  {
+    char *suffix;
+    unsigned long channel = strtoul(&msg[5], &suffix, 10);
+    if (suffix == &msg[5] || channel < 1 || channel > session_count(s))
+    {
+      decode_error(cmd, SCPI_ERROR_SUFFIX_RANGE);
+      return;
+    }
+    cmd->mask    = session_to_phys(s, 1u << (channel - 1));
+    cmd->channel = 1;
+    while (!(cmd->mask & (1u << (cmd->channel - 1))))
+    {
+      cmd->channel++; // physical channel
+    }
+    if (!strcasecmp(EN_QUERY,suffix))
+    {
+      cmd->op = OP_RELAY_EN_QUERY;
+    }
+    else if (!strncasecmp(EN_CMD,suffix,4))
+    {
+      if (!parse_bool(&suffix[4], &cmd->value))
+      {
+        decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+        return;
+      }
+      cmd->op = OP_RELAY_EN;
+    }
+    else if (!strncasecmp(PULS_CMD,suffix,6))
+    {
+      uint32_t width_us;
+      if (!parse_ms_to_us(&suffix[6], &width_us))
+      {
+        decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+        return;
+      }
+      cmd->op    = OP_RELAY_PULS;
+      cmd->value = (int32_t)width_us;
+    }
+    else if (!strcasecmp(POW_QUERY,suffix))
+    {
+      cmd->op = OP_RELAY_POW_QUERY;
+    }
+    else if (!strncasecmp(POW_CMD,suffix,5))
+    {
+      char *pull = &suffix[5];
+      char *hold = strchr(pull, ',');
+      char *time = hold ? strchr(hold + 1, ',') : NULL;
+      uint32_t pull_us;
+      if (!time)
+      {
+        decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+        return;
+      }
+      *hold++ = '\0';
+      *time++ = '\0';
+      if (!parse_fixed(pull, 0, POW_MAX_MA, &cmd->arg[0]) || !parse_fixed(hold, 0, POW_MAX_MA, &cmd->arg[1]) ||
+          !parse_fixed(time, 3, POW_MAX_MS, &pull_us))
+      {
+        decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+        return;
+      }
+      cmd->op    = OP_RELAY_POW;
+      cmd->value = (int32_t)pull_us;
+    }
+    else if (!strncasecmp(":pwm:",suffix,5))
+    {
+      uint32_t value;
+      if (!relay_pwm_capable(cmd->channel))
+      {
+        decode_error(cmd, SCPI_ERROR_HARDWARE_MISSING);
+        return;
+      }
+      if (!strcasecmp(PWM_FREQ_QUERY,suffix))
+      {
+        cmd->op = OP_PWM_FREQ_QUERY;
+      }
+      else if (!strcasecmp(PWM_DUTY_QUERY,suffix))
+      {
+        cmd->op = OP_PWM_DUTY_QUERY;
+      }
+      else if (!strncasecmp(PWM_FREQ_CMD,suffix,10))
+      {
+        if (!parse_fixed(&suffix[10], 0, PWM_FREQ_MAX, &value) || value == 0)
+        {
+          decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+          return;
+        }
+        cmd->op    = OP_PWM_FREQ;
+        cmd->value = (int32_t)value;
+      }
+      else if (!strncasecmp(PWM_DUTY_CMD,suffix,10))
+      {
+        if (!parse_fixed(&suffix[10], 1, 100, &value) || value > 1000u)
+        {
+          decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+          return;
+        }
+        cmd->op    = OP_PWM_DUTY;
+        cmd->value = (int32_t)value;
+      }
+    }
+  }
+  else if (!strncasecmp(ROUT_CLOS_CMD,msg,10) || !strncasecmp(ROUT_CLOS_QUERY,msg,11) ||
+           !strncasecmp(ROUT_OPEN_CMD,msg,10))
+  {
+    char *end;
+    char *list = strchr(msg, ' ') + 1;
+    if (!parse_channel_list(s, list, &end, &cmd->mask) || *end != '\0')
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    if (!strncasecmp(ROUT_CLOS_QUERY,msg,11))
+    {
+      cmd->op = OP_ROUT_CLOS_QUERY;
+    }
+    else if (!strncasecmp(ROUT_OPEN_CMD,msg,10))
+    {
+      cmd->op = OP_ROUT_OPEN;
+    }
+    else
+    {
+      cmd->op = OP_ROUT_CLOS;
+    }
+  }
+  else if (!strncasecmp(ROUT_GRP_CMD,msg,13) || !strncasecmp(ROUT_GRP_QUERY,msg,14))
+  {
+    char *end;
+    bool query = msg[12] == '?';
+    unsigned long group = strtoul(&msg[query ? 14 : 13], &end, 10);
+    if (group < 1 || group > ROUT_GROUPS)
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->value = (int32_t)group;
+    if (query)
+    {
+      if (*end != '\0')
+      {
+        decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+        return;
+      }
+      cmd->op = OP_ROUT_GRP_QUERY;
+    }
+    else
+    {
+      if (*end != ',' || !parse_channel_list(s, end + 1, &end, &cmd->mask) || *end != '\0')
+      {
+        decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+        return;
+      }
+      cmd->op = OP_ROUT_GRP;
+    }
+  }
+  else if (!strcasecmp(ESR_QUERY,msg))
+  {
+    cmd->op = OP_ESR_QUERY;
+  }
+  else if (!strcasecmp(ESE_QUERY,msg))
+  {
+    cmd->op = OP_ESE_QUERY;
+  }
+  else if (!strcasecmp(SRE_QUERY,msg))
+  {
+    cmd->op = OP_SRE_QUERY;
+  }
+  else if (!strcasecmp(STB_QUERY,msg))
+  {
+    cmd->op = OP_STB_QUERY;
+  }
+  else if (!strncasecmp(ESE_CMD,msg,5) || !strncasecmp(SRE_CMD,msg,5))
+  {
+    char *end;
+    long  value = strtol(&msg[5], &end, 10);
+    if (end == &msg[5] || *end != '\0')
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_TYPE);
+      return;
+    }
+    if (value < 0 || value > 255)
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->value = (int32_t)value;
+    cmd->op = strncasecmp(ESE_CMD,msg,5) ? OP_SRE : OP_ESE;
+  }
+  else if (!strcasecmp(CLS_CMD,msg))
+  {
+    cmd->op = OP_CLS;
+  }
+  else if (!strncasecmp(SAV_CMD,msg,5) || !strncasecmp(RCL_CMD,msg,5) || !strncasecmp(SDS_CMD,msg,5))
+  {
+    uint32_t n;
+    if (!parse_fixed(&msg[5], 0, PRESET_SLOTS - 1u, &n))
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op    = !strncasecmp(SAV_CMD,msg,5) ? OP_SAV : !strncasecmp(RCL_CMD,msg,5) ? OP_RCL : OP_SDS;
+    cmd->value = (int32_t)n;
+  }
+  else if (!strcasecmp(MEM_NST_QUERY,msg))
+  {
+    cmd->op = OP_MEM_NST_QUERY;
+  }
+  else if (!strncasecmp(DMC_CMD,msg,5))
+  {
+    int16_t error = macro_decode(s, &msg[5]);
+    if (error)
+    {
+      decode_error(cmd, error);
+      return;
+    }
+    s->macro_staged = true;               // macro_def is in use until the *DMC has run
+    cmd->op = OP_DMC;
+  }
+  else if (!strcasecmp(PMC_CMD,msg))
+  {
+    cmd->op = OP_PMC;
+  }
+  else if (!strcasecmp(EMC_QUERY,msg))
+  {
+    cmd->op = OP_EMC_QUERY;
+  }
+  else if (!strncasecmp(EMC_CMD,msg,5))
+  {
+    if (!parse_bool(&msg[5], &cmd->value))
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op = OP_EMC;
+  }
+  else if (!strcasecmp(LMC_QUERY,msg))
+  {
+    cmd->op = OP_LMC_QUERY;
+  }
+  else if (!strncasecmp(GMC_QUERY,msg,6))
+  {
+    char name[MACRO_NAME_LEN + 1u];
+    char *end = macro_parse_name(&msg[6], name);
+    if (!end || *end != '\0')
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op = OP_GMC_QUERY;
+    memcpy(cmd->name, name, strlen(name));
+  }
+  else if (!strncasecmp(MEAS_CURR_QUERY,msg,11))
+  {
+    char *end;
+    if (!parse_channel_list(s, &msg[11], &end, &cmd->mask) || *end != '\0')
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    if (cmd->mask & ~adc_coil_mask())
+    {
+      decode_error(cmd, SCPI_ERROR_HARDWARE_MISSING);
+      return;
+    }
+    cmd->op = OP_MEAS_CURR_QUERY;
+  }
+  else if (!strcasecmp(SENS_STAT_QUERY,msg))
+  {
+    cmd->op = OP_SENS_STAT_QUERY;
+  }
+  else if (!strcasecmp(SENS_VER_QUERY,msg))
+  {
+    cmd->op = OP_SENS_VER_QUERY;
+  }
+  else if (!strcasecmp(SENS_FAIL_QUERY,msg))
+  {
+    cmd->op = OP_SENS_FAIL_QUERY;
+  }
+  else if (!strncasecmp(SENS_VER_CMD,msg,9))
+  {
+    if (!parse_bool(&msg[9], &cmd->value))
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op = OP_SENS_VER;
+  }
+  else if (!strcasecmp(FETC_QUERY,msg))
+  {
+    cmd->op = OP_FETC_QUERY;
+  }
+  else if (!strcasecmp(SOUR_VOLT_QUERY,msg))
+  {
+    cmd->op = OP_SOUR_VOLT_QUERY;
+  }
+  else if (!strncasecmp(SOUR_VOLT_CMD,msg,10))
+  {
+    uint32_t mv;
+    if (!parse_fixed(&msg[10], 3, SOUR_VOLT_MAX_MV / 1000u, &mv) || mv > SOUR_VOLT_MAX_MV)
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op    = OP_SOUR_VOLT;
+    cmd->value = (int32_t)mv;
+  }
+  else if (!strncasecmp(WAV_DATA_CMD,msg,WAV_DATA_LEN))
+  {
+    if (!s->block_received)
+    {
+      decode_error(cmd, SCPI_ERROR_BLOCK_DATA);
+      return;
+    }
+    cmd->op = OP_WAV_DATA;
+  }
+  else if (!strcasecmp(WAV_POIN_QUERY,msg))
+  {
+    cmd->op = OP_WAV_POIN_QUERY;
+  }
+  else if (!strcasecmp(WAV_RATE_QUERY,msg))
+  {
+    cmd->op = OP_WAV_RATE_QUERY;
+  }
+  else if (!strncasecmp(WAV_RATE_CMD,msg,14))
+  {
+    uint32_t hz;
+    if (!parse_fixed(&msg[14], 0, WAV_RATE_MAX, &hz) || hz == 0)
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op    = OP_WAV_RATE;
+    cmd->value = (int32_t)hz;
+  }
+  else if (!strcasecmp(WAV_CONT_QUERY,msg))
+  {
+    cmd->op = OP_WAV_CONT_QUERY;
+  }
+  else if (!strncasecmp(WAV_CONT_CMD,msg,14))
+  {
+    if (!parse_bool(&msg[14], &cmd->value))
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op = OP_WAV_CONT;
+  }
+  else if (!strcasecmp(WAV_STAR_CMD,msg) || !strcasecmp(WAV_ARM_CMD,msg))
+  {
+    cmd->op = strcasecmp(WAV_STAR_CMD,msg) ? OP_WAV_ARM : OP_WAV_STAR;
+  }
+  else if (!strcasecmp(WAV_STOP_CMD,msg))
+  {
+    cmd->op = OP_WAV_STOP;
+  }
+  else if (!strcasecmp(WAV_STAT_QUERY,msg))
+  {
+    cmd->op = OP_WAV_STAT_QUERY;
+  }
+  else if (!strcasecmp(INP_STAT_QUERY,msg))
+  {
+    cmd->op = OP_INP_STAT_QUERY;
+  }
+  else if (!strcasecmp(INP_DATA_QUERY,msg))
+  {
+    cmd->op = OP_INP_DATA_QUERY;
+  }
+  else if (!strcasecmp(INP_COUN_QUERY,msg))
+  {
+    cmd->op = OP_INP_COUN_QUERY;
+  }
+  else if (!strcasecmp(INP_CLE_CMD,msg))
+  {
+    cmd->op = OP_INP_CLE;
+  }
+  else if (!strncasecmp(INP_LAT_QUERY,msg,9))
+  {
+    char *end;
+    unsigned long input = strtoul(&msg[9], &end, 10);
+    if (end == &msg[9] || *end != '\0' || input < 1 || input > input_count())
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op    = OP_INP_LAT_QUERY;
+    cmd->value = (int32_t)input;
+  }
+  else if (!strcasecmp(TRIG_SOUR_QUERY,msg))
+  {
+    cmd->op = OP_TRIG_SOUR_QUERY;
+  }
+  else if (!strncasecmp(TRIG_SOUR_CMD,msg,10))
+  {
+    if (!strcasecmp("bus",&msg[10]))
+    {
+      cmd->value = TRIG_SOUR_BUS;
+    }
+    else if (!strcasecmp("ext",&msg[10]))
+    {
+      cmd->value = TRIG_SOUR_EXT;
+    }
+    else
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op = OP_TRIG_SOUR;
+  }
+  else if (!strcasecmp(TRIG_SLOP_QUERY,msg))
+  {
+    cmd->op = OP_TRIG_SLOP_QUERY;
+  }
+  else if (!strncasecmp(TRIG_SLOP_CMD,msg,10))
+  {
+    if (!strcasecmp("pos",&msg[10]))
+    {
+      cmd->value = 0;
+    }
+    else if (!strcasecmp("neg",&msg[10]))
+    {
+      cmd->value = 1;
+    }
+    else
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op = OP_TRIG_SLOP;
+  }
+  else if (!strcasecmp(TRIG_DEL_QUERY,msg))
+  {
+    cmd->op = OP_TRIG_DEL_QUERY;
+  }
+  else if (!strncasecmp(TRIG_DEL_CMD,msg,9))
+  {
+    uint32_t us;
+    if (!parse_fixed(&msg[9], 0, TRIG_DEL_MAX, &us))
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op    = OP_TRIG_DEL;
+    cmd->value = (int32_t)us;
+  }
+  else if (!strcasecmp(TRIG_MASK_QUERY,msg))
+  {
+    cmd->op = OP_TRIG_MASK_QUERY;
+  }
+  else if (!strncasecmp(TRIG_MASK_CMD,msg,10))
+  {
+    char *end;
+    if (!parse_mask(s, &msg[10], &end, &cmd->mask) || *end != '\0')
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op = OP_TRIG_MASK;
+  }
+  else if (!strcasecmp(TRIG_LAT_QUERY,msg))
+  {
+    cmd->op = OP_TRIG_LAT_QUERY;
+  }
+  else if (!strcasecmp(INIT_CMD,msg))
+  {
+    cmd->op = OP_INIT;
+  }
+  else if (!strcasecmp(ABOR_CMD,msg))
+  {
+    cmd->op = OP_ABOR;
+  }
+  else if (!strcasecmp(TRAC_DATA_QUERY,msg))
+  {
+    cmd->op = OP_TRAC_DATA_QUERY;
+  }
+  else if (!strcasecmp(TRAC_CLE_CMD,msg))
+  {
+    cmd->op = OP_TRAC_CLE;
+  }
+  else if (!strcasecmp(SYST_ERR_QUERY,msg))
+  {
+    cmd->op = OP_SYST_ERR_QUERY;
+  }
+  else if (!strcasecmp(SYST_QUE_QUERY,msg))
+  {
+    cmd->op = OP_SYST_QUE_QUERY;
+  }
+  else if (!strcasecmp(SYST_BOOT_QUERY,msg))
+  {
+    cmd->op = OP_SYST_BOOT_QUERY;
+  }
+  else if (!strcasecmp(SYST_BUDG_QUERY,msg))
+  {
+    cmd->op = OP_SYST_BUDG_QUERY;
+  }
+  else if (!strncasecmp(SYST_BUDG_CMD,msg,14))
+  {
+    uint32_t ma;
+    if (!parse_fixed(&msg[14], 0, 100000u, &ma))
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op    = OP_SYST_BUDG;
+    cmd->value = (int32_t)ma;
+  }
+  else if (!strcasecmp(SYST_STEP_QUERY,msg))
+  {
+    cmd->op = OP_SYST_STEP_QUERY;
+  }
+  else if (!strcasecmp(SYST_TIME_QUERY,msg))
+  {
+    cmd->op = OP_SYST_TIME_QUERY;
+  }
+  else if (!strcasecmp(SYST_PON_QUERY,msg))
+  {
+    cmd->op = OP_SYST_PON_QUERY;
+  }
+  else if (!strncasecmp(SYST_PON_CMD,msg,14))
+  {
+    char *end;
+    if (!strcasecmp("last",&msg[14]))
+    {
+      cmd->value = 1;
+    }
+    else if (!parse_mask(s, &msg[14], &end, &cmd->mask) || *end != '\0')
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op = OP_SYST_PON;
+  }
+  else if (!strcasecmp(SYST_CHAN_QUERY,msg))
+  {
+    cmd->op = OP_SYST_CHAN_QUERY;
+  }
+  else if (!strncasecmp(SYST_CHAN_CMD,msg,15))
+  {
+    uint32_t count;
+    if (!parse_fixed(&msg[15], 0, RELAY_COUNT, &count) || count < RELAY_FIXED_COUNT || count == 0)
+    {
+      decode_error(cmd, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return;
+    }
+    cmd->op    = OP_SYST_CHAN;
+    cmd->value = (int32_t)count;
+  }
+  else if (!strncasecmp(DELAY_CMD,msg,6))
+  {
+    cmd->op = OP_DELAY;
+    cmd->value = atoi(&msg[6]);
+    if(cmd->value > 10000)
+      cmd->value = 10000;
+    if(cmd->value < 0)
+      cmd->value = 0;
+  }
+
+  if (cmd->op == 0)
+  {
+    decode_error(cmd, SCPI_ERROR_UNDEFINED_HEADER);
+  }
+}
+
+// An armed trigger or a RELAY:MASK:AT change still to come switches relays
+// from an interrupt, outside the power budget plan of relay_apply
+static bool power_unplanned(void)
+{
+  return trigger_armed() || relay_schedule_has(TRACE_AT);
+}
+
+// Checks against the board state when the command runs, commands queued
+// before it, or a macro defined long ago, may have changed the groups or
+// closed relays since it was decoded. cmd_decode only checks the message.
+// A bank interface never changes the relays of another bank: closing a group
+// member whose closed partner is in another bank is a conflict, like a mask
+// that closes a second member next to it.
+static int16_t cmd_check(usbtmc_session_t const *s, usbtmc_cmd_t const *cmd)
+{
+  uint32_t others = relay_read_mask() & ~s->channels;
+  switch (cmd->op)
+  {
+    case OP_RELAY_EN:
+      if (!cmd->value)
+      {
+        return SCPI_ERROR_NONE;
+      }
+      // fall through
+    case OP_RELAY_PULS:
+    case OP_ROUT_CLOS:
+      return route_conflict(cmd->mask) || (route_exclusive(cmd->mask) & others) ?
+             SCPI_ERROR_SETTINGS_CONFLICT : SCPI_ERROR_NONE;
+    case OP_RELAY_MASK_AT:
+      if (power_get_budget())
+      {
+        return SCPI_ERROR_SETTINGS_CONFLICT; // the timer interrupt switches without a budget plan
+      }
+      // fall through
+    case OP_RELAY_MASK:
+    case OP_TRIG_MASK:
+      return route_conflict(others | cmd->mask) ? SCPI_ERROR_SETTINGS_CONFLICT : SCPI_ERROR_NONE;
+    case OP_INIT:
+      return power_get_budget() ? SCPI_ERROR_SETTINGS_CONFLICT : SCPI_ERROR_NONE; // as RELAY:MASK:AT
+    case OP_SYST_BUDG:
+      return cmd->value && power_unplanned() ? SCPI_ERROR_SETTINGS_CONFLICT : SCPI_ERROR_NONE;
+    case OP_RCL:
+      if (presets[cmd->value].budget_ma && power_unplanned())
+      {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+      }
+      // a bank recalls its own channels into the groups of the board
+      return s != &sessions[0] && route_conflict(others | (presets[cmd->value].mask & s->channels)) ?
+             SCPI_ERROR_SETTINGS_CONFLICT : SCPI_ERROR_NONE;
+    case OP_WAV_STAR:
+    case OP_WAV_ARM:
+      return dac_wave_ready() ? SCPI_ERROR_NONE : SCPI_ERROR_SETTINGS_CONFLICT; // no waveform loaded
+    case OP_SYST_TIME_QUERY:
+      return timer_sof_locked() ? SCPI_ERROR_NONE : SCPI_ERROR_SETTINGS_CONFLICT; // no SOFs, not configured or suspended
+    case OP_GMC_QUERY:
+    {
+      char name[MACRO_NAME_LEN + 1u];
+      macro_cmd_name(cmd, name);
+      return macro_find(s, name) >= 0 ? SCPI_ERROR_NONE : SCPI_ERROR_SETTINGS_CONFLICT; // no such macro
+    }
+    case OP_ROUT_GRP:
+    {
+      // a group that already has two members closed would never be exclusive
+      uint32_t closed = relay_read_mask() & cmd->mask;
+      return closed & (closed - 1u) ? SCPI_ERROR_SETTINGS_CONFLICT : SCPI_ERROR_NONE;
+    }
+    default:
+      return SCPI_ERROR_NONE;
+  }
+}
+
+// Runs in usbtmc_app_task_iter, sets up the response the host may read
+static void cmd_execute(usbtmc_session_t *s, usbtmc_cmd_t const *cmd)
+{
+  int16_t code;
+  uint16_t duty;
+  uint16_t pull_ma, hold_ma;
+  uint32_t pull_us;
+  uint32_t latency_us;
+
+  boot_mark(BOOT_FIRST_CMD);
+  s->resp_ptr = (const uint8_t *)s->resp_buf;
+  s->resp_len = 0;
+  code = cmd_check(s, cmd);
+  if (code != SCPI_ERROR_NONE)
+  {
+    error_push(s, code); // a command, still answered with the bare terminator
+    s->resp_len = (size_t)sprintf(s->resp_buf, END_RESPONSE);
+    return;
+  }
+  switch (cmd->op)
+  {
+    case OP_IDN_QUERY:
+      s->resp_ptr = (const uint8_t *)(IDN END_RESPONSE);
+      s->resp_len = sizeof(IDN END_RESPONSE)-1;
+      break;
+    case OP_RST:
+      if (s == &sessions[0])
+      {
+        dac_reset();                         // 0 V, waveform stopped
+      }
+      relay_schedule_cancel(s->channels);    // a bank resets its own channels only
+      relay_pwm_stop(s->channels);
+      relay_update_mask(s->channels, 0, TRACE_RST);
+      break;
+    case OP_RELAY_EN:
+      if (cmd->value)
+      {
+        relay_pwm_stop(cmd->mask | (route_exclusive(cmd->mask) & s->channels));
+        relay_apply(route_exclusive(cmd->mask) & s->channels, cmd->mask, 0, TRACE_EN);
+      }
+      else
+      {
+        relay_pwm_stop(cmd->mask);
+        relay_apply(cmd->mask, 0, 0, TRACE_EN);
+      }
+      break;
+    case OP_RELAY_PULS:
+      relay_pwm_stop(cmd->mask | (route_exclusive(cmd->mask) & s->channels));
+      relay_apply(route_exclusive(cmd->mask) & s->channels, cmd->mask, (uint32_t)cmd->value, TRACE_PULS);
+      break;
+    case OP_RELAY_MASK:
+      if (!relay_set_mask_in(s->channels, cmd->mask, TRACE_MASK))
+      {
+        error_push(s, SCPI_ERROR_SETTINGS_CONFLICT);
+      }
+      break;
+    case OP_RELAY_MASK_AT:
+      relay_pwm_stop(s->channels);
+      relay_schedule_cancel(s->channels);
+      relay_schedule(s->channels & ~cmd->mask, cmd->mask, (uint32_t)cmd->value, TRACE_AT);
+      break;
+    case OP_RELAY_MASK_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)session_from_phys(s, relay_read_mask()));
+      break;
+    case OP_RELAY_GEN_QUERY:
+      s->gen_seen = relay_gen;
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)s->gen_seen);
+      break;
+    case OP_ROUT_CLOS:
+      relay_pwm_stop(cmd->mask | (route_exclusive(cmd->mask) & s->channels));
+      relay_apply(route_exclusive(cmd->mask) & s->channels, cmd->mask, 0, TRACE_ROUT);
+      break;
+    case OP_ROUT_OPEN:
+      relay_pwm_stop(cmd->mask);
+      relay_apply(cmd->mask, 0, 0, TRACE_ROUT);
+      break;
+    case OP_ROUT_CLOS_QUERY:
+      for (uint8_t i = 0; i < RELAY_COUNT; i++)
+      {
+        if (cmd->mask & (1u << i))
+        {
+          s->resp_len += (size_t)sprintf(&s->resp_buf[s->resp_len], "%s%u", s->resp_len ? "," : "",
+                                      (unsigned int)((relay_read_mask() >> i) & 1u));
+        }
+      }
+      break;
+    case OP_ROUT_GRP:
+      route_groups[cmd->value - 1] = cmd->mask;
+      break;
+    case OP_ROUT_GRP_QUERY:
+      s->resp_len = format_channel_list(s, s->resp_buf, route_groups[cmd->value - 1]);
+      break;
+    case OP_RELAY_POW:
+      power_set_channel(cmd->channel, (uint16_t)cmd->arg[0], (uint16_t)cmd->arg[1], (uint32_t)cmd->value);
+      break;
+    case OP_RELAY_POW_QUERY:
+      power_get_channel(cmd->channel, &pull_ma, &hold_ma, &pull_us);
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u,%u,%lu.%03lu", pull_ma, hold_ma,
+          (unsigned long)(pull_us / 1000u), (unsigned long)(pull_us % 1000u));
+      break;
+    case OP_SYST_BUDG:
+      power_set_budget((uint32_t)cmd->value);
+      break;
+    case OP_SYST_BUDG_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)power_get_budget());
+      break;
+    case OP_SYST_STEP_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", power_last_step_count());
+      break;
+    case OP_SYST_TIME_QUERY:
+    {
+      uint16_t frame;
+      uint16_t us;
+      timer_frame_now(&frame, &us);
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u,%u", frame, us);
+      break;
+    }
+    case OP_PWM_FREQ:
+      relay_pwm_set_freq(cmd->channel, (uint32_t)cmd->value);
+      break;
+    case OP_PWM_FREQ_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)relay_pwm_get_freq(cmd->channel));
+      break;
+    case OP_PWM_DUTY:
+      relay_schedule_cancel(cmd->mask);
+      relay_pwm_set_duty(cmd->channel, (uint16_t)cmd->value);
+      break;
+    case OP_PWM_DUTY_QUERY:
+      duty = relay_pwm_get_duty(cmd->channel);
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u.%u", duty / 10u, duty % 10u);
+      break;
+    case OP_RELAY_EN_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", (unsigned int)((relay_mask >> (cmd->channel - 1)) & 1u));
+      break;
+    case OP_ESR_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", s->esr);
+      s->esr = 0; // reading the ESR clears it
+      break;
+    case OP_ESE:
+      s->ese = (uint8_t)cmd->value;
+      break;
+    case OP_ESE_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", s->ese);
+      break;
+    case OP_SRE:
+      s->sre = (uint8_t)(cmd->value & ~IEEE4882_STB_SRQ); // bit 6 is ignored
+      break;
+    case OP_SRE_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", s->sre);
+      break;
+    case OP_STB_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", status_byte(s));
+      break;
+    case OP_CLS:
+      s->esr        = 0;
+      s->error_tail = s->error_head;
+      s->error_overflows_seen = s->error_overflows;
+      s->trig_seen  = trigger_count();
+      s->gen_seen   = relay_gen;
+      adc_verify_clear();
+      break;
+    case OP_SAV:
+      preset_save(&presets[cmd->value]);
+      break;
+    case OP_RCL:
+      preset_recall(s, &presets[cmd->value]);
+      break;
+    case OP_SDS:
+      memset(&presets[cmd->value], 0, sizeof(presets[0]));
+      break;
+    case OP_MEM_NST_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", PRESET_SLOTS);
+      break;
+    case OP_DMC:
+      code = macro_store(s);
+      s->macro_staged = false;              // Bulk-OUT is armed again by cmd_consume
+      if (code != SCPI_ERROR_NONE)
+      {
+        error_push(s, code);
+      }
+      break;
+    case OP_PMC:
+      for (uint8_t i = 0; i < MACRO_SLOTS; i++)
+      {
+        if (macros[i].name[0] && macros[i].session == (uint8_t)(s - sessions))
+        {
+          macro_remove(&macros[i]);
+        }
+      }
+      break;
+    case OP_EMC:
+      s->macros_disabled = !cmd->value;
+      break;
+    case OP_EMC_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", s->macros_disabled ? 0u : 1u);
+      break;
+    case OP_LMC_QUERY:
+      for (uint8_t i = 0; i < MACRO_SLOTS; i++)
+      {
+        if (macros[i].name[0] && macros[i].session == (uint8_t)(s - sessions))
+        {
+          s->resp_len += (size_t)sprintf(&s->resp_buf[s->resp_len], "%s\"%s\"", s->resp_len ? "," : "", macros[i].name);
+        }
+      }
+      if (s->resp_len == 0)
+      {
+        s->resp_len = (size_t)sprintf(s->resp_buf, "\"\"");
+      }
+      break;
+    case OP_GMC_QUERY:
+    {
+      // copied, a *DMC or *PMC moves macro_text while the response is sent
+      char name[MACRO_NAME_LEN + 1u];
+      macro_cmd_name(cmd, name);
+      macro_t const *m = &macros[macro_find(s, name)]; // cmd_check found it
+      memcpy(s->block_buf, &macro_text[m->text_ix], m->text_len);
+      s->resp_ptr = s->block_buf;
+      s->resp_len = m->text_len;
+      break;
+    }
+    case OP_MACRO:
+    {
+      char name[MACRO_NAME_LEN + 1u];
+      macro_cmd_name(cmd, name);
+      int8_t slot = s->macros_disabled ? -1 : macro_find(s, name);
+      if (slot >= 0)
+      {
+        for (uint8_t i = 0; i < macros[slot].len; i++)
+        {
+          cmd_execute(s, &macros[slot].cmds[i]);
+        }
+      }
+      else
+      {
+        usbtmc_cmd_t named;                 // no such macro, a command with no arguments or -113
+        cmd_decode_header(s, name, &named);
+        if (named.op == OP_ERROR)
+        {
+          error_push(s, (int16_t)named.value);
+        }
+        else
+        {
+          cmd_execute(s, &named);
+        }
+      }
+      s->resp_ptr = (const uint8_t *)s->resp_buf; // one terminator for the whole macro
+      s->resp_len = 0;
+      break;
+    }
+    case OP_MEAS_CURR_QUERY:
+      for (uint8_t i = 0; i < RELAY_COUNT; i++)
+      {
+        if (cmd->mask & (1u << i))
+        {
+          uint32_t ma = adc_coil_current((uint8_t)(i + 1u)); // 0.1 mA
+          s->resp_len += (size_t)sprintf(&s->resp_buf[s->resp_len], "%s%lu.%lu", s->resp_len ? "," : "",
+                                      (unsigned long)(ma / 10u), (unsigned long)(ma % 10u));
+        }
+      }
+      break;
+    case OP_SENS_STAT_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)session_from_phys(s, adc_contact_state()));
+      break;
+    case OP_SENS_VER:
+      adc_verify_set(cmd->value != 0);
+      break;
+    case OP_SENS_VER_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", adc_verify_get());
+      break;
+    case OP_SENS_FAIL_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)session_from_phys(s, adc_verify_failed()));
+      break;
+    case OP_FETC_QUERY:
+      s->resp_ptr = s->block_buf;
+      s->resp_len = adc_fetch(s->block_buf, &s->fetch_seq);
+      break;
+    case OP_SOUR_VOLT:
+      dac_set_mv((uint32_t)cmd->value);
+      break;
+    case OP_SOUR_VOLT_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu.%03lu", (unsigned long)(dac_get_mv() / 1000u),
+                                 (unsigned long)(dac_get_mv() % 1000u));
+      break;
+    case OP_WAV_DATA:
+      if (dac_wave_end())
+      {
+        dac_wave_load();
+      }
+      else
+      {
+        error_push(s, SCPI_ERROR_BLOCK_DATA);
+      }
+      break;
+    case OP_WAV_POIN_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", dac_wave_samples());
+      break;
+    case OP_WAV_RATE:
+      dac_wave_set_rate((uint32_t)cmd->value);
+      break;
+    case OP_WAV_RATE_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)dac_wave_get_rate());
+      break;
+    case OP_WAV_CONT:
+      dac_wave_set_cont(cmd->value != 0);
+      break;
+    case OP_WAV_CONT_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", dac_wave_get_cont());
+      break;
+    case OP_WAV_STAR:
+    case OP_WAV_ARM:
+      dac_wave_start(cmd->op == OP_WAV_ARM);
+      break;
+    case OP_WAV_STOP:
+      dac_wave_stop();
+      break;
+    case OP_WAV_STAT_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", dac_wave_state());
+      break;
+    case OP_INP_STAT_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)input_state());
+      break;
+    case OP_INP_DATA_QUERY:
+      s->resp_ptr = s->block_buf;
+      s->resp_len = input_block(s->block_buf);
+      break;
+    case OP_INP_COUN_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)input_edges());
+      break;
+    case OP_INP_CLE:
+      input_clear();
+      break;
+    case OP_INP_LAT_QUERY:
+      if (input_latency((uint8_t)cmd->value, &latency_us))
+      {
+        s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)latency_us);
+      }
+      else
+      {
+        s->resp_len = (size_t)sprintf(s->resp_buf, "9.91E+37"); // SCPI NaN, no edge after the last transition
+      }
+      break;
+    case OP_TRIG_SOUR:
+      trigger_set_source((uint8_t)cmd->value);
+      break;
+    case OP_TRIG_SOUR_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%s", trigger_get_source() == TRIG_SOUR_EXT ? "EXT" : "BUS");
+      break;
+    case OP_TRIG_SLOP:
+      trigger_set_slope(cmd->value != 0);
+      break;
+    case OP_TRIG_SLOP_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%s", trigger_get_slope() ? "NEG" : "POS");
+      break;
+    case OP_TRIG_DEL:
+      trigger_set_delay((uint32_t)cmd->value);
+      break;
+    case OP_TRIG_DEL_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)trigger_get_delay());
+      break;
+    case OP_TRIG_MASK:
+      trigger_set_mask(s->channels, cmd->mask); // a bank arms its own channels
+      break;
+    case OP_TRIG_MASK_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)session_from_phys(s, trigger_get_mask()));
+      break;
+    case OP_TRIG_LAT_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)trigger_latency());
+      break;
+    case OP_INIT:
+      trigger_arm(true);
+      break;
+    case OP_ABOR:
+      trigger_arm(false);
+      break;
+    case OP_TRAC_DATA_QUERY:
+      s->resp_ptr = s->block_buf;
+      s->resp_len = trace_block(s->block_buf);
+      break;
+    case OP_TRAC_CLE:
+      trace_clear();
+      break;
+    case OP_SYST_ERR_QUERY:
+      code = error_pop(s);
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%d,\"%s\"", code, error_message(code));
+      break;
+    case OP_SYST_QUE_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u,%u,%u", (uint8_t)(s->cmd_head - s->cmd_tail), s->cmd_high_water, CMD_QUEUE_LEN);
+      break;
+    case OP_SYST_BOOT_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%lu,%lu,%lu,%lu,%lu",
+          (unsigned long)boot_time(BOOT_GPIO), (unsigned long)boot_time(BOOT_BOARD),
+          (unsigned long)boot_time(BOOT_TUSB), (unsigned long)boot_time(BOOT_MOUNT),
+          (unsigned long)boot_time(BOOT_FIRST_CMD));
+      break;
+    case OP_SYST_PON:
+      nvm_set_power_on(cmd->value != 0, (nvm_power_on_mask() & ~s->channels) | cmd->mask); // a bank sets its own channels
+      break;
+    case OP_SYST_PON_QUERY:
+      if (nvm_power_on_last())
+      {
+        s->resp_len = (size_t)sprintf(s->resp_buf, "LAST");
+      }
+      else
+      {
+        s->resp_len = (size_t)sprintf(s->resp_buf, "%lu", (unsigned long)session_from_phys(s, nvm_power_on_mask()));
+      }
+      break;
+    case OP_SYST_CHAN:
+      relay_set_channels((uint8_t)cmd->value);
+      nvm_set_channels((uint8_t)cmd->value);
+      break;
+    case OP_SYST_CHAN_QUERY:
+      s->resp_len = (size_t)sprintf(s->resp_buf, "%u", relay_channels);
+      break;
+    case OP_DELAY:
+      resp_delay = (uint32_t)cmd->value;
+      break;
+  }
+  if (s->resp_ptr == (const uint8_t *)s->resp_buf)
+  {
+    s->resp_len += (size_t)sprintf(&s->resp_buf[s->resp_len], END_RESPONSE); // commands answer the bare terminator
+  }
+}
+
+static uint8_t error_esr_bit(int16_t code)
+{
+  if (code <= -100 && code > -200) return IEEE4882_ESR_CME;
+  if (code <= -200 && code > -300) return IEEE4882_ESR_EXE;
+  if (code <= -300 && code > -400) return IEEE4882_ESR_DDE;
+  if (code <= -400 && code > -500) return IEEE4882_ESR_QYE;
+  return 0;
+}
+
+static const char * error_message(int16_t code)
+{
+  switch (code)
+  {
+    case SCPI_ERROR_NONE:              return "No error";
+    case SCPI_ERROR_DATA_TYPE:         return "Data type error";
+    case SCPI_ERROR_UNDEFINED_HEADER:  return "Undefined header";
+    case SCPI_ERROR_SUFFIX_RANGE:      return "Header suffix out of range";
+    case SCPI_ERROR_BLOCK_DATA:        return "Invalid block data";
+    case SCPI_ERROR_MACRO_DEFINITION:  return "Invalid inside macro definition";
+    case SCPI_ERROR_SETTINGS_CONFLICT: return "Settings conflict";
+    case SCPI_ERROR_DATA_OUT_OF_RANGE: return "Data out of range";
+    case SCPI_ERROR_OUT_OF_MEMORY:     return "Out of memory";
+    case SCPI_ERROR_HARDWARE_MISSING:  return "Hardware missing";
+    case SCPI_ERROR_QUEUE_OVERFLOW:    return "Queue overflow";
+    case SCPI_ERROR_INPUT_OVERRUN:     return "Input buffer overrun";
+    case SCPI_ERROR_QUERY_INTERRUPTED: return "Query INTERRUPTED";
+    default:                           return "Error";
+  }
+}
+
+// Called from cmd_execute and session_task, in usbtmc_app_task_iter only.
+// Never blocks or allocates.
+static void error_push(usbtmc_session_t *s, int16_t code)
+{
+  uint8_t head = s->error_head;
+  s->esr |= error_esr_bit(code);
+  if ((uint8_t)(head - s->error_tail) >= ERROR_QUEUE_LEN)
+  {
+    s->error_overflows++;
+    return;
+  }
+  s->error_queue[head & (ERROR_QUEUE_LEN - 1u)] = code;
+  s->error_head = (uint8_t)(head + 1u); // publish after the entry is written
+}
+
+// called from usbtmc_app_task_iter only
+static int16_t error_pop(usbtmc_session_t *s)
+{
+  uint8_t tail = s->error_tail;
+  if (tail != s->error_head)
+  {
+    int16_t code = s->error_queue[tail & (ERROR_QUEUE_LEN - 1u)];
+    s->error_tail = (uint8_t)(tail + 1u);
+    return code;
+  }
+  if (s->error_overflows != s->error_overflows_seen)
+  {
+    s->error_overflows_seen = s->error_overflows;
+    return SCPI_ERROR_QUEUE_OVERFLOW;
+  }
+  return SCPI_ERROR_NONE;
+}
+
+static bool error_pending(usbtmc_session_t const *s)
+{
+  return (s->error_tail != s->error_head) || (s->error_overflows != s->error_overflows_seen);
+}
+
+// IEEE 488.2 status byte, with bit 6 as the master summary status
+static uint8_t status_byte(usbtmc_session_t const *s)
+{
+  uint8_t stb = s->status & IEEE4882_STB_MAV;
+  if (error_pending(s))
+  {
+    stb |= IEEE4882_STB_EAV;
+  }
+  if (adc_verify_failed() & s->channels)
+  {
+    stb |= IEEE4882_STB_QUESTIONABLE; // a contact did not follow its relay
+  }
+#if BOARD_RELAY_EXPANDERS
+  if ((expander_failed() << RELAY_GPIO_COUNT) & s->channels)
+  {
+    stb |= IEEE4882_STB_QUESTIONABLE; // an expander did not acknowledge
+  }
+#endif
+  if (trigger_count() != s->trig_seen)
+  {
+    stb |= IEEE4882_STB_TRIG;
+  }
+  if (relay_gen != s->gen_seen)
+  {
+    stb |= IEEE4882_STB_RELAY;
+  }
+  if (s->esr & s->ese)
+  {
+    stb |= IEEE4882_STB_SER;
+  }
+  if (stb & s->sre)
+  {
+    stb |= IEEE4882_STB_SRQ;
+  }
+  return stb;
+}
+
+// Logical mask (bit n-1 = RELAYn) to PORT group 0 pins
+static uint32_t relay_port_bits(uint32_t mask)
+{
+  uint32_t bits = 0;
+  for (uint8_t i = 0; i < RELAY_GPIO_COUNT; i++)
+  {
+    if (mask & (1u << i))
+    {
+      bits |= relay_ports[i];
+    }
+  }
+  return bits;
+}
+
+// Clear then set channels. All relay pins change with a single write of the
+// OUT register, expander channels follow with the next I2C transactions and
+// shift register channels with the next latch pulse.
+// Safe to call from interrupt context (pulse return edges).
+// Every change is recorded in the trace ring with its cause, counted in
+// relay_gen and starts an armed DAC waveform.
+void relay_update_mask(uint32_t clear_mask, uint32_t set_mask, uint8_t cause)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t mask     = ((relay_mask & ~clear_mask) | set_mask) & relay_fitted;
+  uint32_t all_bits = relay_port_bits(RELAY_ALL_MASK);
+  uint32_t on_bits  = relay_port_bits(mask);
+  uint32_t out      = PORT->Group[0].OUT.reg & ~all_bits;
+  if (ACTIVE_LEVEL == 1)
   {
-    PORT->Group[0].OUTCLR.reg = RELAY1_PORT | RELAY2_PORT | RELAY3_PORT | RELAY4_PORT | RELAY5_PORT | RELAY6_PORT | RELAY7_PORT | RELAY8_PORT; // initialized low
+    out |= on_bits;
   }
   else
   {
-    PORT->Group[0].OUTSET.reg = RELAY1_PORT | RELAY2_PORT | RELAY3_PORT | RELAY4_PORT | RELAY5_PORT | RELAY6_PORT | RELAY7_PORT | RELAY8_PORT; // initialized high
+    out |= all_bits & ~on_bits;
+  }
+  PORT->Group[0].OUT.reg = out;
+#if BOARD_RELAY_EXPANDERS
+  expander_write(mask >> RELAY_GPIO_COUNT);
+#endif
+#if BOARD_RELAY_SHIFT_CHANNELS
+  shift_write(mask >> RELAY_FIXED_COUNT);
+#endif
+  if (mask != relay_mask)
+  {
+    dac_relay_edge();
+    trace_record(relay_mask, mask, cause);
+    relay_gen++;
+  }
+  relay_mask = mask;
+  __set_PRIMASK(primask);
+}
+
+// RELAY:MASK, shared by the SCPI and HID interfaces. PWM channels go back to
+// GPIO, the power budget applies. False when mask has channels this board
+// does not have or closes two members of an exclusive group.
+bool relay_set_mask(uint32_t mask, uint8_t cause)
+{
+  return relay_set_mask_in(relay_fitted, mask, cause);
+}
+
+// RELAY:MASK of a bank interface, channels outside scope keep their state
+static bool relay_set_mask_in(uint32_t scope, uint32_t mask, uint8_t cause)
+{
+  if ((mask & ~scope) || route_conflict((relay_read_mask() & ~scope) | mask))
+  {
+    return false;
+  }
+  relay_pwm_stop(scope);
+  relay_apply(scope & ~mask, mask, 0, cause);
+  return true;
+}
+
+void relay_write_mask(uint32_t mask, uint8_t cause)
+{
+  relay_update_mask(RELAY_ALL_MASK, mask, cause);
+}
+
+uint32_t relay_read_mask(void)
+{
+  return relay_mask;
+}
+
+// *SAV, the relay state of pulses and power budget steps still under way is
+// saved as it is now
+static void preset_save(preset_t *p)
+{
+  p->mask = relay_read_mask();
+  memcpy(p->groups, route_groups, sizeof(p->groups));
+  p->budget_ma = power_get_budget();
+  for (uint8_t i = 0; i < RELAY_COUNT; i++)
+  {
+    power_get_channel((uint8_t)(i + 1u), &p->pull_ma[i], &p->hold_ma[i], &p->pull_us[i]);
+  }
+  p->pwm = relay_pwm_active();
+  for (uint8_t i = 0; i < RELAY_GPIO_COUNT; i++)
+  {
+    p->pwm_duty[i] = relay_pwm_get_duty((uint8_t)(i + 1u));
+    p->pwm_freq[i] = relay_pwm_get_freq((uint8_t)(i + 1u));
+  }
+}
+
+// *RCL. The groups and the budget are restored first, so the relays change
+// under the rules they were saved with: one relay_apply, a single OUT write
+// without a budget. Channels that stay in PWM mode keep running. A bank
+// interface only recalls its own channels, groups and budget are the board's.
+static void preset_recall(usbtmc_session_t const *s, preset_t const *p)
+{
+  uint32_t scope = s->channels;
+  if (s == &sessions[0])
+  {
+    memcpy(route_groups, p->groups, sizeof(route_groups));
+    power_set_budget(p->budget_ma);
+  }
+  for (uint8_t i = 0; i < RELAY_COUNT; i++)
+  {
+    if (scope & (1u << i))
+    {
+      power_set_channel((uint8_t)(i + 1u), p->pull_ma[i], p->hold_ma[i], p->pull_us[i]);
+    }
+  }
+  relay_pwm_stop(scope & ~p->pwm);
+  relay_apply(scope & ~p->mask, scope & p->mask, 0, TRACE_RCL);
+  for (uint8_t i = 0; i < RELAY_GPIO_COUNT; i++)
+  {
+    if (scope & p->pwm & (1u << i))
+    {
+      relay_pwm_set_freq((uint8_t)(i + 1u), p->pwm_freq[i]);
+      relay_pwm_set_duty((uint8_t)(i + 1u), p->pwm_duty[i]);
+    }
+  }
+}
+
+// SYST:CHAN:COUN, channels above count are turned off and no longer accepted
+// by any interface. The shift register chain is cut to the fitted channels.
+static void relay_set_channels(uint8_t count)
+{
+  uint32_t fitted  = RELAY_ALL_MASK >> (RELAY_COUNT - count);
+  uint32_t removed = RELAY_ALL_MASK & ~fitted;
+  relay_schedule_cancel(removed);
+  relay_pwm_stop(removed);
+  relay_channels = count;
+  relay_fitted   = fitted;
+  relay_update_mask(removed, 0, TRACE_CHAN);
+  for (uint8_t i = 0; i < USBTMC_SESSIONS; i++)
+  {
+    sessions[i].channels = session_channels[i] & fitted;
+  }
+#if BOARD_RELAY_SHIFT_CHANNELS
+  shift_set_channels((uint8_t)(count - RELAY_FIXED_COUNT));
+#endif
+}
+
+void gpio_setup(void) {
+  nvm_setup();
+#if BOARD_RELAY_EXPANDERS
+  expander_setup();
+#endif
+#if BOARD_RELAY_SHIFT_CHANNELS
+  shift_setup();
+#endif
+  uint8_t channels = nvm_channel_count();  // 0 until SYST:CHAN:COUN is saved
+  if (channels && channels >= RELAY_FIXED_COUNT && channels < RELAY_COUNT)
+  {
+    relay_set_channels(channels);
   }
+  relay_write_mask(nvm_power_on_mask(), TRACE_POWER_ON);                            // power-on state, all off by default
+  PORT->Group[0].DIRSET.reg = relay_port_bits(RELAY_ALL_MASK);      // as output
 }
 
 char * get_value(char *in_string) {
@@ -719,7 +2980,7 @@ char * get_command(char *in_string, char *ptr_value) {
 }
 
 void samd21_unique_id( char * id_buff )
-{   
+{
     volatile uint32_t val0, val1, val2, val3;
     volatile uint32_t *val0_ptr = (volatile uint32_t *)0x0080A00C;
     volatile uint32_t *val1_ptr = (volatile uint32_t *)0x0080A040;
@@ -0,0 +1,3 @@
+// USBTMC interface of channel bank 1, see usbtmc_bank.h
+#define USBTMC_BANK 1
+#include "usbtmc_bank.h"
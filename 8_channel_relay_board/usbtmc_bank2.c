@@ -0,0 +1,3 @@
+// USBTMC interface of channel bank 2, see usbtmc_bank.h
+#define USBTMC_BANK 2
+#include "usbtmc_bank.h"
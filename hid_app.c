@@ -0,0 +1,80 @@
+#include "tusb.h"
+#include "usbtmc_app.h"
+
+// Vendor-defined HID interface next to USBTMC. HID needs no driver or VISA
+// layer on the host and its interrupt endpoints are polled every 1 ms, a mask
+// change is one OUT report instead of a bulk write and read through VISA.
+//
+// Both reports are 8 bytes without a report ID, a little endian relay mask
+// with bit 0 = RELAY1:
+//   OUT report  new relay mask, applied like RELAY:MASK
+//   IN report   relay mask after every OUT report, and whenever the relays
+//               change by other means (SCPI, pulse ends, staggered steps)
+// A rejected mask (missing channels, two members of an exclusive group) is
+// answered with the unchanged relay mask.
+#define HID_REPORT_LEN   8u
+
+static uint32_t hid_sent_mask;
+static bool     hid_report_due = true;
+
+static void hid_fill_report(uint8_t *report)
+{
+  uint32_t mask = relay_read_mask();
+  for (uint8_t i = 0; i < HID_REPORT_LEN; i++)
+  {
+    report[i] = i < 4u ? (uint8_t)(mask >> (8u * i)) : 0u;
+  }
+}
+
+// Called from the main loop, sends the IN report when one is due
+void hid_task(void)
+{
+  uint8_t report[HID_REPORT_LEN];
+  if (!tud_hid_ready() || (!hid_report_due && relay_read_mask() == hid_sent_mask))
+  {
+    return;
+  }
+  hid_fill_report(report);
+  if (tud_hid_report(0, report, HID_REPORT_LEN))
+  {
+    hid_sent_mask  = relay_read_mask();
+    hid_report_due = false;
+  }
+}
+
+// GET_REPORT on the control endpoint, the current relay mask
+uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t *buffer, uint16_t reqlen)
+{
+  (void)instance;
+  (void)report_id;
+  (void)report_type;
+  if (reqlen < HID_REPORT_LEN)
+  {
+    return 0;
+  }
+  hid_fill_report(buffer);
+  return HID_REPORT_LEN;
+}
+
+// OUT report from the interrupt endpoint or SET_REPORT. Runs in tud_task, the
+// same context as the SCPI command execution, so both use the relay layer
+// without locking. It does not wait in the SCPI command queue.
+void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t bufsize)
+{
+  (void)instance;
+  (void)report_id;
+  (void)report_type;
+  if (bufsize != HID_REPORT_LEN)
+  {
+    return;
+  }
+  uint32_t mask = (uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) |
+                  ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+  if (buffer[4] | buffer[5] | buffer[6] | buffer[7])
+  {
+    mask = 0xFFFFFFFFu; // channels this board can not have
+  }
+  relay_set_mask(mask, TRACE_HID);
+  hid_report_due = true;
+  hid_task();
+}
@@ -0,0 +1,10 @@
+// Host build of the firmware, see relay_host.c
+#ifndef HOST_BOARD_H
+#define HOST_BOARD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+uint32_t board_millis(void);
+
+#endif
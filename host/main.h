@@ -0,0 +1,7 @@
+// Host build of the firmware, see relay_host.c
+#ifndef HOST_MAIN_H
+#define HOST_MAIN_H
+
+void led_indicator_pulse(void);
+
+#endif
@@ -0,0 +1,407 @@
+// The firmware built for the host, one relay board per process, for
+// relay_vserver.py. usbtmc_app.c and the relay_* modules are compiled
+// unchanged against the peripheral stubs in this directory: the registers are
+// structs in RAM (sam.h), and this file takes the place of main.c, TinyUSB and
+// the flash settings of relay_nvm.c.
+//
+// The board is the main loop of main.c. TC4, the microsecond timebase, counts
+// the host's monotonic clock, and the SOFs of the frames that passed are fed
+// to timer_sof before each pass. Due relay edges are applied at the next pass
+// (TC4_Handler), so a board that is left alone catches up when it is next
+// asked. Nothing else completes: no DMA block, no EIC edge, the ADC reads 0
+// and an expander or shift register write never finishes.
+//
+// stdin carries one message at a time, "W <length>\n" or "Q <length>\n" and
+// the message bytes. W is a Bulk-OUT message, Q is one followed by a Bulk-IN
+// request. The answer on stdout is "<length>\n" and the response bytes, empty
+// for W and for a query the firmware did not answer, the host would have
+// timed out.
+//
+//   cc -std=gnu99 -Ihost -I<board tree> host/relay_host.c <board tree>/*.c
+//   (without main.c, usb_descriptors.c, relay_nvm.c and usbtmc_bank*.c)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tusb.h"
+#include "device/usbd_pvt.h"
+#include "bsp/board.h"
+#include "main.h"
+#include "usbtmc_app.h"
+#include "sam.h"
+
+#define HOST_PACKET_LEN     64u    // full speed bulk endpoint
+#define HOST_HEADER_LEN     12u    // USBTMC header in the first packet
+#define HOST_PASSES_MAX     1000u  // main loop passes for the endpoint to be armed again
+#define HOST_READ_PASSES    8u     // passes for a response, the firmware answers in 2
+#define HOST_SOF_FRAMES     16u    // SOF_LOCK_FRAMES of relay_timer.c
+
+//--------------------------------------------------------------------+
+// Peripherals
+//--------------------------------------------------------------------+
+static Port    port_s;
+static Dac     dac_s;
+static Gclk    gclk_s;
+static Pm      pm_s;
+static Tc      tc3_s, tc4_s, tc5_s;
+static Tcc     tcc0_s, tcc1_s, tcc2_s;
+static Sysctrl sysctrl_s;
+static Dmac    dmac_s;
+static Adc     adc_s;
+static Evsys   evsys_s;
+static Eic     eic_s;
+static Sercom  sercom0_s, sercom1_s, sercom2_s, sercom3_s;
+static Usb     usb_s;
+
+Port    *PORT    = &port_s;
+Dac     *DAC     = &dac_s;
+Gclk    *GCLK    = &gclk_s;
+Pm      *PM      = &pm_s;
+Tc      *TC3     = &tc3_s, *TC4 = &tc4_s, *TC5 = &tc5_s;
+Tcc     *TCC0    = &tcc0_s, *TCC1 = &tcc1_s, *TCC2 = &tcc2_s;
+Sysctrl *SYSCTRL = &sysctrl_s;
+Dmac    *DMAC    = &dmac_s;
+Adc     *ADC     = &adc_s;
+Evsys   *EVSYS   = &evsys_s;
+Eic     *EIC     = &eic_s;
+Sercom  *SERCOM0 = &sercom0_s, *SERCOM1 = &sercom1_s, *SERCOM2 = &sercom2_s, *SERCOM3 = &sercom3_s;
+Usb     *USB     = &usb_s;
+uint32_t host_adc_fuses[2];
+
+void NVIC_EnableIRQ(IRQn_Type irq)                       { (void)irq; }
+void NVIC_DisableIRQ(IRQn_Type irq)                      { (void)irq; }
+void NVIC_ClearPendingIRQ(IRQn_Type irq)                 { (void)irq; }
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority)  { (void)irq; (void)priority; }
+
+void TC4_Handler(void);
+
+//--------------------------------------------------------------------+
+// Clocks
+//--------------------------------------------------------------------+
+static uint64_t host_start_us;
+static uint64_t host_frame;      // last frame whose SOF timer_sof has seen
+
+static uint64_t host_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u - host_start_us;
+}
+
+uint32_t board_millis(void)
+{
+  return (uint32_t)(host_us() / 1000u);
+}
+
+// Brings TC4 up to the host clock. The SOFs of the frames since the last call
+// go to timer_sof first, at most the last HOST_SOF_FRAMES, which are enough to
+// lock again after a long pause. Then the edges that are due are applied.
+static void host_clock(void)
+{
+  uint64_t now   = host_us();
+  uint64_t frame = now / TIMER_FRAME_US;
+  uint64_t first = frame - host_frame > HOST_SOF_FRAMES ? frame - HOST_SOF_FRAMES + 1u : host_frame + 1u;
+  for (uint64_t f = first; f <= frame; f++)
+  {
+    TC4->COUNT32.COUNT.reg = (uint32_t)(f * TIMER_FRAME_US);
+    timer_sof((uint32_t)f);
+  }
+  host_frame = frame;
+  TC4->COUNT32.COUNT.reg = (uint32_t)now;
+  if (relay_schedule_pending() | relay_schedule_pending_set())
+  {
+    TC4_Handler();
+  }
+}
+
+//--------------------------------------------------------------------+
+// Settings, relay_nvm.c keeps them in flash
+//--------------------------------------------------------------------+
+// A host process can not write into its own image, the settings live as long
+// as the process, which is the power cycle of a virtual board
+static bool     nvm_last;
+static uint32_t nvm_mask;
+static uint8_t  nvm_channels;
+
+void nvm_setup(void)
+{
+}
+
+uint32_t nvm_power_on_mask(void)
+{
+  return nvm_mask;
+}
+
+bool nvm_power_on_last(void)
+{
+  return nvm_last;
+}
+
+void nvm_set_power_on(bool last, uint32_t mask)
+{
+  nvm_last = last;
+  nvm_mask = last ? relay_read_mask() : mask;
+}
+
+uint8_t nvm_channel_count(void)
+{
+  return nvm_channels;
+}
+
+void nvm_set_channels(uint8_t count)
+{
+  nvm_channels = count;
+}
+
+void nvm_task(void)
+{
+  if (nvm_last)
+  {
+    nvm_mask = relay_read_mask() & ~relay_schedule_pending();
+  }
+}
+
+//--------------------------------------------------------------------+
+// USB
+//--------------------------------------------------------------------+
+static bool     usb_armed;       // Bulk-OUT endpoint armed by start_bus_read
+static uint8_t *usb_rx;          // Bulk-IN data of the current read
+static size_t   usb_rx_len;
+static size_t   usb_rx_size;
+static bool     usb_tx_seen;     // a transmit since the last Bulk-IN request
+static bool     usb_tx_eom;
+
+bool tud_usbtmc_start_bus_read(void)
+{
+  usb_armed = true;
+  return true;
+}
+
+bool tud_usbtmc_transmit_dev_msg_data(const void *data, size_t len, bool endOfMessage, bool usingTermChar)
+{
+  (void)usingTermChar;
+  if (len > usb_rx_size - usb_rx_len)
+  {
+    len = usb_rx_size - usb_rx_len;
+  }
+  memcpy(&usb_rx[usb_rx_len], data, len);
+  usb_rx_len += len;
+  usb_tx_seen = true;
+  usb_tx_eom  = endOfMessage;
+  return true;
+}
+
+bool tud_usbtmc_transmit_notification_data(const void *data, size_t len)
+{
+  (void)data;
+  (void)len;
+  return true; // SRQ, nobody listens on the interrupt endpoint
+}
+
+bool tud_hid_ready(void)
+{
+  return false; // the HID interface is not served
+}
+
+bool tud_hid_report(uint8_t report_id, void const *report, uint16_t len)
+{
+  (void)report_id;
+  (void)report;
+  (void)len;
+  return false;
+}
+
+void led_indicator_pulse(void)
+{
+}
+
+// Only the main USBTMC interface is served, the bank drivers are never opened
+#define HOST_BANK_DRIVER(n) \
+  void usbtmcd_init_cb_bank##n(void) {} \
+  void usbtmcd_reset_cb_bank##n(uint8_t rhport) { (void)rhport; } \
+  uint16_t usbtmcd_open_cb_bank##n(uint8_t rhport, tusb_desc_interface_t const *itf_desc, uint16_t max_len) \
+  { (void)rhport; (void)itf_desc; (void)max_len; return 0; } \
+  bool usbtmcd_control_xfer_cb_bank##n(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request) \
+  { (void)rhport; (void)stage; (void)request; return false; } \
+  bool usbtmcd_xfer_cb_bank##n(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes) \
+  { (void)rhport; (void)ep_addr; (void)result; (void)xferred_bytes; return false; }
+
+#if BOARD_USBTMC_BANKS
+HOST_BANK_DRIVER(1)
+#if BOARD_USBTMC_BANKS > 1
+HOST_BANK_DRIVER(2)
+#endif
+#endif
+
+// TinyUSB's callbacks, defined in usbtmc_app.c
+void     tud_usbtmc_open_cb(uint8_t interface_id);
+bool     tud_usbtmc_msgBulkOut_start_cb(usbtmc_msg_request_dev_dep_out const *msgHeader);
+bool     tud_usbtmc_msg_data_cb(void *data, size_t len, bool transfer_complete);
+bool     tud_usbtmc_msgBulkIn_request_cb(usbtmc_msg_request_dev_dep_in const *request);
+bool     tud_usbtmc_msgBulkIn_complete_cb(void);
+bool     tud_usbtmc_initiate_clear_cb(uint8_t *tmcResult);
+bool     tud_usbtmc_check_clear_cb(usbtmc_get_clear_status_rsp_t *rsp);
+bool     tud_usbtmc_initiate_abort_bulk_in_cb(uint8_t *tmcResult);
+bool     tud_usbtmc_check_abort_bulk_in_cb(usbtmc_check_abort_bulk_rsp_t *rsp);
+bool     tud_usbtmc_initiate_abort_bulk_out_cb(uint8_t *tmcResult);
+bool     tud_usbtmc_check_abort_bulk_out_cb(usbtmc_check_abort_bulk_rsp_t *rsp);
+usbd_class_driver_t const * usbd_app_driver_get_cb(uint8_t *driver_count);
+
+//--------------------------------------------------------------------+
+// Main loop
+//--------------------------------------------------------------------+
+static void host_pass(void)
+{
+  host_clock();
+  usbtmc_app_task_iter();
+  hid_task();
+  adc_task();
+  nvm_task();
+}
+
+// Runs the main loop until the firmware arms the Bulk-OUT endpoint. One that
+// stays held is cleared the way a host recovers from a write timeout.
+static void host_wait_armed(void)
+{
+  for (uint32_t i = 0; !usb_armed && i < HOST_PASSES_MAX; i++)
+  {
+    host_pass();
+  }
+  if (!usb_armed)
+  {
+    uint8_t                       result;
+    usbtmc_get_clear_status_rsp_t rsp;
+    tud_usbtmc_initiate_clear_cb(&result);
+    tud_usbtmc_check_clear_cb(&rsp);
+    usb_armed = true;
+  }
+}
+
+// A message in packets, the first one after the USBTMC header
+static void host_write(uint8_t *msg, size_t len)
+{
+  usbtmc_msg_request_dev_dep_out header = { .TransferSize = (uint32_t)len, .bmTransferAttributes.EOM = 1 };
+  uint8_t                        result;
+  usbtmc_check_abort_bulk_rsp_t  rsp;
+  size_t                         sent  = 0;
+  size_t                         chunk = HOST_PACKET_LEN - HOST_HEADER_LEN;
+
+  host_wait_armed();
+  usb_armed = false;
+  bool ok = tud_usbtmc_msgBulkOut_start_cb(&header);
+  while (ok)
+  {
+    if (sent)
+    {
+      host_wait_armed();
+      usb_armed = false;
+    }
+    chunk = len - sent < chunk ? len - sent : chunk;
+    ok    = tud_usbtmc_msg_data_cb(&msg[sent], chunk, sent + chunk == len);
+    sent += chunk;
+    chunk = HOST_PACKET_LEN;
+    if (sent == len)
+    {
+      break;
+    }
+  }
+  if (!ok) // stalled, the host aborts the transfer
+  {
+    tud_usbtmc_initiate_abort_bulk_out_cb(&result);
+    tud_usbtmc_check_abort_bulk_out_cb(&rsp);
+  }
+  host_wait_armed();
+  host_pass(); // executes it
+}
+
+// Bulk-IN requests until the end of the message, the length read
+static size_t host_read(uint8_t *buf, size_t size)
+{
+  usbtmc_msg_request_dev_dep_in request = { 0 };
+  usb_rx      = buf;
+  usb_rx_len  = 0;
+  usb_rx_size = size;
+  usb_tx_eom  = false;
+  while (!usb_tx_eom && usb_rx_len < size)
+  {
+    request.TransferSize = (uint32_t)(size - usb_rx_len);
+    usb_tx_seen = false;
+    tud_usbtmc_msgBulkIn_request_cb(&request);
+    for (uint32_t i = 0; !usb_tx_seen && i < HOST_READ_PASSES; i++)
+    {
+      host_pass();
+    }
+    if (!usb_tx_seen) // nothing to read, the host read times out
+    {
+      uint8_t                       result;
+      usbtmc_check_abort_bulk_rsp_t rsp;
+      tud_usbtmc_initiate_abort_bulk_in_cb(&result);
+      tud_usbtmc_check_abort_bulk_in_cb(&rsp);
+      break;
+    }
+    tud_usbtmc_msgBulkIn_complete_cb();
+  }
+  return usb_rx_len;
+}
+
+// Power-on and enumeration as in main.c
+static void host_boot(void)
+{
+  host_start_us = host_us();
+  host_frame    = (uint64_t)0 - HOST_SOF_FRAMES;
+  timer_setup();
+  gpio_setup();
+  boot_mark(BOOT_GPIO);
+  timer_clock_dfll();
+  boot_mark(BOOT_BOARD);
+  boot_mark(BOOT_TUSB);
+
+  uint8_t                    count;
+  usbd_class_driver_t const *drivers = usbd_app_driver_get_cb(&count);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    drivers[i].reset(0); // bus reset
+  }
+  tud_usbtmc_open_cb(ITF_NUM_USBTMC);
+  boot_mark(BOOT_MOUNT);
+  pwm_setup();
+  adc_setup();
+  dac_setup();
+  input_setup();
+  trigger_setup();
+}
+
+int main(void)
+{
+  static uint8_t response[BLOCK_OUT_LEN + HOST_PACKET_LEN];
+  uint8_t *msg  = NULL;
+  size_t   size = 0;
+  char     line[32];
+
+  host_boot();
+  while (fgets(line, sizeof(line), stdin))
+  {
+    char          kind;
+    unsigned long len;
+    if (sscanf(line, "%c %lu", &kind, &len) != 2 || (kind != 'W' && kind != 'Q'))
+    {
+      return 1;
+    }
+    if (len + 1u > size)
+    {
+      size = len + 1u;
+      msg  = realloc(msg, size);
+    }
+    if (!msg || fread(msg, 1, len, stdin) != len)
+    {
+      return 1;
+    }
+    host_pass();
+    host_write(msg, len);
+    size_t n = kind == 'Q' ? host_read(response, sizeof(response)) : 0u;
+    printf("%zu\n", n);
+    fwrite(response, 1, n, stdout);
+    fflush(stdout);
+  }
+  return 0;
+}
@@ -0,0 +1,265 @@
+// Host build of the firmware, see relay_host.c. The SAMD21 peripherals the
+// modules touch, each instance is a struct in RAM: writes are kept, nothing
+// happens in hardware, and status bits read as written (SYNCBUSY clear, no
+// DMA or interrupt ever completes). Only the registers and bit fields the
+// firmware uses are here.
+#ifndef HOST_SAM_H
+#define HOST_SAM_H
+
+#include <stdint.h>
+
+#define __IO volatile
+
+/* --- PORT, DAC --- */
+#define PORT_PA02 (1u<<2)
+#define PORT_PA03 (1u<<3)
+#define PORT_PA04 (1u<<4)
+#define PORT_PA05 (1u<<5)
+#define PORT_PA06 (1u<<6)
+#define PORT_PA07 (1u<<7)
+#define PORT_PA08 (1u<<8)
+#define PORT_PA09 (1u<<9)
+#define PORT_PA10 (1u<<10)
+#define PORT_PA11 (1u<<11)
+#define PORT_PA16 (1u<<16)
+#define PORT_PA17 (1u<<17)
+#define PORT_PA18 (1u<<18)
+#define PORT_PA19 (1u<<19)
+typedef struct { __IO union{uint32_t reg;} DIR, DIRCLR, DIRSET, DIRTGL, OUT, OUTCLR, OUTSET, OUTTGL, IN, CTRL, WRCONFIG; uint32_t _r; __IO union{uint8_t reg; struct{uint8_t PMUXE:4, PMUXO:4;} bit;} PMUX[16]; __IO union{uint8_t reg; struct{uint8_t PMUXEN:1, INEN:1, PULLEN:1;} bit;} PINCFG[32]; } PortGroup;
+typedef struct { PortGroup Group[2]; } Port;
+typedef struct { __IO union{uint8_t reg;} CTRLA, CTRLB, EVCTRL, _r0, INTENCLR, INTENSET, INTFLAG; __IO union{uint8_t reg; struct{uint8_t :7; uint8_t SYNCBUSY:1;} bit;} STATUS; __IO union{uint16_t reg;} DATA; uint8_t _r1[2]; __IO union{uint16_t reg;} DATABUF; } Dac;
+extern Port *PORT; extern Dac *DAC;
+/* --- core --- */
+static inline uint32_t __get_PRIMASK(void){return 0;} // one thread, no interrupts to mask
+static inline void __set_PRIMASK(uint32_t x){(void)x;}
+static inline void __disable_irq(void){}
+static inline void __enable_irq(void){}
+static inline void __DMB(void){}
+typedef enum { TC3_IRQn=18, TC4_IRQn=19, TC5_IRQn=20, EIC_IRQn=4, DMAC_IRQn=6, TCC0_IRQn=15, TCC1_IRQn=16, TCC2_IRQn=17, ADC_IRQn=23, USB_IRQn=7, SERCOM1_IRQn=10, SERCOM2_IRQn=11, SERCOM0_IRQn=9, SERCOM3_IRQn=12, NVMCTRL_IRQn=5, EVSYS_IRQn=8 } IRQn_Type;
+void NVIC_EnableIRQ(IRQn_Type); void NVIC_DisableIRQ(IRQn_Type); void NVIC_SetPriority(IRQn_Type, uint32_t); void NVIC_ClearPendingIRQ(IRQn_Type);
+/* --- GCLK --- */
+typedef struct { __IO union{uint8_t reg;} CTRL; __IO union{uint8_t reg; struct{uint8_t :7; uint8_t SYNCBUSY:1;} bit;} STATUS; __IO union{uint16_t reg;} CLKCTRL; __IO union{uint32_t reg;} GENCTRL; __IO union{uint32_t reg;} GENDIV; } Gclk;
+extern Gclk *GCLK;
+#define GCLK_GENDIV_ID(x) ((uint32_t)(x))
+#define GCLK_GENDIV_DIV(x) ((uint32_t)(x)<<8)
+#define GCLK_GENCTRL_ID(x) ((uint32_t)(x))
+#define GCLK_GENCTRL_SRC_DFLL48M (7u<<8)
+#define GCLK_GENCTRL_SRC_OSC8M (6u<<8)
+#define GCLK_GENCTRL_SRC_OSCULP32K (3u<<8)
+#define GCLK_GENCTRL_GENEN (1u<<16)
+#define GCLK_GENCTRL_IDC (1u<<17)
+#define GCLK_CLKCTRL_ID(x) ((uint16_t)(x))
+#define GCLK_CLKCTRL_ID_TC4_TC5 GCLK_CLKCTRL_ID(0x1C)
+#define GCLK_CLKCTRL_ID_TC3_TCC2 GCLK_CLKCTRL_ID(0x1B)
+#define GCLK_CLKCTRL_ID_TCC0_TCC1 GCLK_CLKCTRL_ID(0x1A)
+#define GCLK_CLKCTRL_ID_TC6_TC7 GCLK_CLKCTRL_ID(0x1D)
+#define GCLK_CLKCTRL_ID_EIC GCLK_CLKCTRL_ID(0x05)
+#define GCLK_CLKCTRL_ID_ADC GCLK_CLKCTRL_ID(0x1E)
+#define GCLK_CLKCTRL_ID_DAC GCLK_CLKCTRL_ID(0x21)
+#define GCLK_CLKCTRL_ID_EVSYS_0 GCLK_CLKCTRL_ID(0x07)
+#define GCLK_CLKCTRL_ID_SERCOM0_CORE GCLK_CLKCTRL_ID(0x14)
+#define GCLK_CLKCTRL_ID_SERCOM1_CORE GCLK_CLKCTRL_ID(0x15)
+#define GCLK_CLKCTRL_ID_SERCOM2_CORE GCLK_CLKCTRL_ID(0x16)
+#define GCLK_CLKCTRL_ID_SERCOMX_SLOW GCLK_CLKCTRL_ID(0x13)
+#define GCLK_CLKCTRL_GEN_GCLK0 (0u<<8)
+#define GCLK_CLKCTRL_GEN_GCLK3 (3u<<8)
+#define GCLK_CLKCTRL_GEN_GCLK4 (4u<<8)
+#define GCLK_CLKCTRL_GEN_GCLK5 (5u<<8)
+#define GCLK_CLKCTRL_CLKEN (1u<<14)
+/* --- PM --- */
+typedef struct { __IO union{uint32_t reg;} APBAMASK, APBBMASK, APBCMASK, AHBMASK; } Pm;
+extern Pm *PM;
+#define PM_APBCMASK_TC3 (1u<<11)
+#define PM_APBCMASK_TC4 (1u<<12)
+#define PM_APBCMASK_TC5 (1u<<13)
+#define PM_APBCMASK_TCC0 (1u<<8)
+#define PM_APBCMASK_TCC1 (1u<<9)
+#define PM_APBCMASK_TCC2 (1u<<10)
+#define PM_APBCMASK_ADC (1u<<16)
+#define PM_APBCMASK_DAC (1u<<18)
+#define PM_APBCMASK_EVSYS (1u<<1)
+#define PM_APBCMASK_SERCOM0 (1u<<2)
+#define PM_APBCMASK_SERCOM1 (1u<<3)
+#define PM_APBCMASK_SERCOM2 (1u<<4)
+#define PM_APBAMASK_EIC (1u<<6)
+#define PM_APBBMASK_DMAC (1u<<4)
+#define PM_APBBMASK_NVMCTRL (1u<<2)
+#define PM_AHBMASK_DMAC (1u<<5)
+/* --- TC --- */
+typedef struct { __IO union{uint16_t reg;} CTRLA; __IO union{uint16_t reg;} READREQ; __IO union{uint8_t reg;} CTRLBCLR, CTRLBSET, CTRLC, _r0, DBGCTRL, _r1; __IO union{uint16_t reg;} EVCTRL; __IO union{uint8_t reg; struct{uint8_t OVF:1,ERR:1,_r:1,SYNCRDY:1,MC0:1,MC1:1;} bit;} INTENCLR, INTENSET, INTFLAG; __IO union{uint8_t reg; struct{uint8_t :7; uint8_t SYNCBUSY:1;} bit;} STATUS; __IO union{uint32_t reg;} COUNT; uint32_t _r2; __IO union{uint32_t reg;} PER; __IO union{uint32_t reg;} CC[2]; } TcCount32;
+typedef struct { __IO union{uint16_t reg;} CTRLA; __IO union{uint16_t reg;} READREQ; __IO union{uint8_t reg;} CTRLBCLR, CTRLBSET, CTRLC, _r0, DBGCTRL, _r1; __IO union{uint16_t reg;} EVCTRL; __IO union{uint8_t reg; struct{uint8_t OVF:1,ERR:1,_r:1,SYNCRDY:1,MC0:1,MC1:1;} bit;} INTENCLR, INTENSET, INTFLAG; __IO union{uint8_t reg; struct{uint8_t :7; uint8_t SYNCBUSY:1;} bit;} STATUS; __IO union{uint16_t reg;} COUNT; uint8_t _r2[6]; __IO union{uint16_t reg;} CC[2]; } TcCount16;
+typedef union { TcCount32 COUNT32; TcCount16 COUNT16; } Tc;
+extern Tc *TC3, *TC4, *TC5;
+#define TC_CTRLA_ENABLE (1u<<1)
+#define TC_CTRLA_SWRST (1u<<0)
+#define TC_CTRLA_MODE_COUNT16 (0u<<2)
+#define TC_CTRLA_MODE_COUNT32 (2u<<2)
+#define TC_CTRLA_WAVEGEN_NFRQ (0u<<5)
+#define TC_CTRLA_WAVEGEN_MFRQ (1u<<5)
+#define TC_CTRLA_PRESCALER_DIV1 (0u<<8)
+#define TC_CTRLA_PRESCALER_DIV16 (4u<<8)
+#define TC_CTRLA_PRESCSYNC_PRESC (1u<<12)
+#define TC_READREQ_RREQ (1u<<15)
+#define TC_READREQ_RCONT (1u<<14)
+#define TC_READREQ_ADDR(x) ((uint16_t)(x))
+#define TC_COUNT32_COUNT_OFFSET 0x10
+#define TC_COUNT16_COUNT_OFFSET 0x10
+#define TC_INTFLAG_OVF (1u<<0)
+#define TC_INTFLAG_MC0 (1u<<4)
+#define TC_INTFLAG_MC1 (1u<<5)
+#define TC_INTENSET_MC0 (1u<<4)
+#define TC_INTENSET_MC1 (1u<<5)
+#define TC_INTENSET_OVF (1u<<0)
+#define TC_INTENCLR_MC0 (1u<<4)
+#define TC_INTENCLR_MC1 (1u<<5)
+#define TC_EVCTRL_OVFEO (1u<<8)
+#define TC_EVCTRL_MCEO0 (1u<<12)
+#define TC_EVCTRL_TCEI (1u<<5)
+#define TC_EVCTRL_EVACT_RETRIGGER (1u<<0)
+#define TC_EVCTRL_EVACT_START (3u<<0)
+#define TC_CTRLBSET_ONESHOT (1u<<2)
+#define TC_CTRLBSET_CMD_RETRIGGER (1u<<6)
+#define TC_CTRLBSET_CMD_STOP (2u<<6)
+/* --- TCC --- */
+typedef struct { __IO union{uint32_t reg;} CTRLA; __IO union{uint8_t reg;} CTRLBCLR, CTRLBSET; uint16_t _r0; __IO union{uint32_t reg; struct{uint32_t SWRST:1,ENABLE:1,CTRLB:1,STATUS:1,COUNT:1,PATT:1,WAVE:1,PER:1,CC0:1,CC1:1,CC2:1,CC3:1;} bit;} SYNCBUSY; __IO union{uint32_t reg;} FCTRLA, FCTRLB, WEXCTRL, DRVCTRL; uint16_t _r1; __IO union{uint8_t reg;} DBGCTRL; uint8_t _r2; __IO union{uint32_t reg;} EVCTRL, INTENCLR, INTENSET, INTFLAG, STATUS, COUNT; __IO union{uint16_t reg;} PATT; uint16_t _r3; __IO union{uint32_t reg;} WAVE, PER, CC[4]; uint32_t _r4[4]; __IO union{uint16_t reg;} PATTB; uint16_t _r5; __IO union{uint32_t reg;} WAVEB, PERB, CCB[4]; } Tcc;
+extern Tcc *TCC0, *TCC1, *TCC2;
+#define TCC_CTRLA_ENABLE (1u<<1)
+#define TCC_CTRLA_PRESCALER(x) ((uint32_t)(x)<<8)
+#define TCC_CTRLA_PRESCSYNC_PRESC (1u<<12)
+#define TCC_WAVE_WAVEGEN_NPWM (2u<<0)
+#define TCC_DRVCTRL_INVEN0 (1u<<16)
+#define TCC_CTRLBSET_CMD_RETRIGGER (1u<<5)
+#define TCC_CTRLBSET_CMD_READSYNC (4u<<5)
+/* --- SYSCTRL --- */
+typedef struct { uint32_t _r[8]; __IO union{uint32_t reg; struct{uint32_t :1; uint32_t ENABLE:1; uint32_t :6; uint32_t PRESC:2;} bit;} OSC8M; } Sysctrl;
+extern Sysctrl *SYSCTRL;
+/* --- DMAC --- */
+typedef struct { __IO union{uint16_t reg;} BTCTRL; __IO union{uint16_t reg;} BTCNT; __IO union{uint32_t reg;} SRCADDR, DSTADDR, DESCADDR; } DmacDescriptor;
+typedef struct { __IO union{uint16_t reg; struct{uint16_t SWRST:1, DMAENABLE:1;} bit;} CTRL; __IO union{uint16_t reg;} CRCCTRL; __IO union{uint32_t reg;} CRCDATAIN, CRCCHKSUM; __IO union{uint8_t reg;} CRCSTATUS, DBGCTRL, QOSCTRL, _r; __IO union{uint32_t reg;} SWTRIGCTRL, PRICTRL0; uint32_t _r1[2]; __IO union{uint16_t reg; struct{uint16_t ID:4;} bit;} INTPEND; uint16_t _r2; __IO union{uint32_t reg;} INTSTATUS, BUSYCH, PENDCH, ACTIVE, BASEADDR, WRBADDR; uint8_t _r3[3]; __IO union{uint8_t reg;} CHID; __IO struct{uint8_t reg; struct{uint8_t SWRST:1, ENABLE:1;} bit;} CHCTRLA; /* bit reads 0, a reset or disable is done at once */ uint8_t _r4[3]; __IO union{uint32_t reg;} CHCTRLB; uint8_t _r5[4]; __IO union{uint8_t reg;} CHINTENCLR, CHINTENSET, CHINTFLAG, CHSTATUS; } Dmac;
+extern Dmac *DMAC;
+#define DMAC_CTRL_DMAENABLE (1u<<1)
+#define DMAC_CTRL_LVLEN(x) ((x)<<8)
+#define DMAC_CHID_ID(x) (x)
+#define DMAC_CHCTRLA_SWRST 1u
+#define DMAC_CHCTRLA_ENABLE 2u
+#define DMAC_CHINTENSET_TCMPL 2u
+#define DMAC_CHCTRLB_TRIGSRC(x) ((uint32_t)(x)<<8)
+#define DMAC_CHCTRLB_TRIGACT_BEAT (2u<<22)
+#define DMAC_CHCTRLB_TRIGACT_BLOCK (0u<<22)
+#define DMAC_CHCTRLB_TRIGACT_TRANSACTION (3u<<22)
+#define DMAC_BTCTRL_VALID 1u
+#define DMAC_BTCTRL_BLOCKACT_INT (1u<<3)
+#define DMAC_BTCTRL_BLOCKACT_NOACT 0u
+#define DMAC_BTCTRL_BEATSIZE_HWORD (1u<<8)
+#define DMAC_BTCTRL_BEATSIZE_BYTE (0u<<8)
+#define DMAC_BTCTRL_BEATSIZE_WORD (2u<<8)
+#define DMAC_BTCTRL_SRCINC (1u<<10)
+#define DMAC_BTCTRL_DSTINC (1u<<11)
+/* --- ADC --- */
+typedef struct { __IO union{uint8_t reg;} CTRLA, REFCTRL, AVGCTRL, SAMPCTRL; __IO union{uint16_t reg;} CTRLB; uint16_t _r; __IO union{uint8_t reg;} WINCTRL, _r1[3], SWTRIG; uint8_t _r2[3]; __IO union{uint32_t reg;} INPUTCTRL; __IO union{uint8_t reg;} EVCTRL, _r3, INTENCLR, INTENSET, INTFLAG; __IO union{uint8_t reg; struct{uint8_t :7; uint8_t SYNCBUSY:1;} bit;} STATUS; __IO union{uint16_t reg;} RESULT, WINLT, WINUT, GAINCORR, OFFSETCORR, CALIB; } Adc;
+extern Adc *ADC;
+extern uint32_t host_adc_fuses[2];
+#define ADC_FUSES_BIASCAL_ADDR (&host_adc_fuses[0]) // calibration row, read as 0
+#define ADC_FUSES_BIASCAL_Msk 0
+#define ADC_FUSES_BIASCAL_Pos 0
+#define ADC_FUSES_LINEARITY_0_ADDR (&host_adc_fuses[0])
+#define ADC_FUSES_LINEARITY_0_Msk 0
+#define ADC_FUSES_LINEARITY_0_Pos 0
+#define ADC_FUSES_LINEARITY_1_ADDR (&host_adc_fuses[1])
+#define ADC_FUSES_LINEARITY_1_Msk 0
+#define ADC_FUSES_LINEARITY_1_Pos 0
+#define ADC_CALIB_BIAS_CAL(x) ((x)<<8)
+#define ADC_CALIB_LINEARITY_CAL(x) (x)
+#define ADC_REFCTRL_REFSEL_INTVCC1 2u
+#define ADC_AVGCTRL_SAMPLENUM_16 4u
+#define ADC_AVGCTRL_ADJRES(x) ((x)<<4)
+#define ADC_SAMPCTRL_SAMPLEN(x) (x)
+#define ADC_CTRLB_PRESCALER_DIV64 (4u<<8)
+#define ADC_CTRLB_RESSEL_16BIT (1u<<4)
+#define ADC_CTRLB_FREERUN (1u<<2)
+#define ADC_INPUTCTRL_MUXPOS(x) (x)
+#define ADC_INPUTCTRL_MUXNEG_GND (0x18u<<8)
+#define ADC_INPUTCTRL_INPUTSCAN(x) ((uint32_t)(x)<<16)
+#define ADC_INPUTCTRL_GAIN_DIV2 (0xFu<<24)
+#define ADC_CTRLA_ENABLE 2u
+#define ADC_SWTRIG_START 2u
+#define ADC_DMAC_ID_RESRDY 0x27
+/* --- DAC bits --- */
+#define DAC_CTRLA_ENABLE (1u<<1)
+#define DAC_CTRLB_EOEN (1u<<0)
+#define DAC_CTRLB_REFSEL_AVCC (1u<<6)
+#define DAC_EVCTRL_STARTEI (1u<<0)
+#define DAC_DMAC_ID_EMPTY 0x28
+#define TC_CTRLA_PRESCALER(x) ((uint32_t)(x)<<8)
+/* --- EVSYS --- */
+typedef struct { __IO union{uint8_t reg;} CTRL; uint8_t _r[3]; __IO union{uint32_t reg;} CHANNEL; __IO union{uint16_t reg;} USER; } Evsys;
+extern Evsys *EVSYS;
+#define EVSYS_CHANNEL_CHANNEL(x) ((uint32_t)(x))
+#define EVSYS_CHANNEL_EVGEN(x) ((uint32_t)(x)<<16)
+#define EVSYS_CHANNEL_PATH_ASYNCHRONOUS (2u<<24)
+#define EVSYS_USER_USER(x) ((uint16_t)(x))
+#define EVSYS_USER_CHANNEL(x) ((uint16_t)(x)<<8)
+#define EVSYS_ID_GEN_TC3_OVF 0x2D
+#define EVSYS_ID_USER_DAC_START 0x13
+/* --- EIC --- */
+typedef struct { __IO union{uint8_t reg;} CTRL; __IO union{uint8_t reg; struct{uint8_t :7; uint8_t SYNCBUSY:1;} bit;} STATUS; __IO union{uint8_t reg;} NMICTRL, NMIFLAG; __IO union{uint32_t reg;} EVCTRL, INTENCLR, INTENSET, INTFLAG, WAKEUP; __IO union{uint32_t reg;} CONFIG[2]; } Eic;
+extern Eic *EIC;
+#define EIC_CTRL_ENABLE (1u<<1)
+#define EIC_CONFIG_SENSE0_BOTH (3u<<0)
+#define EIC_CONFIG_FILTEN0 (1u<<3)
+#define EIC_INTENSET_EXTINT(x) ((uint32_t)(x))
+#define PORT_PINCFG_PMUXEN (1u<<0)
+#define PORT_PINCFG_INEN (1u<<1)
+#define PORT_PINCFG_PULLEN (1u<<2)
+/* --- SERCOM --- */
+typedef struct { __IO union{uint32_t reg;} CTRLA, CTRLB; uint32_t _r0; __IO union{uint16_t reg;} BAUD; uint8_t _r1[6]; __IO union{uint8_t reg;} INTENCLR; uint8_t _r2; __IO union{uint8_t reg;} INTENSET; uint8_t _r3; __IO union{uint8_t reg;} INTFLAG; uint8_t _r4; __IO union{uint16_t reg; struct{uint16_t BUSERR:1,ARBLOST:1,RXNACK:1;} bit;} STATUS; __IO union{uint32_t reg;} SYNCBUSY; uint32_t _r5; __IO union{uint32_t reg;} ADDR; __IO union{uint8_t reg;} DATA; } SercomI2cm;
+typedef struct { __IO union{uint32_t reg;} CTRLA, CTRLB; uint32_t _r0; __IO union{uint8_t reg;} BAUD; uint8_t _r1[7]; __IO union{uint8_t reg;} INTENCLR; uint8_t _r2; __IO union{uint8_t reg;} INTENSET; uint8_t _r3; __IO union{uint8_t reg; struct{uint8_t DRE:1,TXC:1,RXC:1;} bit;} INTFLAG; uint8_t _r4; __IO union{uint16_t reg;} STATUS; __IO union{uint32_t reg;} SYNCBUSY; uint32_t _r5; __IO union{uint32_t reg;} ADDR; __IO union{uint32_t reg;} DATA; } SercomSpi;
+typedef union { SercomI2cm I2CM; SercomSpi SPI; } Sercom;
+extern Sercom *SERCOM0, *SERCOM1, *SERCOM2, *SERCOM3;
+#define PORT_PMUX_PMUXE_C (2u)
+#define PORT_PMUX_PMUXO_C (2u<<4)
+#define PORT_PMUX_PMUXE_D (3u)
+#define PORT_PMUX_PMUXO_D (3u<<4)
+#define SERCOM_I2CM_CTRLA_ENABLE (1u<<1)
+#define SERCOM_I2CM_CTRLA_MODE_I2C_MASTER (5u<<2)
+#define SERCOM_I2CM_CTRLA_SDAHOLD(x) ((uint32_t)(x)<<20)
+#define SERCOM_I2CM_CTRLB_SMEN (1u<<8)
+#define SERCOM_I2CM_CTRLB_CMD(x) ((uint32_t)(x)<<16)
+#define SERCOM_I2CM_ADDR_ADDR(x) ((uint32_t)(x))
+#define SERCOM_I2CM_ADDR_LENEN (1u<<13)
+#define SERCOM_I2CM_ADDR_LEN(x) ((uint32_t)(x)<<16)
+#define SERCOM_I2CM_INTENSET_MB (1u<<0)
+#define SERCOM_I2CM_INTENSET_ERROR (1u<<7)
+#define SERCOM_I2CM_INTENCLR_MB (1u<<0)
+#define SERCOM_I2CM_INTENCLR_ERROR (1u<<7)
+#define SERCOM_I2CM_INTFLAG_MB (1u<<0)
+#define SERCOM_I2CM_INTFLAG_ERROR (1u<<7)
+#define SERCOM_I2CM_STATUS_BUSERR (1u<<0)
+#define SERCOM_I2CM_STATUS_ARBLOST (1u<<1)
+#define SERCOM_I2CM_STATUS_BUSSTATE(x) ((uint16_t)(x)<<4)
+#define SERCOM_SPI_CTRLA_ENABLE (1u<<1)
+#define SERCOM_SPI_CTRLA_MODE_SPI_MASTER (3u<<2)
+#define SERCOM_SPI_CTRLA_DOPO(x) ((uint32_t)(x)<<16)
+#define SERCOM_SPI_CTRLA_DIPO(x) ((uint32_t)(x)<<20)
+#define SERCOM_SPI_CTRLA_DORD (1u<<30)
+#define SERCOM_SPI_CTRLB_RXEN (1u<<17)
+#define SERCOM_SPI_INTENSET_TXC (1u<<1)
+#define SERCOM_SPI_INTENCLR_TXC (1u<<1)
+#define SERCOM_SPI_INTFLAG_TXC (1u<<1)
+#define SERCOM0_DMAC_ID_TX 0x02
+#define SERCOM1_DMAC_ID_TX 0x04
+#define SERCOM2_DMAC_ID_TX 0x06
+#define GCLK_CLKCTRL_ID_SERCOM3_CORE GCLK_CLKCTRL_ID(0x17)
+#define PM_APBCMASK_SERCOM3 (1u<<5)
+#define TC_COUNT32_CC_OFFSET 0x18
+#define TC_CTRLC_CPTEN1 (1u<<5)
+#define TC_EVCTRL_EVACT_OFF (0u<<0)
+#define EVSYS_ID_USER_TC4_EVU 0x0F
+#define EVSYS_ID_GEN_EIC_EXTINT_0 0x0C
+#define EIC_EVCTRL_EXTINTEO(x) ((uint32_t)(x))
+/* --- USB --- */
+typedef struct { struct { __IO union{uint8_t reg;} INTENSET; } DEVICE; } Usb;
+extern Usb *USB;
+#define USB_DEVICE_INTENSET_SOF (1u<<2)
+
+#endif
@@ -0,0 +1,128 @@
+// Host build of the firmware, see relay_host.c. The parts of TinyUSB's
+// headers the firmware modules use: the USBTMC/USB488 message and response
+// types, the USBTMC and HID application API and the TU_ helpers.
+#ifndef HOST_TUSB_H
+#define HOST_TUSB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "tusb_config.h"
+
+#define TU_VERIFY_STATIC    _Static_assert
+#define TU_ASSERT(...)      do {} while (0)
+#define TU_ATTR_PACKED      __attribute__((packed))
+#define TU_VERIFY(x, ...)   do { if (!(x)) return __VA_ARGS__; } while (0)
+
+static inline uint32_t tu_min32(uint32_t a, uint32_t b) { return a < b ? a : b; }
+
+typedef enum { XFER_RESULT_SUCCESS } xfer_result_t;
+
+typedef struct
+{
+  uint8_t  bmRequestType, bRequest;
+  uint16_t wValue, wIndex, wLength;
+} tusb_control_request_t;
+
+typedef struct
+{
+  uint8_t bLength, bDescriptorType, bInterfaceNumber, bAlternateSetting, bNumEndpoints,
+          bInterfaceClass, bInterfaceSubClass, bInterfaceProtocol, iInterface;
+} tusb_desc_interface_t;
+
+//--------------------------------------------------------------------+
+// USBTMC, USB488
+//--------------------------------------------------------------------+
+enum
+{
+  USBTMC_STATUS_SUCCESS = 0x01,
+  USBTMC_STATUS_PENDING = 0x02,
+  USBTMC_STATUS_FAILED  = 0x80,
+};
+
+#define USBTMC_VERSION      0x0100
+#define USBTMC_488_VERSION  0x0100
+
+typedef struct
+{
+  uint8_t MsgID, bTag, bTagInverse, _reserved;
+} usbtmc_msg_header_t;
+
+typedef struct
+{
+  usbtmc_msg_header_t header;
+  uint8_t             data[8];
+} usbtmc_msg_generic_t;
+
+typedef struct
+{
+  usbtmc_msg_header_t header;
+  uint32_t            TransferSize;
+  struct { uint8_t EOM : 1; } bmTransferAttributes;
+  uint8_t             _reserved[3];
+} usbtmc_msg_request_dev_dep_out;
+
+typedef struct
+{
+  usbtmc_msg_header_t header;
+  uint32_t            TransferSize;
+  struct { uint8_t : 1; uint8_t TermCharEnabled : 1; } bmTransferAttributes;
+  uint8_t             TermChar;
+  uint8_t             _reserved[2];
+} usbtmc_msg_request_dev_dep_in;
+
+typedef struct
+{
+  usbtmc_msg_header_t header;
+  uint32_t            TransferSize;
+  struct { uint8_t EOM : 1; uint8_t UsingTermChar : 1; } bmTransferAttributes;
+  uint8_t             _reserved[3];
+} usbtmc_msg_dev_dep_msg_in_header_t;
+
+typedef struct
+{
+  uint8_t USBTMC_status;
+  struct { uint8_t BulkInFifoBytes : 1; } bmClear;
+} usbtmc_get_clear_status_rsp_t;
+
+typedef struct
+{
+  uint8_t  USBTMC_status;
+  uint8_t  bmAbortBulkIn;
+  uint8_t  _reserved[2];
+  uint32_t NBYTES_RXD_TXD;
+} usbtmc_check_abort_bulk_rsp_t;
+
+typedef struct
+{
+  uint8_t  USBTMC_status;
+  uint8_t  _reserved;
+  uint16_t bcdUSBTMC;
+  struct { uint8_t listenOnly : 1, talkOnly : 1, supportsIndicatorPulse : 1; } bmIntfcCapabilities;
+  struct { uint8_t canEndBulkInOnTermChar : 1; } bmDevCapabilities;
+  uint8_t  _reserved2[6];
+  uint16_t bcdUSB488;
+  struct { uint8_t is488_2 : 1, supportsREN_GTL_LLO : 1, supportsTrigger : 1; } bmIntfcCapabilities488;
+  struct { uint8_t SCPI : 1, SR1 : 1, RL1 : 1, DT1 : 1; } bmDevCapabilities488;
+} usbtmc_response_capabilities_488_t;
+
+bool tud_usbtmc_start_bus_read(void);
+bool tud_usbtmc_transmit_dev_msg_data(const void *data, size_t len, bool endOfMessage, bool usingTermChar);
+bool tud_usbtmc_transmit_notification_data(const void *data, size_t len);
+
+//--------------------------------------------------------------------+
+// HID
+//--------------------------------------------------------------------+
+typedef enum
+{
+  HID_REPORT_TYPE_INVALID,
+  HID_REPORT_TYPE_INPUT,
+  HID_REPORT_TYPE_OUTPUT,
+  HID_REPORT_TYPE_FEATURE
+} hid_report_type_t;
+
+bool tud_hid_ready(void);
+bool tud_hid_report(uint8_t report_id, void const *report, uint16_t len);
+
+#endif
@@ -0,0 +1,367 @@
+import argparse
+import json
+import os
+import re
+import socket
+import socketserver
+import sys
+import threading
+import time
+from collections import deque
+
+# Host broker that owns relay boards and serves many local clients over Unix
+# sockets, one socket per board. Without it every process opens its own VISA
+# session and exclusive locks serialize them with a round trip per command.
+#
+# Clients send SCPI lines, each query line is answered with one line. Writes
+# do not wait for the board, so writes from all clients pile up in the board
+# queue while the board is busy. The board thread then coalesces consecutive
+# relay writes (RELAY:MASK, RELAYn:EN, ROUT:CLOS, ROUT:OPEN) into a single
+# RELAY:MASK with the resulting mask. Commands of one client reach the board
+# in the order they were sent, only the relay writes between two other
+# commands are merged.
+#
+# The broker keeps a mirror of the relay mask and the exclusive groups in a
+# relay_sim.SimRelayDevice, read from the board at start. Relay state queries
+# (RELAY:MASK?, RELAYn:EN?, ROUT:CLOS?, ROUT:GRP:DEF?) are answered from the
+# mirror while it is valid. A relay command the mirror does not model
+# (pulses, PWM, power-on state..) invalidates it, and it is read back from the
+# board before it is used again. The broker assumes it is the only one changing the relays, HID
+# and other USBTMC interfaces of the same board are not seen.
+#
+# A merged write shows up as one RELAY:MASK transition in TRAC:DATA?, and
+# like RELAY:MASK it returns PWM channels to GPIO. A write the mirror rejects
+# is sent as it is, so the board still reports the error.
+#
+# BROKER:STAT? is answered by the broker with a JSON line: queue depth and
+# high-water mark, relay writes received and sent and their ratio, queries
+# answered from the mirror.
+#
+#   python3 relay_broker.py --sim /tmp/relay0.sock
+#   python3 relay_broker.py --visa USB0::51966::16384::123456::0::INSTR /tmp/relay0.sock
+#   python3 relay_broker.py --selftest
+
+RELAY_WRITE = re.compile(r"relay:mask |relay\d+:en |rout:clos |rout:open ")
+MIRROR_QUERY = re.compile(r"relay:mask\?$|relay\d+:en\?$|rout:clos\? |rout:grp:def\? ")
+MIRROR_WRITE = re.compile(r"rout:grp:def |\*rst$")   # modelled, keep the mirror valid
+NEUTRAL_WRITE = re.compile(r"\*cls$|\*ese |\*sre |trac:cle$|inp:cle$|sour:|sens:ver |syst:pow:budg |delay ")
+STAT_QUERY = "broker:stat?"
+ROUT_GROUPS = 4
+
+class Request:
+    def __init__(self, msg):
+        self.msg = msg.strip()
+        self.key = self.msg.lower()
+        self.response = None
+        self.done = threading.Event()
+
+    def is_query(self):
+        return self.key.endswith("?") or "? " in self.key
+
+
+class BoardBroker:
+    # target has the pyvisa resource calls write/query, a real board or
+    # relay_sim.SimUsbtmc
+    def __init__(self, target, channels=2):
+        from relay_sim import SimRelayDevice
+        self.target = target
+        self.mirror = SimRelayDevice(channels=channels)
+        self.mirror_valid = False
+        self.queue = deque()
+        self.cond = threading.Condition()
+        self.stats = {"commands": 0, "queue_depth": 0, "queue_high_water": 0, "relay_writes": 0,
+                      "relay_writes_sent": 0, "mirror_hits": 0, "resyncs": 0, "failures": 0}
+        self.running = True
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    # Called by the client threads, returns the Request to wait on
+    def submit(self, msg):
+        req = Request(msg)
+        with self.cond:
+            self.queue.append(req)
+            self.stats["commands"] += 1
+            self.stats["queue_high_water"] = max(self.stats["queue_high_water"], len(self.queue))
+            self.cond.notify()
+        return req
+
+    def metrics(self):
+        with self.cond:
+            stats = dict(self.stats, queue_depth=len(self.queue))
+        stats["coalescing_ratio"] = round(stats["relay_writes"] / max(1, stats["relay_writes_sent"]), 3)
+        return stats
+
+    def stop(self):
+        with self.cond:
+            self.running = False
+            self.cond.notify()
+        self.thread.join()
+
+    # --- board thread ---
+
+    def _run(self):
+        while True:
+            with self.cond:
+                while self.running and not self.queue:
+                    self.cond.wait()
+                if not self.queue:
+                    return
+                req = self.queue.popleft()
+            if RELAY_WRITE.match(req.key):
+                self._relay_write(req)
+            elif MIRROR_QUERY.match(req.key) and self._sync():
+                self._mirror_query(req)
+            else:
+                self._send(req)
+                if MIRROR_WRITE.match(req.key) and self.mirror_valid:
+                    self.mirror.scpi(req.key)
+                elif not req.is_query() and not NEUTRAL_WRITE.match(req.key):
+                    self.mirror_valid = False
+            req.done.set()
+
+    def _send(self, req):
+        try:
+            if req.is_query():
+                req.response = self.target.query(req.msg).rstrip("\n")
+            else:
+                self.target.write(req.msg)
+        except Exception:
+            self.stats["failures"] += 1
+            self.mirror_valid = False
+            req.response = "" # the board did not answer, a rejected query
+
+    # Read the relay mask and the exclusive groups back from the board
+    def _sync(self):
+        if self.mirror_valid:
+            return True
+        try:
+            mask = int(self.target.query("RELAY:MASK?"))
+            groups = [self.mirror._parse_list(self.target.query("ROUT:GRP:DEF? %d" % (i + 1)).strip())
+                      for i in range(ROUT_GROUPS)]
+        except Exception:
+            self.stats["failures"] += 1
+            return False
+        self.mirror.mask = mask
+        self.mirror.groups = groups
+        self.mirror.errors.clear()
+        self.mirror_valid = True
+        self.stats["resyncs"] += 1
+        return True
+
+    # Applies msg to the mirror, False when the board would reject it
+    def _mirror_accepts(self, msg):
+        self.mirror.errors.clear()
+        self.mirror.scpi(msg)
+        self.mirror.hid_reports.clear()
+        return not self.mirror.errors
+
+    def _mirror_query(self, req):
+        self.mirror.errors.clear()
+        response = self.mirror.scpi(req.key)
+        if self.mirror.errors:
+            self._send(req) # malformed, the board reports the error
+        else:
+            req.response = response
+            self.stats["mirror_hits"] += 1
+
+    # Merges req with the relay writes queued right behind it
+    def _relay_write(self, req):
+        self.stats["relay_writes"] += 1
+        synced = self._sync()
+        before = self.mirror.mask
+        if not synced or not self._mirror_accepts(req.key):
+            self._send(req)
+            self.stats["relay_writes_sent"] += 1
+            return
+        batch = [req]
+        with self.cond:
+            while self.queue and RELAY_WRITE.match(self.queue[0].key) and self._mirror_accepts(self.queue[0].key):
+                batch.append(self.queue.popleft())
+        self.stats["relay_writes"] += len(batch) - 1
+        if len(batch) == 1:
+            self._send(req)
+            self.stats["relay_writes_sent"] += 1
+        elif self.mirror.mask != before:
+            self._send(Request("RELAY:MASK %d" % self.mirror.mask))
+            self.stats["relay_writes_sent"] += 1
+        for other in batch[1:]:
+            other.done.set()
+
+
+class ClientHandler(socketserver.StreamRequestHandler):
+    def handle(self):
+        broker = self.server.broker
+        for line in self.rfile:
+            msg = line.decode("ascii", "replace").strip()
+            if not msg:
+                continue
+            if msg.lower() == STAT_QUERY:
+                self._reply(json.dumps(broker.metrics()))
+                continue
+            req = broker.submit(msg)
+            if req.is_query():
+                req.done.wait()
+                self._reply(req.response)
+
+    def _reply(self, text):
+        self.wfile.write((text + "\n").encode("ascii", "replace"))
+        self.wfile.flush()
+
+
+class BrokerServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+    def __init__(self, path, broker):
+        if os.path.exists(path):
+            os.unlink(path)
+        self.broker = broker
+        super().__init__(path, ClientHandler)
+
+
+class BrokerClient:
+    # Same calls as a pyvisa resource, for scripts that used the board directly
+    def __init__(self, path, timeout_s=5.0):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.settimeout(timeout_s)
+        self.sock.connect(path)
+        self.rfile = self.sock.makefile("r", encoding="ascii", newline="\n")
+
+    def write(self, msg):
+        self.sock.sendall((msg.strip() + "\n").encode("ascii"))
+
+    def read(self):
+        return self.rfile.readline()
+
+    def query(self, msg):
+        self.write(msg)
+        return self.read()
+
+    def close(self):
+        self.rfile.close()
+        self.sock.close()
+
+
+def serve(path, target, channels):
+    broker = BoardBroker(target, channels)
+    server = BrokerServer(path, broker)
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+    return server
+
+
+class SlowTarget:
+    # Adds a USB round trip to a simulated board, so writes queue up
+    def __init__(self, target, delay_s):
+        self.target = target
+        self.delay_s = delay_s
+        self.sent = []
+
+    def write(self, msg):
+        time.sleep(self.delay_s)
+        self.sent.append(msg)
+        self.target.write(msg)
+
+    def query(self, msg):
+        time.sleep(self.delay_s)
+        self.sent.append(msg)
+        return self.target.query(msg)
+
+
+def selftest():
+    import tempfile
+    from relay_sim import SimRelayDevice
+
+    dev = SimRelayDevice(channels=8, idn="SIM")
+    target = SlowTarget(dev.usbtmc(), 0.002)
+    path = os.path.join(tempfile.mkdtemp(), "relay.sock")
+    server = serve(path, target, 8)
+
+    # per-client ordering, every client reads back what it last wrote
+    def client(ch, results):
+        c = BrokerClient(path)
+        for i in range(20):
+            c.write("RELAY%d:EN %d" % (ch, i & 1))
+            results.append(c.query("RELAY%d:EN?" % ch) == "%d\n" % (i & 1))
+        c.close()
+    results = []
+    threads = [threading.Thread(target=client, args=(ch, results)) for ch in range(1, 9)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    assert all(results) and len(results) == 160
+
+    # a burst of writes is merged, the board ends in the same state
+    c = BrokerClient(path)
+    sent = len(target.sent)
+    for ch in range(1, 9):
+        c.write("RELAY%d:EN 1" % ch)
+    c.write("ROUT:OPEN (@2,4)")
+    assert c.query("RELAY:MASK?") == "245\n"
+    assert dev.mask == 245
+    assert len(target.sent) - sent < 9
+
+    # groups pass through, a rejected write still reaches the board
+    c.write("ROUT:GRP:DEF 1,(@1:2)")
+    c.write("RELAY:MASK 3")
+    assert c.query("SYST:ERR?") == '-221,"Settings conflict"\n'
+    assert c.query("ROUT:CLOS? (@1:2)") == "1,0\n"
+
+    # unmodelled commands invalidate the mirror, it is read back
+    c.write("*CLS")
+    dev.mask = 0 # changed behind the broker's back, e.g. a pulse ended
+    c.write("RELAY:PULS #H1,5")
+    assert c.query("RELAY:MASK?") == "0\n"
+
+    stats = json.loads(c.query(STAT_QUERY))
+    assert stats["coalescing_ratio"] > 1.0 and stats["mirror_hits"] > 0
+    c.close()
+    server.shutdown()
+    server.broker.stop()
+    print("broker OK", stats)
+
+def main():
+    parser = argparse.ArgumentParser(description="Serve relay boards to many local clients")
+    parser.add_argument("--visa", nargs=2, action="append", default=[], metavar=("RESOURCE", "SOCKET"),
+                        help="real board and the Unix socket its clients connect to")
+    parser.add_argument("--visa-backend", default="@py")
+    parser.add_argument("--timeout-ms", type=int, default=2000)
+    parser.add_argument("--sim", action="append", default=[], metavar="SOCKET", help="simulated board")
+    parser.add_argument("--channels", type=int, default=2, help="relay channels of the boards")
+    parser.add_argument("--stats", type=float, default=0, metavar="S", help="print metrics every S seconds")
+    parser.add_argument("--selftest", action="store_true", help="run against a simulated board and exit")
+    args = parser.parse_args()
+
+    if args.selftest:
+        selftest()
+        return 0
+    servers = []
+    for path in args.sim:
+        from relay_sim import SimRelayDevice
+        servers.append(serve(path, SimRelayDevice(channels=args.channels).usbtmc(), args.channels))
+    if args.visa:
+        import pyvisa
+        rm = pyvisa.ResourceManager(args.visa_backend)
+        for resource, path in args.visa:
+            inst = rm.open_resource(resource)
+            inst.timeout = args.timeout_ms
+            if resource.upper().endswith("::SOCKET"):
+                inst.read_termination = "\n" # relay_vserver.py boards
+            servers.append(serve(path, inst, args.channels))
+    if not servers:
+        parser.error("no board, use --sim SOCKET or --visa RESOURCE SOCKET")
+    try:
+        while True:
+            time.sleep(args.stats or 3600)
+            if args.stats:
+                for server in servers:
+                    print(server.server_address, json.dumps(server.broker.metrics()))
+    except KeyboardInterrupt:
+        pass
+    for server in servers:
+        server.shutdown()
+        server.broker.stop()
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,87 @@
+#include "tusb.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* DMAC */
+
+// DMAC descriptor tables, shared by all DMA users. Each user owns a fixed
+// channel (DMA_CH_* in usbtmc_app.h) and its first descriptor, further
+// descriptors of a linked list live with the user.
+static DmacDescriptor          dma_base[DMA_CHANNELS] __attribute__((aligned(16)));
+static volatile DmacDescriptor dma_wb[DMA_CHANNELS]   __attribute__((aligned(16)));
+
+void dma_setup(void)
+{
+  if (DMAC->CTRL.bit.DMAENABLE)
+  {
+    return; // already done by an earlier user
+  }
+  PM->AHBMASK.reg  |= PM_AHBMASK_DMAC;
+  PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+  DMAC->BASEADDR.reg = (uint32_t)(uintptr_t)dma_base;
+  DMAC->WRBADDR.reg  = (uint32_t)(uintptr_t)dma_wb;
+  DMAC->CTRL.reg     = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xF);
+  NVIC_SetPriority(DMAC_IRQn, 2); // block ends only, below the relay edges
+  NVIC_EnableIRQ(DMAC_IRQn);
+}
+
+void * dma_descriptor(uint8_t channel)
+{
+  return &dma_base[channel];
+}
+
+// Reset the channel and start it with its descriptor, chctrlb holds the
+// trigger source and action. A transfer complete interrupt is enabled for
+// descriptors with BLOCKACT_INT.
+void dma_channel_start(uint8_t channel, uint32_t chctrlb)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq(); // CHID is shared with DMAC_Handler
+  DMAC->CHID.reg      = DMAC_CHID_ID(channel);
+  DMAC->CHCTRLA.reg   = 0;
+  DMAC->CHCTRLA.reg   = DMAC_CHCTRLA_SWRST;
+  while (DMAC->CHCTRLA.bit.SWRST);
+  DMAC->CHCTRLB.reg   = chctrlb;
+  DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL;
+  DMAC->CHCTRLA.reg   = DMAC_CHCTRLA_ENABLE;
+  __set_PRIMASK(primask);
+}
+
+void dma_channel_stop(uint8_t channel)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  DMAC->CHID.reg    = DMAC_CHID_ID(channel);
+  DMAC->CHCTRLA.reg = 0;
+  while (DMAC->CHCTRLA.bit.ENABLE);
+  __set_PRIMASK(primask);
+}
+
+void DMAC_Handler(void)
+{
+  while (DMAC->INTSTATUS.reg)
+  {
+    uint8_t channel = DMAC->INTPEND.bit.ID;
+    DMAC->CHID.reg       = DMAC_CHID_ID(channel);
+    DMAC->CHINTFLAG.reg  = DMAC->CHINTFLAG.reg;
+    switch (channel)
+    {
+      case DMA_CH_ADC:
+        adc_dma_block_done();
+        break;
+      case DMA_CH_DAC:
+        dac_dma_block_done();
+        break;
+#if BOARD_RELAY_EXPANDERS
+      case DMA_CH_EXP:
+        expander_dma_done();
+        break;
+#endif
+#if BOARD_RELAY_SHIFT_CHANNELS
+      case DMA_CH_SHIFT:
+        shift_dma_done();
+        break;
+#endif
+      default:
+        break;
+    }
+  }
+}
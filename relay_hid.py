@@ -0,0 +1,47 @@
+import struct
+
+# Host side of the vendor HID interface (hid_app.c). Reports are 8 bytes
+# without a report ID, a little endian relay mask with bit 0 = RELAY1. Every
+# OUT report is answered with an IN report holding the resulting mask, the
+# device also sends one when the relays change through SCPI or a pulse ends.
+VID = 0xCAFE
+PID = 0x4000
+REPORT_LEN = 8
+
+class RelayHid:
+    # dev is an opened hidapi device (pip install hidapi) or relay_sim.SimHid
+    def __init__(self, dev=None, timeout_ms=100):
+        if dev is None:
+            import hid
+            dev = hid.device()
+            dev.open(VID, PID)
+        self.dev = dev
+        self.timeout_ms = timeout_ms
+        self.mask = None
+
+    def _read(self):
+        data = self.dev.read(REPORT_LEN, self.timeout_ms)
+        if len(data) != REPORT_LEN:
+            raise TimeoutError("no HID report from relay board")
+        self.mask = struct.unpack("<Q", bytes(data))[0]
+        return self.mask
+
+    # Drop change reports that were queued before this request
+    def _flush(self):
+        while self.dev.read(REPORT_LEN, 0):
+            pass
+
+    # Returns the mask the board reports back, it differs from mask when the
+    # board rejected it (missing channel, exclusive group conflict)
+    def set_mask(self, mask):
+        self._flush()
+        self.dev.write([0] + list(struct.pack("<Q", mask)))
+        return self._read()
+
+    def get_mask(self):
+        data = self.dev.get_input_report(0, REPORT_LEN + 1)
+        self.mask = struct.unpack("<Q", bytes(data[-REPORT_LEN:]))[0]
+        return self.mask
+
+    def close(self):
+        self.dev.close()
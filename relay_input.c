@@ -0,0 +1,181 @@
+#define INP_PINS         11, 9          // PA pins of INP1, INP2..: SCK PA11, MISO PA09
+
+#include <stdio.h>      /* sprintf */
+#include "tusb.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* EIC, PORT pin multiplexer */
+
+// Digital input capture. Every edge on a capture input raises an EIC
+// interrupt that stores timer_us() and the new pin level in a RAM ring, the
+// oldest entries are overwritten. timer_us() is the relay trace timebase, so
+// edges and relay transitions can be compared directly. The EIC filter and
+// the interrupt entry add a few microseconds, the same for every edge.
+//
+// INP:DATA? returns the entries oldest first as an IEEE 488.2 definite
+// length block, 8 bytes per entry, little endian:
+//   uint32 timer_us() of the edge
+//   uint8  input, 1 = INP1
+//   uint8  level after the edge
+//   uint8  reserved[2]
+#define INP_LEN          256u           // must be a power of two
+#define INP_ENTRY_LEN    8u
+
+typedef struct
+{
+  uint32_t us;
+  uint8_t  input;
+  uint8_t  level;
+  uint8_t  reserved[2];
+} inp_entry_t;
+
+static const uint8_t inp_pins[] = { INP_PINS };
+TU_VERIFY_STATIC(!(PA_MASK(INP_PINS) & BUS_PINS),
+                 "the shift register chain or the expander bus has a pin of INP_PINS, move it");
+#define INP_COUNT        (sizeof(inp_pins))
+
+TU_VERIFY_STATIC(2u + 4u + INP_LEN * INP_ENTRY_LEN + 1u <= BLOCK_OUT_LEN, "INP:DATA? block does not fit");
+
+static inp_entry_t       inp_ring[INP_LEN];
+static volatile uint32_t inp_head;      // edges captured since the last clear
+
+// EXTINT line of a PA pin
+static uint8_t inp_extint(uint8_t pin)
+{
+  return pin & 15u;
+}
+
+void input_setup(void)
+{
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_EIC | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN; // edge detection and filter
+  while (GCLK->STATUS.bit.SYNCBUSY);
+  PM->APBAMASK.reg |= PM_APBAMASK_EIC;
+
+  for (uint8_t i = 0; i < INP_COUNT; i++)
+  {
+    uint8_t pin    = inp_pins[i];
+    uint8_t extint = inp_extint(pin);
+    PORT->Group[0].OUTSET.reg = 1u << pin;      // pull-up, for open drain outputs like power good
+    PORT->Group[0].PINCFG[pin].reg = PORT_PINCFG_INEN | PORT_PINCFG_PULLEN | PORT_PINCFG_PMUXEN;
+    if (pin & 1u)
+    {
+      PORT->Group[0].PMUX[pin >> 1].bit.PMUXO = 0; // function A, EXTINT
+    }
+    else
+    {
+      PORT->Group[0].PMUX[pin >> 1].bit.PMUXE = 0;
+    }
+    EIC->CONFIG[extint >> 3].reg |= (EIC_CONFIG_SENSE0_BOTH | EIC_CONFIG_FILTEN0) << (4u * (extint & 7u));
+    EIC->INTENSET.reg = EIC_INTENSET_EXTINT(1u << extint);
+  }
+  EIC->CTRL.reg = EIC_CTRL_ENABLE;
+  while (EIC->STATUS.bit.SYNCBUSY);
+
+  NVIC_SetPriority(EIC_IRQn, 1); // below the relay edges, above the DMA
+  NVIC_EnableIRQ(EIC_IRQn);
+}
+
+void EIC_Handler(void)
+{
+  uint32_t us    = timer_us();
+  uint32_t flags = EIC->INTFLAG.reg;
+  uint32_t in    = PORT->Group[0].IN.reg;
+  EIC->INTFLAG.reg = flags;
+  for (uint8_t i = 0; i < INP_COUNT; i++)
+  {
+    if (flags & (1u << inp_extint(inp_pins[i])))
+    {
+      inp_entry_t *entry = &inp_ring[inp_head & (INP_LEN - 1u)];
+      entry->us    = us;
+      entry->input = (uint8_t)(i + 1u);
+      entry->level = (uint8_t)((in >> inp_pins[i]) & 1u);
+      inp_head++;
+    }
+  }
+  trigger_eic(flags, in);
+}
+
+uint8_t input_count(void)
+{
+  return INP_COUNT;
+}
+
+// INP:STAT?, pin levels, bit 0 = INP1
+uint32_t input_state(void)
+{
+  uint32_t in   = PORT->Group[0].IN.reg;
+  uint32_t mask = 0;
+  for (uint8_t i = 0; i < INP_COUNT; i++)
+  {
+    mask |= ((in >> inp_pins[i]) & 1u) << i;
+  }
+  return mask;
+}
+
+// INP:COUN?, edges since the last clear, including overwritten ones
+uint32_t input_edges(void)
+{
+  return inp_head;
+}
+
+void input_clear(void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  inp_head = 0;
+  __set_PRIMASK(primask);
+}
+
+// INP:LAT?, microseconds from the last relay transition to the first edge of
+// input after it, false when there is none in the ring
+bool input_latency(uint8_t input, uint32_t *us)
+{
+  uint32_t relay_us;
+  if (!trace_last(&relay_us))
+  {
+    return false;
+  }
+  uint32_t head  = inp_head;      // entries before head are stable unless the ring wraps meanwhile
+  uint32_t count = head < INP_LEN ? head : INP_LEN;
+  for (uint32_t i = head - count; i != head; i++)
+  {
+    inp_entry_t const *entry = &inp_ring[i & (INP_LEN - 1u)];
+    if (entry->input == input && (int32_t)(entry->us - relay_us) >= 0)
+    {
+      *us = entry->us - relay_us;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Snapshot of the ring as a definite length block in a BLOCK_OUT_LEN buffer,
+// so that edges during the transfer can not tear it. Returns its length.
+// The entries are copied with interrupts enabled, inp_head is read again
+// afterwards and the oldest entries, overwritten by edges meanwhile, are
+// dropped.
+size_t input_block(uint8_t *block)
+{
+  uint32_t head  = inp_head;
+  uint32_t count = head < INP_LEN ? head : INP_LEN;
+  uint32_t first = head - count;
+  uint8_t *data  = &block[2u + 4u]; // behind the longest header
+  for (uint32_t i = 0; i < count; i++)
+  {
+    memcpy(&data[i * INP_ENTRY_LEN], &inp_ring[(first + i) & (INP_LEN - 1u)], INP_ENTRY_LEN);
+  }
+  __DMB(); // the copy is done before inp_head is read again
+  uint32_t lost = inp_head - first;
+  lost = lost > INP_LEN ? lost - INP_LEN : 0u;
+  lost = lost < count ? lost : count;
+  count -= lost;
+
+  char   digits[8];
+  size_t len = count * INP_ENTRY_LEN;
+  size_t hdr = (size_t)sprintf(digits, "%lu", (unsigned long)len);
+  block[0] = '#';
+  block[1] = (uint8_t)('0' + hdr);
+  memmove(&block[2u + hdr], &data[lost * INP_ENTRY_LEN], len);
+  memcpy(&block[2u], digits, hdr);
+  block[2u + hdr + len] = '\n';
+  return 2u + hdr + len + 1u;
+}
@@ -0,0 +1,172 @@
+import re
+import threading
+import time
+
+# Host-side mirror of a board's relay state. Relay state queries (RELAY:MASK?,
+# RELAYn:EN?, ROUT:CLOS?) are answered from a local copy of the relay mask
+# instead of a round trip to the board, everything else goes to the board.
+#
+# The copy is tagged with the board's RELAY:GEN?, the count of relay changes
+# since power-on. The board raises bit 1 of the status byte on every change
+# until the next RELAY:GEN?, the mirror enables it in *SRE, so a change from
+# any source (this or another program, HID, a pulse ending, a sequence step, a
+# trigger) sends an SRQ on the interrupt endpoint. An SRQ or a write of this
+# program only marks the copy stale: the next read asks RELAY:GEN? and reads
+# the mask again only when the generation moved. The generation is read
+# before the mask, a change in between leaves the copy tagged with the older
+# generation and it is read again.
+#
+# Without SRQ support in the VISA backend (pyvisa-py has none for USB) the
+# copy is revalidated by generation when it is older than max_age_s, 0 checks
+# on every read: still one round trip, but a short one that never goes stale.
+#
+#   mirror = RelayMirror(rm.open_resource('USB0::51966::16384::123456::0::INSTR'))
+#   mirror.query("RELAY1:EN?")
+
+MIRROR_QUERY = re.compile(r"relay:mask\?$|relay\d+:en\?$|rout:clos\? ")
+NEUTRAL_WRITE = re.compile(r"\*cls$|\*ese |\*sre |trac:cle$|inp:cle$|sens:ver |syst:pow:budg |delay ")
+STB_RELAY = 0x02
+
+try:
+    from pyvisa import constants
+    EVENT_SRQ = constants.EventType.service_request
+    EVENT_HANDLER = constants.EventMechanism.handler
+except ImportError:
+    EVENT_SRQ = 0x3FFF200B # VI_EVENT_SERVICE_REQ
+    EVENT_HANDLER = 2      # VI_HNDLR
+
+class RelayMirror:
+    # inst has the pyvisa resource calls write/query, a real board or
+    # relay_sim.SimUsbtmc. channels as seen through inst, a bank interface
+    # has its own.
+    def __init__(self, inst, channels=2, srq=True, max_age_s=0.0):
+        from relay_sim import SimRelayDevice
+        self.inst = inst
+        self.mirror = SimRelayDevice(channels=channels)
+        self.max_age_s = max_age_s
+        self.lock = threading.Lock()
+        self.generation = None # of the copy, None = never read
+        self.stale = True
+        self.checked = 0.0     # time.monotonic() of the last revalidation
+        self.stats = {"reads": 0, "local": 0, "revalidations": 0, "resyncs": 0, "srqs": 0}
+        self.srq = srq and self._install_srq()
+
+    def _install_srq(self):
+        try:
+            self.inst.install_handler(EVENT_SRQ, self._on_srq)
+            self.inst.enable_event(EVENT_SRQ, EVENT_HANDLER)
+        except Exception:
+            return False
+        self.inst.write("*SRE %d" % (int(self.inst.query("*SRE?")) | STB_RELAY))
+        return True
+
+    # pyvisa calls it from its own thread
+    def _on_srq(self, *args):
+        self.stale = True
+        self.stats["srqs"] += 1
+        return 0 # VI_SUCCESS
+
+    def _resync(self):
+        self.generation = int(self.inst.query("RELAY:GEN?"))
+        self.mirror.mask = int(self.inst.query("RELAY:MASK?"))
+        self.stats["resyncs"] += 1
+
+    # Makes the copy current, called with the lock held
+    def _revalidate(self):
+        now = time.monotonic()
+        if self.generation is not None and not self.stale:
+            if self.srq or now - self.checked < self.max_age_s:
+                return
+        self.stale = False # an SRQ from here on is a newer change
+        self.checked = now
+        if self.generation is None:
+            self._resync()
+            return
+        self.stats["revalidations"] += 1
+        if int(self.inst.query("RELAY:GEN?")) != self.generation:
+            self._resync()
+
+    def write(self, msg):
+        with self.lock:
+            self.inst.write(msg)
+            if not NEUTRAL_WRITE.match(msg.strip().lower()):
+                self.stale = True # the relays may have changed, its SRQ can come late
+
+    def query(self, msg):
+        key = msg.strip().lower()
+        with self.lock:
+            self.stats["reads"] += 1
+            if not MIRROR_QUERY.match(key):
+                return self.inst.query(msg)
+            self._revalidate()
+            self.mirror.errors.clear()
+            response = self.mirror.scpi(key)
+            if self.mirror.errors:
+                return self.inst.query(msg) # malformed, the board reports the error
+            self.stats["local"] += 1
+            return response + "\n"
+
+    def mask(self):
+        with self.lock:
+            self._revalidate()
+            return self.mirror.mask
+
+    def close(self):
+        self.inst.close()
+
+
+if __name__ == "__main__":
+    from relay_sim import SimRelayDevice
+
+    class CountingTarget:
+        def __init__(self, target):
+            self.target = target
+            self.sent = []
+
+        def __getattr__(self, name):
+            return getattr(self.target, name)
+
+        def write(self, msg):
+            self.sent.append(msg)
+            self.target.write(msg)
+
+        def query(self, msg):
+            self.sent.append(msg)
+            return self.target.query(msg)
+
+    # with SRQ, repeated reads are free until the relays change
+    dev = SimRelayDevice()
+    target = CountingTarget(dev.usbtmc())
+    mirror = RelayMirror(target)
+    assert mirror.srq and dev.sre == STB_RELAY
+    assert mirror.query("RELAY1:EN?") == "0\n"
+    del target.sent[:]
+    for _ in range(100):
+        assert mirror.query("RELAY2:EN?") == "0\n"
+    assert target.sent == []
+
+    # a write of its own, then a change through HID that nobody announced
+    mirror.write("RELAY1:EN 1")
+    assert mirror.query("ROUT:CLOS? (@1:2)") == "1,0\n"
+    dev.hid().write([0] + [3, 0, 0, 0, 0, 0, 0, 0])
+    assert mirror.query("RELAY:MASK?") == "3\n"
+    del target.sent[:]
+    assert mirror.query("RELAY2:EN?") == "1\n" and target.sent == []
+
+    # an SRQ for some other reason costs one RELAY:GEN?, not a resync
+    resyncs = mirror.stats["resyncs"]
+    mirror._on_srq()
+    assert mirror.query("RELAY1:EN?") == "1\n"
+    assert target.sent == ["RELAY:GEN?"] and mirror.stats["resyncs"] == resyncs
+
+    # without SRQ every read past max_age_s checks the generation
+    dev = SimRelayDevice()
+    target = CountingTarget(dev.usbtmc())
+    mirror = RelayMirror(target, srq=False, max_age_s=3600)
+    assert mirror.query("RELAY:MASK?") == "0\n"
+    dev.set_mask(2)
+    assert mirror.query("RELAY:MASK?") == "0\n" # stale within max_age_s
+    mirror.max_age_s = 0
+    assert mirror.query("RELAY:MASK?") == "2\n"
+    assert mirror.query("RELAY5:EN?") == "\n" and dev.errors[-1] == -114 # out of range, asked the board
+    print("mirror OK", mirror.stats)
@@ -0,0 +1,191 @@
+#include "tusb.h"
+#include "bsp/board.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* NVMCTRL */
+
+// Power-on relay state, kept in NVM_ROWS flash rows inside the firmware
+// image. The rows are a log of 8 byte records, a new record goes into the next
+// erased slot. When a row is full the log moves on to the next row, which is
+// erased first, so each row is erased once every NVM_ROWS * 32 records and the
+// older rows keep their records meanwhile. Every record carries the sequence
+// number of its row, one more than the row before it, which finds the newest
+// row at power-on. Together with the coalescing delay in nvm_task this keeps
+// erase cycles low even when the relays change all the time. Flashing a new
+// UF2 resets the rows to erased, which means all relays off.
+//
+// The CPU runs from the flash it writes, so it stalls until the flash is
+// ready, interrupts included: up to 6 ms for a row erase, 2.5 ms for a page
+// write (SAMD21 datasheet, NVM characteristics). A relay edge, trigger or
+// USB interrupt that falls in that time is served late, nvm_task therefore
+// only writes when no relay edge is scheduled and no trigger is armed.
+#define NVM_ROW_SIZE        (FLASH_PAGE_SIZE * NVMCTRL_ROW_PAGES)
+#define NVM_ROWS            4u
+#define NVM_RECORDS         (NVM_ROW_SIZE / 8u) // per row
+#define NVM_MAGIC           0xA5000000u
+#define NVM_MAGIC_MASK      0xFF000000u
+#define NVM_MODE_LAST       0x00000001u   // restore the last relay state
+#define NVM_CHANNELS_POS    8u            // SYST:CHAN:COUN, 0 = RELAY_COUNT
+#define NVM_CHANNELS_MASK   0x0000FF00u
+#define NVM_SEQ_POS         16u           // sequence number of the row
+#define NVM_SEQ_MASK        0x00FF0000u
+#define NVM_COALESCE_MS     5000u         // state must be stable this long before it is written
+
+typedef struct
+{
+  uint32_t header;  // NVM_MAGIC | channel count | mode
+  uint32_t mask;    // power-on mask, or last state in NVM_MODE_LAST
+} nvm_record_t;
+
+static const volatile nvm_record_t nvm_rows[NVM_ROWS][NVM_RECORDS] __attribute__((aligned(NVM_ROW_SIZE))) =
+{
+  [0 ... NVM_ROWS - 1] = { [0 ... NVM_RECORDS - 1] = { 0xFFFFFFFFu, 0xFFFFFFFFu } }
+};
+
+static uint8_t  nvm_row_ix;           // row the log is in
+static uint8_t  nvm_seq;              // its sequence number
+static int8_t   nvm_last_ix = -1;     // newest valid record, -1 when the row is erased
+static bool     nvm_mode_last;
+static uint8_t  nvm_channels;
+static uint32_t nvm_mask;             // what should be in flash
+static uint32_t nvm_saved_header;
+static uint32_t nvm_saved_mask;
+static uint32_t nvm_seen_mask;
+static uint32_t nvm_change_ms;
+
+static void nvm_command(uint16_t cmd, volatile const void *addr)
+{
+  NVMCTRL->STATUS.reg = NVMCTRL_STATUS_MASK;         // clear errors
+  NVMCTRL->ADDR.reg   = (uint32_t)(uintptr_t)addr / 2u; // 16-bit word address
+  NVMCTRL->CTRLA.reg  = NVMCTRL_CTRLA_CMDEX_KEY | cmd;
+  while (!NVMCTRL->INTFLAG.bit.READY);
+}
+
+static bool nvm_valid(uint8_t row, uint8_t ix)
+{
+  return (nvm_rows[row][ix].header & NVM_MAGIC_MASK) == NVM_MAGIC;
+}
+
+static uint8_t nvm_row_seq(uint8_t row)
+{
+  return (uint8_t)((nvm_rows[row][0].header & NVM_SEQ_MASK) >> NVM_SEQ_POS);
+}
+
+static void nvm_write_record(uint32_t header, uint32_t mask)
+{
+  int8_t ix = (int8_t)(nvm_last_ix + 1);
+  if (ix >= (int8_t)NVM_RECORDS)
+  {
+    nvm_row_ix = (uint8_t)((nvm_row_ix + 1u) % NVM_ROWS);
+    nvm_seq++;
+    nvm_command(NVMCTRL_CTRLA_CMD_ER, &nvm_rows[nvm_row_ix][0]);
+    ix = 0;
+  }
+  NVMCTRL->CTRLB.bit.MANW = 1;
+  nvm_command(NVMCTRL_CTRLA_CMD_PBC, &nvm_rows[nvm_row_ix][ix]);
+  volatile uint32_t *dst = (volatile uint32_t *)(uintptr_t)&nvm_rows[nvm_row_ix][ix];
+  dst[0] = header | ((uint32_t)nvm_seq << NVM_SEQ_POS); // page buffer, rest of the page stays 0xFF
+  dst[1] = mask;
+  nvm_command(NVMCTRL_CTRLA_CMD_WP, &nvm_rows[nvm_row_ix][ix]);
+  nvm_last_ix      = ix;
+  nvm_saved_header = header;
+  nvm_saved_mask   = mask;
+}
+
+// Find the newest record, runs before the clocks and USB are up. The newest
+// row is the one the next row does not continue: that one is erased or has
+// an older sequence number.
+void nvm_setup(void)
+{
+  nvm_row_ix  = 0;
+  nvm_seq     = 0;
+  nvm_last_ix = -1;
+  for (uint8_t r = 0; r < NVM_ROWS; r++)
+  {
+    uint8_t next = (uint8_t)((r + 1u) % NVM_ROWS);
+    if (nvm_valid(r, 0) && !(nvm_valid(next, 0) && nvm_row_seq(next) == (uint8_t)(nvm_row_seq(r) + 1u)))
+    {
+      nvm_row_ix = r;
+      nvm_seq    = nvm_row_seq(r);
+      break;
+    }
+  }
+  for (uint8_t i = 0; i < NVM_RECORDS; i++)
+  {
+    if (!nvm_valid(nvm_row_ix, i))
+    {
+      break;
+    }
+    nvm_last_ix = (int8_t)i;
+  }
+  if (nvm_last_ix >= 0)
+  {
+    nvm_saved_header = nvm_rows[nvm_row_ix][nvm_last_ix].header & ~NVM_SEQ_MASK;
+    nvm_saved_mask   = nvm_rows[nvm_row_ix][nvm_last_ix].mask;
+  }
+  else
+  {
+    nvm_saved_header = NVM_MAGIC; // an erased row means all relays off
+    nvm_saved_mask   = 0;
+  }
+  nvm_mode_last = (nvm_saved_header & NVM_MODE_LAST) != 0;
+  nvm_channels  = (uint8_t)((nvm_saved_header & NVM_CHANNELS_MASK) >> NVM_CHANNELS_POS);
+  nvm_mask      = nvm_saved_mask;
+  nvm_seen_mask = nvm_mask;
+}
+
+uint32_t nvm_power_on_mask(void)
+{
+  return nvm_mask;
+}
+
+bool nvm_power_on_last(void)
+{
+  return nvm_mode_last;
+}
+
+// Takes effect at the next nvm_task, the write itself is not coalesced
+void nvm_set_power_on(bool last, uint32_t mask)
+{
+  nvm_mode_last = last;
+  nvm_mask      = last ? relay_read_mask() : mask;
+  nvm_seen_mask = nvm_mask;
+  nvm_change_ms = board_millis() - NVM_COALESCE_MS;
+}
+
+uint8_t nvm_channel_count(void)
+{
+  return nvm_channels;
+}
+
+// Written by the next nvm_task, like nvm_set_power_on
+void nvm_set_channels(uint8_t count)
+{
+  nvm_channels  = count;
+  nvm_change_ms = board_millis() - NVM_COALESCE_MS;
+}
+
+// Called from the main loop. Flash writes stall the CPU and its interrupts for
+// a few ms, so in "last state" mode a relay state is only written once it has
+// been stable for NVM_COALESCE_MS, a burst of changes ends up as a single
+// record. Any write waits until no relay edge is scheduled and no trigger is
+// armed, their interrupts would be late.
+void nvm_task(void)
+{
+  if (nvm_mode_last)
+  {
+    uint32_t mask = relay_read_mask() & ~relay_schedule_pending();
+    if (mask != nvm_seen_mask)
+    {
+      nvm_seen_mask = mask;
+      nvm_change_ms = board_millis();
+    }
+    nvm_mask = nvm_seen_mask;
+  }
+  uint32_t header = NVM_MAGIC | ((uint32_t)nvm_channels << NVM_CHANNELS_POS) | (nvm_mode_last ? NVM_MODE_LAST : 0u);
+  if ((header != nvm_saved_header || nvm_mask != nvm_saved_mask) &&
+      (board_millis() - nvm_change_ms) >= NVM_COALESCE_MS &&
+      !relay_schedule_pending() && !trigger_armed())
+  {
+    nvm_write_record(header, nvm_mask);
+  }
+}
@@ -0,0 +1,227 @@
+#include "tusb.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* PRIMASK */
+
+// Coil current budget. All coils are powered from the USB supply, switching a
+// whole bank on in the same instant can brown out the hub. With a budget set,
+// relays that turn on are split into steps that fit: while a step pulls in,
+// the relays already on draw their hold current and the new ones their
+// pull-in current. The next step follows after the longest pull-in time of
+// the previous one. Relays that turn off always do so immediately, in the same
+// OUT write as the first relays that turn on. RELAY:MASK:AT and the trigger
+// change the relays from the timer and EIC interrupts without a plan, the
+// command parser rejects them while a budget is set.
+#define POWER_CHANNELS   32u
+#define POWER_PULL_MAX_US 1000000u
+
+typedef struct
+{
+  uint16_t pull_ma;   // pull-in current
+  uint16_t hold_ma;   // hold current
+  uint32_t pull_us;   // pull-in time
+} relay_power_t;
+
+static relay_power_t relay_power[POWER_CHANNELS];
+static uint32_t      power_budget_ma;    // 0 = no limit
+static uint32_t      power_busy_until;   // end of the last scheduled pull-in
+static uint8_t       power_last_steps;
+static uint32_t      power_plan_step[POWER_CHANNELS]; // of the relay_apply being planned
+static uint32_t      power_plan_us[POWER_CHANNELS];
+
+void power_set_budget(uint32_t ma)
+{
+  power_budget_ma = ma;
+}
+
+uint32_t power_get_budget(void)
+{
+  return power_budget_ma;
+}
+
+void power_set_channel(uint8_t channel, uint16_t pull_ma, uint16_t hold_ma, uint32_t pull_us)
+{
+  relay_power[channel - 1].pull_ma = pull_ma;
+  relay_power[channel - 1].hold_ma = hold_ma;
+  relay_power[channel - 1].pull_us = pull_us;
+}
+
+void power_get_channel(uint8_t channel, uint16_t *pull_ma, uint16_t *hold_ma, uint32_t *pull_us)
+{
+  *pull_ma = relay_power[channel - 1].pull_ma;
+  *hold_ma = relay_power[channel - 1].hold_ma;
+  *pull_us = relay_power[channel - 1].pull_us;
+}
+
+// Sub-steps used by the last relay_apply
+uint8_t power_last_step_count(void)
+{
+  return power_last_steps;
+}
+
+static uint32_t power_hold_ma(uint32_t mask)
+{
+  uint32_t ma = 0;
+  for (uint8_t i = 0; i < POWER_CHANNELS; i++)
+  {
+    if (mask & (1u << i))
+    {
+      ma += relay_power[i].hold_ma;
+    }
+  }
+  return ma;
+}
+
+// Next step, first fit with the largest pull-in currents first. A relay that
+// does not fit even on its own still gets a step of its own.
+static uint32_t power_next_step(uint32_t on, uint32_t todo)
+{
+  uint32_t hold = power_hold_ma(on);
+  uint32_t left = power_budget_ma > hold ? power_budget_ma - hold : 0;
+  uint32_t step = 0;
+  uint32_t candidates = todo;
+
+  while (candidates)
+  {
+    int8_t best = -1;
+    for (uint8_t i = 0; i < POWER_CHANNELS; i++)
+    {
+      if ((candidates & (1u << i)) && (best < 0 || relay_power[i].pull_ma > relay_power[best].pull_ma))
+      {
+        best = (int8_t)i;
+      }
+    }
+    candidates &= ~(1u << best);
+    if (relay_power[best].pull_ma <= left)
+    {
+      left -= relay_power[best].pull_ma;
+      step |= 1u << best;
+    }
+  }
+  if (step == 0)
+  {
+    // nothing fits, take the smallest pull-in current
+    int8_t best = -1;
+    for (uint8_t i = 0; i < POWER_CHANNELS; i++)
+    {
+      if ((todo & (1u << i)) && (best < 0 || relay_power[i].pull_ma < relay_power[best].pull_ma))
+      {
+        best = (int8_t)i;
+      }
+    }
+    step = 1u << best;
+  }
+  return step;
+}
+
+static uint32_t power_step_us(uint32_t step)
+{
+  uint32_t us = 0;
+  for (uint8_t i = 0; i < POWER_CHANNELS; i++)
+  {
+    if ((step & (1u << i)) && relay_power[i].pull_us > us)
+    {
+      us = relay_power[i].pull_us;
+    }
+  }
+  return us;
+}
+
+// Splits todo into steps for relays already drawing on, into power_plan_step
+// and power_plan_us. Runs with interrupts enabled, returns the step count.
+static uint8_t power_plan(uint32_t on, uint32_t todo)
+{
+  uint8_t steps = 0;
+  while (todo)
+  {
+    uint32_t step = power_next_step(on, todo);
+    power_plan_step[steps] = step;
+    power_plan_us[steps]   = power_step_us(step);
+    on   |= step;
+    todo &= ~step;
+    steps++;
+  }
+  return steps;
+}
+
+// Turn clear off and set on, within the power budget. A pulse_us other than 0
+// turns each relay in set off again pulse_us after its own switch-on step.
+// Pending edges of the channels involved are replaced. cause is traced for
+// the immediate change, later steps and pulse ends have their own.
+//
+// The steps are planned with interrupts enabled, they are disabled only to
+// write the first step and schedule the others. An edge that fired while
+// planning changed the relays the plan started from, it is planned again.
+void relay_apply(uint32_t clear, uint32_t set, uint32_t pulse_us, uint8_t cause)
+{
+  uint32_t primask = __get_PRIMASK();
+  uint32_t off = clear & ~set;
+  uint32_t mask, pending, todo;
+  uint8_t  steps = 0;
+
+  for (;;)
+  {
+    mask    = relay_read_mask();
+    pending = relay_schedule_pending_set() & ~(clear | set); // the others stay scheduled
+    todo    = set & ~mask;
+    if (power_budget_ma != 0 && todo != 0)
+    {
+      steps = power_plan((mask & ~off) | pending, todo);
+    }
+    __disable_irq();
+    if (mask == relay_read_mask() && pending == (relay_schedule_pending_set() & ~(clear | set)))
+    {
+      break;
+    }
+    __set_PRIMASK(primask);
+  }
+
+  uint32_t now = timer_us();
+  uint32_t at  = now;
+  relay_schedule_cancel(clear | set);
+
+  if (power_budget_ma == 0 || todo == 0)
+  {
+    relay_update_mask(off, set, cause); // a mux switch, no state with both or neither
+    if (pulse_us)
+    {
+      relay_schedule(set, 0, now + pulse_us, TRACE_PULSE_END);
+    }
+    steps = todo ? 1 : 0;
+  }
+  else
+  {
+    uint32_t busy_us = power_busy_until - now;
+    if ((int32_t)busy_us > 0 && busy_us <= POWER_PULL_MAX_US * POWER_CHANNELS)
+    {
+      at = power_busy_until; // an earlier transition is still pulling in
+    }
+    if (pulse_us)
+    {
+      relay_schedule(set & ~todo, 0, now + pulse_us, TRACE_PULSE_END); // already on, only the return edge
+    }
+    for (uint8_t i = 0; i < steps; i++)
+    {
+      if (at == now)
+      {
+        relay_update_mask(off, power_plan_step[i], cause);
+        off = 0;
+      }
+      else
+      {
+        relay_schedule(0, power_plan_step[i], at, TRACE_STEP);
+      }
+      if (pulse_us)
+      {
+        relay_schedule(power_plan_step[i], 0, at + pulse_us, TRACE_PULSE_END);
+      }
+      at += power_plan_us[i];
+    }
+    if (off)
+    {
+      relay_update_mask(off, 0, cause); // the first step waits for an earlier transition
+    }
+    power_busy_until = at;
+  }
+  power_last_steps = steps;
+  __set_PRIMASK(primask);
+}
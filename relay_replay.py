@@ -0,0 +1,156 @@
+import argparse
+import json
+import re
+import sys
+import threading
+import time
+
+# Replays a recorded command trace against relay boards and reports throughput
+# and command latency percentiles. Targets are real boards through pyvisa
+# (--visa, repeat for more boards), in-process simulated boards (--sim N) or
+# boards behind relay_broker.py (--broker SOCKET). Each client is a thread
+# bound to one board, clients on the same board take turns like VISA sessions
+# sharing an instrument. Broker clients have a connection each and leave the
+# ordering to the broker. Latency is what the client sees, the wait for its
+# turn included.
+#
+# Trace files have one command per line, commands ending in '?' are queries:
+#   RELAY1:EN 1
+#   RELAY1:EN?
+#   sleep 0.5          pause, only with --sleep
+#   # comment
+# A Python script such as test_qtpy_2_channel_relay.py can be used as a trace,
+# its .write("..."), .query("...") and time.sleep(...) calls are extracted.
+#
+#   python3 relay_replay.py test_qtpy_2_channel_relay.py --sim 4 --clients 16 --iterations 200
+
+SCRIPT_CALL = re.compile(r'\.(write|query)\(\s*"([^"]*)"|time\.sleep\(\s*([0-9.]+)\s*\)')
+
+def load_trace(path):
+    text = open(path).read()
+    trace = []
+    if path.endswith(".py"):
+        for m in SCRIPT_CALL.finditer(text):
+            if m.group(3):
+                trace.append(("sleep", float(m.group(3))))
+            else:
+                trace.append((m.group(1), m.group(2)))
+        return trace
+    for line in text.splitlines():
+        line = line.strip()
+        if not line or line.startswith("#"):
+            continue
+        if line.lower().startswith("sleep "):
+            trace.append(("sleep", float(line[6:])))
+        else:
+            trace.append(("query" if line.endswith("?") else "write", line))
+    return trace
+
+def percentile(sorted_values, p):
+    # nearest rank
+    if not sorted_values:
+        return 0.0
+    rank = max(1, int(-(-p * len(sorted_values) // 100)))
+    return sorted_values[min(rank, len(sorted_values)) - 1]
+
+def open_targets(args):
+    targets = []
+    if args.sim:
+        from relay_sim import SimRelayDevice
+        for _ in range(args.sim):
+            targets.append(SimRelayDevice(channels=args.channels).usbtmc())
+    targets += args.broker # connected per client in main
+    if args.visa:
+        import pyvisa
+        rm = pyvisa.ResourceManager(args.visa_backend)
+        for resource in args.visa:
+            inst = rm.open_resource(resource)
+            inst.timeout = args.timeout_ms
+            if resource.upper().endswith("::SOCKET"):
+                inst.read_termination = "\n" # relay_vserver.py boards
+            targets.append(inst)
+    return targets
+
+def client(target, lock, trace, iterations, sleep, samples, failures):
+    for _ in range(iterations):
+        for kind, arg in trace:
+            if kind == "sleep":
+                if sleep:
+                    time.sleep(arg)
+                continue
+            start = time.perf_counter_ns() # includes waiting for the board
+            with lock:
+                try:
+                    if kind == "query":
+                        target.query(arg)
+                    else:
+                        target.write(arg)
+                except Exception:
+                    failures.append(arg)
+                    continue
+                samples.append((kind, time.perf_counter_ns() - start))
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay a command trace against relay boards")
+    parser.add_argument("trace", help="trace file, or a Python script with write/query calls")
+    parser.add_argument("--sim", type=int, default=0, help="number of simulated boards")
+    parser.add_argument("--channels", type=int, default=2, help="relay channels of a simulated board")
+    parser.add_argument("--visa", action="append", default=[], help="VISA resource of a real board")
+    parser.add_argument("--broker", action="append", default=[], help="Unix socket of relay_broker.py")
+    parser.add_argument("--visa-backend", default="@py")
+    parser.add_argument("--timeout-ms", type=int, default=2000)
+    parser.add_argument("--clients", type=int, default=1, help="concurrent clients, spread over the boards")
+    parser.add_argument("--iterations", type=int, default=1, help="trace repetitions per client")
+    parser.add_argument("--sleep", action="store_true", help="keep the pauses of the trace")
+    parser.add_argument("--json", action="store_true", help="print the report as JSON")
+    args = parser.parse_args()
+
+    trace = load_trace(args.trace)
+    targets = open_targets(args)
+    if not targets:
+        parser.error("no board, use --sim N, --visa RESOURCE or --broker SOCKET")
+    locks = [threading.Lock() for _ in targets]
+    clients = []
+    for i in range(args.clients):
+        target = targets[i % len(targets)]
+        if isinstance(target, str):
+            from relay_broker import BrokerClient
+            clients.append((BrokerClient(target), threading.Lock()))
+        else:
+            clients.append((target, locks[i % len(targets)]))
+
+    samples = []   # list.append is atomic, shared by all clients
+    failures = []
+    threads = [threading.Thread(target=client, args=(target, lock, trace, args.iterations, args.sleep,
+                                                     samples, failures))
+               for target, lock in clients]
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - start
+
+    report = {"boards": len(targets), "clients": args.clients, "commands": len(samples),
+              "failures": len(failures), "seconds": round(elapsed, 6),
+              "commands_per_s": round(len(samples) / elapsed, 1) if elapsed > 0 else 0.0}
+    for kind in ("all", "write", "query"):
+        lat = sorted(ns / 1000.0 for k, ns in samples if kind == "all" or k == kind)
+        if lat:
+            report[kind] = {"n": len(lat), "p50_us": round(percentile(lat, 50), 1),
+                            "p99_us": round(percentile(lat, 99), 1),
+                            "p999_us": round(percentile(lat, 99.9), 1), "max_us": round(lat[-1], 1)}
+
+    if args.json:
+        print(json.dumps(report, indent=2))
+    else:
+        print("{boards} boards, {clients} clients, {commands} commands in {seconds} s, "
+              "{commands_per_s} commands/s, {failures} failures".format(**report))
+        for kind in ("all", "write", "query"):
+            if kind in report:
+                print("{:6} n={n:<8} p50={p50_us} us  p99={p99_us} us  p999={p999_us} us  max={max_us} us"
+                      .format(kind, **report[kind]))
+    return 1 if failures else 0
+
+if __name__ == "__main__":
+    sys.exit(main())
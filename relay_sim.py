@@ -0,0 +1,548 @@
+import random
+import re
+import struct
+from collections import deque
+
+# In-process model of the relay firmware for host tools, without a board.
+# SimRelayDevice holds one relay state engine, SimUsbtmc (pyvisa resource
+# style write/read/query) and SimHid (hidapi device style write/read) are its
+# two USB interfaces, like usbtmc_app.c and hid_app.c on the board. Covers the
+# relay state commands; timing (pulses, power budget steps, PWM) is not modelled.
+# Channels past the GPIO ones go to SimExpander chips through SimExpanderBus,
+# a rewrite of the write sequence of relay_i2c.c. SimSofBus drives
+# SimTimebase, a rewrite of the USB frame timebase of relay_timer.c, on
+# several devices for RELAY:MASK:AT. RELAY:GEN? and the relay bit of the
+# status byte raise SRQs like the firmware's interrupt endpoint, through the
+# pyvisa install_handler call.
+#
+# None of the firmware's C code runs here. The self-check below tests the
+# model, host tools written against it still need a board, and a change of
+# the firmware has to be made here by hand.
+IDN = "RELAY1:EN 1, RELAY2:EN 1, https://github.com/charkster/relay_usbtmc"
+ROUT_GROUPS = 4
+STB_RELAY = 0x02 # the relays changed since the last RELAY:GEN? or *CLS
+STB_EAV = 0x04
+STB_SRQ = 0x40
+
+ERRORS = {
+    -113: "Undefined header",
+    -114: "Header suffix out of range",
+    -221: "Settings conflict",
+    -222: "Data out of range",
+}
+
+class SimExpander:
+    # Register file of an MCP23017 (IOCON.BANK = 0) or PCA9555 as seen from
+    # the I2C bus: a write transaction is the register pointer and data bytes,
+    # the pointer steps within the port A/B (0/1) register pair
+    REGS = {"mcp23017": {"output": 0x14, "dir": 0x00}, "pca9555": {"output": 0x02, "dir": 0x06}}
+
+    def __init__(self, address, chip="mcp23017"):
+        self.address = address
+        self.chip = chip
+        regs = self.REGS[chip]
+        self.output_reg, self.dir_reg = regs["output"], regs["dir"]
+        self.regs = bytearray(0x16)
+        self.regs[self.dir_reg:self.dir_reg + 2] = b"\xff\xff" # all inputs after reset
+        if chip == "pca9555":
+            self.regs[self.output_reg:self.output_reg + 2] = b"\xff\xff"
+        self.glitches = 0 # pins made outputs before their level was written
+        self.ports_written = set()
+
+    def _pair(self, reg):
+        return self.regs[reg] | self.regs[reg + 1] << 8
+
+    # Levels of the pins that are outputs, bit 0 = port A/0 bit 0
+    def outputs(self):
+        return self._pair(self.output_reg) & ~self._pair(self.dir_reg) & 0xFFFF
+
+    def i2c_write(self, data):
+        reg = data[0]
+        for value in data[1:]:
+            port = reg & 1
+            if reg & ~1 == self.dir_reg and self.regs[reg] & ~value and port not in self.ports_written:
+                self.glitches += 1
+            if reg & ~1 == self.output_reg:
+                self.ports_written.add(port)
+            self.regs[reg] = value
+            reg ^= 1 # port A -> B -> A
+        return True
+
+
+class SimExpanderBus:
+    # Rewrite of relay_i2c.c: an expander whose 16 outputs changed gets one
+    # transaction with the output register and both bytes, the direction
+    # registers are written once, after the outputs. Absent addresses do not
+    # acknowledge, their write is repeated with the next change.
+    def __init__(self, expanders):
+        self.expanders = expanders
+        self.sent = [None] * len(expanders)
+        self.dir_done = [False] * len(expanders)
+        self.failed = [False] * len(expanders)
+        self.transactions = []           # (address, bytes)
+        self.last = len(expanders) - 1   # round robin start
+
+    def _transfer(self, n, data):
+        self.transactions.append((self.expanders[n].address, bytes(data)))
+        ok = self.expanders[n].i2c_write(data) if self.expanders[n].address is not None else False
+        self.failed[n] = not ok
+        if not ok:
+            self.dir_done[n] = False
+
+    def write(self, mask):
+        while True:
+            count = len(self.expanders)
+            for i in range(1, count + 1):
+                n = (self.last + i) % count
+                out = mask >> (16 * n) & 0xFFFF
+                if out != self.sent[n]:
+                    self.sent[n] = out
+                    self.last = n
+                    self._transfer(n, [self.expanders[n].output_reg, out & 0xFF, out >> 8])
+                    break
+            else:
+                for n in range(count):
+                    if not self.dir_done[n] and not self.failed[n]:
+                        self.dir_done[n] = True
+                        self._transfer(n, [self.expanders[n].dir_reg, 0, 0])
+                        break
+                else:
+                    return
+
+    def outputs(self):
+        mask = 0
+        for n, expander in enumerate(self.expanders):
+            mask |= expander.outputs() << (16 * n)
+        return mask
+
+
+class SimTimebase:
+    # Rewrite of the relay_timer.c frame timebase. Times are the device's own
+    # timer_us() values; a SOF timestamp earlier than predicted is taken at
+    # once, a later one moves the frame start by 1/16 of its delay.
+    FRAME_US = 1000
+    FRAME_MASK = 0x7FF
+    LOCK_FRAMES = 16
+    LOST_US = 3000
+
+    def __init__(self):
+        self.sof_us = self.sof_last = self.frame = 0
+        self.seen = 0
+
+    def sof(self, frame, now):
+        frame &= self.FRAME_MASK
+        if self.seen == 0 or (now - self.sof_last) & 0xFFFFFFFF > self.LOST_US:
+            self.sof_us, self.seen = now, 1
+        else:
+            predicted = self.sof_us + ((frame - self.frame) & self.FRAME_MASK) * self.FRAME_US
+            late = now - predicted
+            self.sof_us = now if late < 0 else predicted + (late >> 4)
+            self.seen = min(self.seen + 1, self.LOCK_FRAMES)
+        self.frame, self.sof_last = frame, now
+
+    def locked(self, now):
+        return self.seen >= self.LOCK_FRAMES and now - self.sof_last <= self.LOST_US
+
+    def frame_now(self, now):
+        since = now - self.sof_us
+        return (self.frame + since // self.FRAME_US) & self.FRAME_MASK, since % self.FRAME_US
+
+    # timer_us() value of us into the next frame with that number, None
+    # when that frame has already passed
+    def deadline(self, frame, us, now):
+        ahead = (frame - self.frame) & self.FRAME_MASK
+        if ahead > self.FRAME_MASK // 2:
+            return None
+        deadline = self.sof_us + ahead * self.FRAME_US + us
+        return deadline if deadline > now else None
+
+
+class SimSofBus:
+    # One host controller: every device sees the SOF of each frame, after an
+    # interrupt latency of its own, on a timer with its own power-on offset
+    # and the residual rate error of its DFLL. Bus time is in microseconds.
+    def __init__(self, devices, latency_us=(2, 15), ppm=20, seed=1):
+        self.devices = devices
+        self.latency_us = latency_us
+        self.rng = random.Random(seed)
+        self.frame = 0
+        self.applied = {} # device -> bus time of its last RELAY:MASK:AT
+        for dev in devices:
+            dev.timebase = SimTimebase()
+            dev.clock = (self.rng.randrange(1 << 20), 1 + self.rng.uniform(-ppm, ppm) * 1e-6)
+
+    @staticmethod
+    def local(dev, t):
+        offset, rate = dev.clock
+        return int(offset + t * rate)
+
+    def run(self, frames):
+        for _ in range(frames):
+            t = self.frame * SimTimebase.FRAME_US
+            for dev in self.devices:
+                dev.timebase.sof(self.frame, self.local(dev, t + self.rng.uniform(*self.latency_us)))
+                dev.now = self.local(dev, t)
+            for dev in self.devices:
+                end = self.local(dev, t + SimTimebase.FRAME_US)
+                for deadline, clear, set_ in [e for e in dev.scheduled if e[0] < end]:
+                    dev.scheduled.remove((deadline, clear, set_))
+                    dev._apply(clear, set_)
+                    offset, rate = dev.clock
+                    self.applied[dev] = (deadline - offset) / rate # TC4 compare at the deadline
+                dev.now = end
+            self.frame += 1
+
+
+class SimRelayDevice:
+    def __init__(self, channels=2, idn=IDN, expanders=()):
+        self.channels = channels
+        self.idn = idn
+        self.all_mask = (1 << channels) - 1
+        self.mask = 0
+        self.groups = [0] * ROUT_GROUPS
+        self.errors = deque()
+        self.esr = 0x80 # PON
+        self.sre = 0
+        self.generation = 0 # RELAY:GEN?
+        self.gen_seen = 0
+        self.srq_handlers = [] # called with the status byte when the summary bit comes up
+        self.srq_sent = False
+        self.hid_reports = deque()
+        self.timebase = None # SimSofBus sets up the frame timebase
+        self.now = 0
+        self.scheduled = [] # RELAY:MASK:AT, (deadline, clear, set)
+        # channels - 16 per expander are GPIOs, like RELAY_PORTS
+        self.gpio_count = channels - 16 * len(expanders)
+        self.expander_bus = SimExpanderBus(list(expanders)) if expanders else None
+        if self.expander_bus:
+            self.expander_bus.write(0) # power-on state in gpio_setup
+
+    # --- relay state engine, relay_set_mask / relay_apply ---
+
+    def _conflict(self, mask):
+        return any(bin(mask & g).count("1") > 1 for g in self.groups)
+
+    def _exclusive(self, mask):
+        opened = 0
+        for g in self.groups:
+            if mask & g:
+                opened |= g
+        return opened & ~mask
+
+    def _apply(self, clear, set_):
+        new = ((self.mask & ~clear) | set_) & self.all_mask
+        if self.expander_bus:
+            self.expander_bus.write(new >> self.gpio_count)
+        if new != self.mask:
+            self.mask = new
+            self.generation += 1
+            self._hid_report() # hid_task sends a report on every change
+            self._service_request()
+
+    def set_mask(self, mask):
+        if mask & ~self.all_mask or self._conflict(mask):
+            return False
+        self._apply(self.all_mask & ~mask, mask)
+        return True
+
+    def _hid_report(self):
+        self.hid_reports.append(struct.pack("<Q", self.mask))
+
+    def status_byte(self):
+        stb = STB_EAV if self.errors else 0
+        if self.generation != self.gen_seen:
+            stb |= STB_RELAY
+        return stb | (STB_SRQ if stb & self.sre else 0)
+
+    # srq_task, one SRQ each time the summary bit comes up
+    def _service_request(self):
+        stb = self.status_byte()
+        if not stb & STB_SRQ:
+            self.srq_sent = False
+        elif not self.srq_sent:
+            self.srq_sent = True
+            for handler in list(self.srq_handlers):
+                handler(stb)
+
+    # --- SCPI ---
+
+    def _error(self, code):
+        self.errors.append(code)
+        self.esr |= 0x20 if -200 < code <= -100 else 0x10
+
+    def _parse_mask(self, text):
+        text = text.strip().lower()
+        if text.startswith("#h"):
+            value = int(text[2:], 16)
+        elif text.startswith("#b"):
+            value = int(text[2:], 2)
+        else:
+            value = int(text, 0)
+        if value & ~self.all_mask:
+            raise ValueError(text)
+        return value
+
+    def _parse_list(self, text):
+        m = re.fullmatch(r"\s*\(@([0-9:,\s]*)\)", text)
+        if not m:
+            raise ValueError(text)
+        mask = 0
+        for entry in filter(None, (e.strip() for e in m.group(1).split(","))):
+            first, _, last = entry.partition(":")
+            first, last = int(first), int(last or first)
+            first, last = min(first, last), max(first, last)
+            if first < 1 or last > self.channels:
+                raise ValueError(text)
+            for ch in range(first, last + 1):
+                mask |= 1 << (ch - 1)
+        return mask
+
+    def _format_list(self, mask):
+        parts = []
+        ch = 0
+        while ch < self.channels:
+            if not mask >> ch & 1:
+                ch += 1
+                continue
+            first = ch
+            while ch + 1 < self.channels and mask >> (ch + 1) & 1:
+                ch += 1
+            parts.append(str(first + 1) if first == ch else "%d:%d" % (first + 1, ch + 1))
+            ch += 1
+        return "(@" + ",".join(parts) + ")"
+
+    # Returns the response text of a query, None for commands
+    def scpi(self, msg):
+        msg = msg.strip().lower()
+        try:
+            return self._scpi(msg)
+        except ValueError:
+            self._error(-222)
+            return None
+        finally:
+            self._service_request()
+
+    def _scpi(self, msg):
+        if msg == "*idn?":
+            return self.idn
+        if msg == "*rst":
+            self._apply(self.all_mask, 0)
+            return None
+        if msg == "*cls":
+            self.errors.clear()
+            self.esr = 0
+            self.gen_seen = self.generation
+            return None
+        if msg == "*esr?":
+            esr, self.esr = self.esr, 0
+            return str(esr)
+        if msg == "*stb?":
+            return str(self.status_byte())
+        if msg == "*sre?":
+            return str(self.sre)
+        if msg.startswith("*sre "):
+            self.sre = int(msg[5:]) & ~STB_SRQ & 0xFF
+            return None
+        if msg == "relay:gen?":
+            self.gen_seen = self.generation
+            return str(self.generation)
+        if msg == "syst:err?":
+            code = self.errors.popleft() if self.errors else 0
+            return '%d,"%s"' % (code, ERRORS.get(code, "No error" if code == 0 else "Error"))
+        if msg == "syst:time?":
+            if not self.timebase or not self.timebase.locked(self.now):
+                self._error(-221)
+                return None
+            return "%d,%d" % self.timebase.frame_now(self.now)
+        m = re.fullmatch(r"relay:mask:at (\d+),(\d+),(.*)", msg)
+        if m:
+            frame, us, mask = int(m.group(1)), int(m.group(2)), self._parse_mask(m.group(3))
+            if frame > SimTimebase.FRAME_MASK or us >= SimTimebase.FRAME_US:
+                raise ValueError(msg)
+            if self._conflict(mask) or not self.timebase or not self.timebase.locked(self.now):
+                self._error(-221)
+                return None
+            deadline = self.timebase.deadline(frame, us, self.now)
+            if deadline is None:
+                raise ValueError(msg)
+            self.scheduled = [(deadline, self.all_mask & ~mask, mask)]
+            return None
+        if msg == "relay:mask?":
+            return str(self.mask)
+        if msg.startswith("relay:mask "):
+            if not self.set_mask(self._parse_mask(msg[11:])):
+                self._error(-221)
+            return None
+        m = re.fullmatch(r"relay(\d+)(:en\?|:en (.*))", msg)
+        if m:
+            ch = int(m.group(1))
+            if not 1 <= ch <= self.channels:
+                self._error(-114)
+                return None
+            bit = 1 << (ch - 1)
+            if m.group(2) == ":en?":
+                return str(self.mask >> (ch - 1) & 1)
+            value = {"1": 1, "on": 1, "0": 0, "off": 0}.get(m.group(3))
+            if value is None:
+                raise ValueError(msg)
+            if value:
+                self._apply(self._exclusive(bit), bit)
+            else:
+                self._apply(bit, 0)
+            return None
+        m = re.fullmatch(r"rout:(clos\?|clos|open) (.*)", msg)
+        if m:
+            mask = self._parse_list(m.group(2))
+            if m.group(1) == "clos?":
+                return ",".join(str(self.mask >> ch & 1) for ch in range(self.channels) if mask >> ch & 1)
+            if m.group(1) == "open":
+                self._apply(mask, 0)
+            elif self._conflict(mask):
+                self._error(-221)
+            else:
+                self._apply(self._exclusive(mask), mask)
+            return None
+        m = re.fullmatch(r"rout:grp:def(\?)? (\d+)(,.*)?", msg)
+        if m and 1 <= int(m.group(2)) <= ROUT_GROUPS and (m.group(1) is None) == (m.group(3) is not None):
+            group = int(m.group(2)) - 1
+            if m.group(1):
+                return self._format_list(self.groups[group])
+            self.groups[group] = self._parse_list(m.group(3)[1:])
+            return None
+        if msg.startswith("rout:grp:def"):
+            raise ValueError(msg)
+        self._error(-113)
+        return None
+
+    def usbtmc(self):
+        return SimUsbtmc(self)
+
+    def hid(self):
+        return SimHid(self)
+
+
+class SimUsbtmc:
+    # Same calls as a pyvisa resource, so scripts can run on either
+    def __init__(self, device):
+        self.device = device
+        self.response = None
+
+    def write(self, msg):
+        self.response = self.device.scpi(msg)
+
+    # Commands without a response answer "\n" like the firmware does
+    def read(self):
+        response, self.response = self.response, None
+        return (response if response is not None else "") + "\n"
+
+    def query(self, msg):
+        self.write(msg)
+        return self.read()
+
+    def read_stb(self):
+        return self.device.status_byte()
+
+    # pyvisa event calls for the service request, handler(resource, event, user_handle)
+    def install_handler(self, event_type, handler, user_handle=None):
+        self.device.srq_handlers.append(lambda stb: handler(self, event_type, user_handle))
+
+    def enable_event(self, event_type, mechanism, context=None):
+        pass
+
+    def close(self):
+        pass
+
+
+class SimHid:
+    # Same calls as a hidapi device, for relay_hid.RelayHid
+    def __init__(self, device):
+        self.device = device
+
+    def write(self, data):
+        report = bytes(data[1:]) # report ID 0 first, as hidapi expects
+        if len(report) == 8:
+            mask = struct.unpack("<Q", report)[0]
+            self.device.set_mask(mask)
+            self.device._hid_report() # the answer to every OUT report
+        return len(data)
+
+    def read(self, length, timeout_ms=0):
+        if not self.device.hid_reports:
+            return []
+        return list(self.device.hid_reports.popleft()[:length])
+
+    def get_input_report(self, report_id, length):
+        return [report_id] + list(struct.pack("<Q", self.device.mask))[:length - 1]
+
+    def close(self):
+        pass
+
+
+if __name__ == "__main__":
+    from relay_hid import RelayHid
+
+    dev = SimRelayDevice()
+    scpi = dev.usbtmc()
+    hid = RelayHid(dev.hid())
+
+    # the sequence of test_qtpy_2_channel_relay.py, through both interfaces
+    assert scpi.query("*IDN?").startswith("RELAY1:EN 1")
+    scpi.write("RELAY1:EN 1")
+    assert hid.get_mask() == 1
+    assert hid.set_mask(3) == 3
+    assert scpi.query("RELAY2:EN?") == "1\n"
+    scpi.write("*RST")
+    assert hid.get_mask() == 0
+
+    # exclusive group, a rejected mask is answered with the unchanged one
+    scpi.write("ROUT:GRP:DEF 1,(@1:2)")
+    assert hid.set_mask(1) == 1
+    assert hid.set_mask(3) == 1
+    assert hid.set_mask(4) == 1
+    scpi.write("ROUT:CLOS (@2)")
+    assert scpi.query("ROUT:CLOS? (@1:2)") == "0,1\n"
+    assert hid.get_mask() == 2
+    assert scpi.query("SYST:ERR?") == '0,"No error"\n'
+
+    # no GPIO channels and two expanders fill the 32 bit relay mask
+    chips = [SimExpander(0x20), SimExpander(0x21, "pca9555")]
+    dev = SimRelayDevice(channels=32, expanders=chips)
+    bus = dev.expander_bus
+    assert [t[1][0] for t in bus.transactions] == [0x14, 0x02, 0x00, 0x06] # outputs before direction
+    assert not any(chip.glitches for chip in chips)
+    scpi = dev.usbtmc()
+    del bus.transactions[:]
+    scpi.write("RELAY20:EN 1")
+    assert bus.transactions == [(0x21, bytes([0x02, 0x08, 0x00]))] # one burst, only the changed chip
+    assert bus.outputs() == 1 << 19
+    del bus.transactions[:]
+    scpi.write("RELAY:MASK #HFFFFFFFF")
+    assert len(bus.transactions) == 2 and dev.mask == 0xFFFFFFFF # one burst per chip
+    scpi.write("RELAY:MASK #H0000FFFF")
+    assert bus.outputs() == 0x0000FFFF
+    chips[0].address = None # chip 1 stops acknowledging
+    scpi.write("RELAY1:EN 0")
+    assert bus.failed == [True, False] and bus.outputs() == 0x0000FFFF
+    chips[0].address = 0x20
+    scpi.write("RELAY2:EN 0")
+    assert bus.failed == [False, False] and bus.outputs() == 0x0000FFFC
+
+    # RELAY:MASK:AT on four boards at one frame instant, each with its own
+    # timer offset, rate error and SOF interrupt latency
+    boards = [SimRelayDevice() for _ in range(4)]
+    sof_bus = SimSofBus(boards)
+    assert boards[0].scpi("syst:time?") is None and boards[0].errors.popleft() == -221 # no SOF yet
+    sof_bus.run(100)
+    frame, us = map(int, boards[0].usbtmc().query("SYST:TIME?").split(","))
+    assert frame * 1000 + us in range(99980, 100000) # the SOF latency is mostly filtered out
+    at = (frame + 200) & SimTimebase.FRAME_MASK
+    for board in boards:
+        board.usbtmc().write("RELAY:MASK:AT %d,500,3" % at)
+    boards[0].usbtmc().write("RELAY:MASK:AT %d,500,1" % (frame - 10))
+    assert boards[0].errors.popleft() == -222 # already passed
+    sof_bus.run(300)
+    times = [sof_bus.applied[board] for board in boards]
+    assert all(board.mask == 3 for board in boards)
+    assert max(times) - min(times) < 20, times
+    assert all(abs(t - (frame + 200) * 1000 - 500) < 30 for t in times), times
+    print("simulated device OK")
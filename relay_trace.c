@@ -0,0 +1,94 @@
+#include <stdio.h>      /* sprintf */
+#include "tusb.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* PRIMASK */
+
+// Relay transition trace. relay_update_mask records every change of the relay
+// state in a RAM ring, the oldest entries are overwritten. Recording is a few
+// stores, the entries are sent to the host as they are and decoded there.
+//
+// TRAC:DATA? returns the entries oldest first as an IEEE 488.2 definite
+// length block, 16 bytes per entry, little endian:
+//   uint32 timer_us() of the change
+//   uint32 relay mask before
+//   uint32 relay mask after
+//   uint8  cause, TRACE_* in usbtmc_app.h
+//   uint8  reserved[3]
+#define TRACE_LEN        128u           // must be a power of two
+#define TRACE_ENTRY_LEN  16u
+
+typedef struct
+{
+  uint32_t us;
+  uint32_t before;
+  uint32_t after;
+  uint8_t  cause;
+  uint8_t  reserved[3];
+} trace_entry_t;
+
+static trace_entry_t trace_ring[TRACE_LEN];
+static volatile uint32_t trace_head;   // entries recorded since the last clear
+
+TU_VERIFY_STATIC(2u + 4u + TRACE_LEN * TRACE_ENTRY_LEN + 1u <= BLOCK_OUT_LEN, "TRAC:DATA? block does not fit");
+
+// Called from relay_update_mask with interrupts disabled
+void trace_record(uint32_t before, uint32_t after, uint8_t cause)
+{
+  trace_entry_t *entry = &trace_ring[trace_head & (TRACE_LEN - 1u)];
+  entry->us     = timer_us();
+  entry->before = before;
+  entry->after  = after;
+  entry->cause  = cause;
+  trace_head++;
+}
+
+void trace_clear(void)
+{
+  trace_head = 0;
+}
+
+// Time of the newest transition, false when the trace is empty
+bool trace_last(uint32_t *us)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  bool any = trace_head != 0;
+  if (any)
+  {
+    *us = trace_ring[(trace_head - 1u) & (TRACE_LEN - 1u)].us;
+  }
+  __set_PRIMASK(primask);
+  return any;
+}
+
+// Snapshot of the ring as a definite length block in a BLOCK_OUT_LEN buffer,
+// so that transitions during the transfer can not tear it. Returns its length.
+// The entries are copied with interrupts enabled, trace_head is read again
+// afterwards and the oldest entries, overwritten by transitions meanwhile, are
+// dropped.
+size_t trace_block(uint8_t *block)
+{
+  uint32_t head  = trace_head;
+  uint32_t count = head < TRACE_LEN ? head : TRACE_LEN;
+  uint32_t first = head - count;
+  uint8_t *data  = &block[2u + 4u]; // behind the longest header
+  for (uint32_t i = 0; i < count; i++)
+  {
+    memcpy(&data[i * TRACE_ENTRY_LEN], &trace_ring[(first + i) & (TRACE_LEN - 1u)], TRACE_ENTRY_LEN);
+  }
+  __DMB(); // the copy is done before trace_head is read again
+  uint32_t lost = trace_head - first;
+  lost = lost > TRACE_LEN ? lost - TRACE_LEN : 0u;
+  lost = lost < count ? lost : count;
+  count -= lost;
+
+  char   digits[8];
+  size_t len = count * TRACE_ENTRY_LEN;
+  size_t hdr = (size_t)sprintf(digits, "%lu", (unsigned long)len);
+  block[0] = '#';
+  block[1] = (uint8_t)('0' + hdr);
+  memmove(&block[2u + hdr], &data[lost * TRACE_ENTRY_LEN], len);
+  memcpy(&block[2u], digits, hdr);
+  block[2u + hdr + len] = '\n';
+  return 2u + hdr + len + 1u;
+}
@@ -0,0 +1,111 @@
+import struct
+import sys
+
+# Reads the relay transition trace (TRAC:DATA?) and prints it. The board only
+# copies raw 16 byte entries into an IEEE 488.2 definite length block, see
+# relay_trace.c, all decoding and formatting happens here.
+CAUSES = {
+    1: "power-on",
+    2: "*RST",
+    3: "RELAY:EN",
+    4: "RELAY:PULS",
+    5: "RELAY:MASK",
+    6: "ROUT",
+    7: "HID",
+    8: "power step",
+    9: "pulse end",
+    10: "SYST:CHAN",
+    11: "trigger",
+    12: "RELAY:MASK:AT",
+    13: "*RCL",
+}
+ENTRY = struct.Struct("<IIIB3x")
+INPUT_ENTRY = struct.Struct("<IBB2x")   # INP:DATA?, see relay_input.c
+
+def parse_block(data):
+    if data[:1] != b"#":
+        raise ValueError("not a definite length block")
+    digits = int(data[1:2])
+    length = int(data[2:2 + digits] or b"0")
+    body = data[2 + digits:2 + digits + length]
+    if len(body) != length:
+        raise ValueError("block is %d bytes short" % (length - len(body)))
+    return body
+
+# Entries as tuples starting with us, unwrapped past the 32-bit timer
+def unwrap(entries):
+    out = []
+    offset = 0
+    last = None
+    for entry in entries:
+        us = entry[0]
+        if last is not None and us < last % (1 << 32):
+            offset += 1 << 32
+        last = us + offset
+        out.append((last,) + tuple(entry[1:]))
+    return out
+
+# Entries as (us, before, after, cause)
+def decode(data):
+    return unwrap(ENTRY.iter_unpack(parse_block(data)))
+
+# Input edges as (us, input, level)
+def decode_inputs(data):
+    return unwrap(INPUT_ENTRY.iter_unpack(parse_block(data)))
+
+def changes(before, after, channels=32):
+    text = []
+    for ch in range(channels):
+        bit = 1 << ch
+        if (before ^ after) & bit:
+            text.append("%d%s" % (ch + 1, "+" if after & bit else "-"))
+    return " ".join(text)
+
+def block_complete(data):
+    if len(data) < 2:
+        return False
+    digits = int(data[1:2])
+    return len(data) >= 2 + digits and len(data) >= 2 + digits + int(data[2:2 + digits] or b"0")
+
+def read_block(inst, query):
+    inst.write(query)
+    data = inst.read_raw()
+    while not block_complete(data):
+        data += inst.read_raw() # the transfer ends early on a TermChar in the data
+    return data
+
+def read_trace(inst):
+    return decode(read_block(inst, "TRAC:DATA?"))
+
+def read_inputs(inst):
+    return decode_inputs(read_block(inst, "INP:DATA?"))
+
+# Relay transitions, merged with input edges when given. Both rings share
+# the timer_us() timebase, but each unwraps on its own, so a merge is only
+# exact while neither spans a timer wrap (71 minutes).
+def print_trace(entries, inputs=()):
+    lines = [(e[0], 0, e) for e in entries] + [(e[0], 1, e) for e in inputs]
+    if not lines:
+        print("trace is empty")
+        return
+    lines.sort(key=lambda line: line[:2])
+    t0 = lines[0][0]
+    for us, kind, entry in lines:
+        if kind:
+            print("%12.3f ms  %-11s INP%d %s" % ((us - t0) / 1000.0, "input", entry[1], "high" if entry[2] else "low"))
+        else:
+            before, after, cause = entry[1:]
+            print("%12.3f ms  %-11s %08x -> %08x  %s" % ((us - t0) / 1000.0, CAUSES.get(cause, str(cause)),
+                                                       before, after, changes(before, after)))
+
+if __name__ == "__main__":
+    import pyvisa
+    rm = pyvisa.ResourceManager('@py')
+    args = [a for a in sys.argv[1:] if not a.startswith("--")]
+    resource = args[0] if args else 'USB0::51966::16384::123456::0::INSTR'
+    inst = rm.open_resource(resource)
+    print_trace(read_trace(inst), read_inputs(inst) if "--inputs" in sys.argv else ())
+    if "--clear" in sys.argv:
+        inst.write("TRAC:CLE")
+        if "--inputs" in sys.argv:
+            inst.write("INP:CLE")
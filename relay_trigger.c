@@ -0,0 +1,184 @@
+#define TRIG_PIN         10             // PA pin of the trigger input: MOSI PA10
+
+#include "tusb.h"
+#include "usbtmc_app.h"
+#include "sam.h" /* EIC, EVSYS, PORT pin multiplexer */
+
+// Trigger input. INIT arms the action set with TRIG:MASK, the next trigger
+// applies it and disarms. With TRIG:SOUR BUS the trigger is the USB488
+// TRIGGER message, with TRIG:SOUR EXT an edge of TRIG:SLOP on the trigger
+// pin.
+//
+// The pin is an EIC line whose event goes through EVSYS into TC4, which
+// captures the edge time into CC1 in hardware. The EIC interrupt applies the
+// mask right away with TRIG:DEL 0, the relay pins then change a few
+// microseconds after the edge (TRIG:LAT? of the last trigger). With a delay
+// the mask is scheduled on the relay timer for the captured time plus the
+// delay, which does not depend on interrupt latency at all. A triggered mask
+// has no power budget plan, INIT is rejected while a budget is set. An armed
+// waveform (SOUR:WAV:ARM) starts with it.
+//
+// The line senses both edges, the slope is checked against the pin level,
+// so the pin can also be one of the INP capture inputs.
+#define TRIG_EVSYS_CHANNEL 1u           // channel 0 is the DAC's
+TU_VERIFY_STATIC(!(PA_BIT(TRIG_PIN) & BUS_PINS),
+                 "the shift register chain or the expander bus has TRIG_PIN, move it");
+
+static uint8_t           trig_source = TRIG_SOUR_BUS;
+static bool              trig_negative;
+static uint32_t          trig_delay_us;
+static uint32_t          trig_clear;    // action, channels turned off ...
+static uint32_t          trig_set;      // ... and on
+static volatile bool     trig_armed;
+static volatile uint32_t trig_count;    // triggers that fired since power-on
+static volatile uint32_t trig_latency;  // us from the edge to the relay write
+
+static uint8_t trig_extint(void)
+{
+  return TRIG_PIN & 15u;
+}
+
+// After input_setup, which has set up the EIC
+void trigger_setup(void)
+{
+  uint8_t extint = trig_extint();
+  PM->APBCMASK.reg |= PM_APBCMASK_EVSYS;
+
+  PORT->Group[0].OUTSET.reg = 1u << TRIG_PIN;  // pull-up, like the INP inputs
+  PORT->Group[0].PINCFG[TRIG_PIN].reg = PORT_PINCFG_INEN | PORT_PINCFG_PULLEN | PORT_PINCFG_PMUXEN;
+  if (TRIG_PIN & 1u)
+  {
+    PORT->Group[0].PMUX[TRIG_PIN >> 1].bit.PMUXO = 0; // function A, EXTINT
+  }
+  else
+  {
+    PORT->Group[0].PMUX[TRIG_PIN >> 1].bit.PMUXE = 0;
+  }
+
+  EIC->CTRL.reg = 0;                            // CONFIG and EVCTRL are written disabled
+  while (EIC->STATUS.bit.SYNCBUSY);
+  EIC->CONFIG[extint >> 3].reg |= (EIC_CONFIG_SENSE0_BOTH | EIC_CONFIG_FILTEN0) << (4u * (extint & 7u));
+  EIC->EVCTRL.reg   |= EIC_EVCTRL_EXTINTEO(1u << extint);
+  EIC->INTENSET.reg  = EIC_INTENSET_EXTINT(1u << extint);
+  EIC->CTRL.reg      = EIC_CTRL_ENABLE;
+  while (EIC->STATUS.bit.SYNCBUSY);
+
+  EVSYS->USER.reg    = EVSYS_USER_USER(EVSYS_ID_USER_TC4_EVU) | EVSYS_USER_CHANNEL(TRIG_EVSYS_CHANNEL + 1u);
+  EVSYS->CHANNEL.reg = EVSYS_CHANNEL_CHANNEL(TRIG_EVSYS_CHANNEL) |
+                       EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_EIC_EXTINT_0 + extint) |
+                       EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+  timer_capture_setup();
+}
+
+// Called with interrupts disabled
+static void trigger_fire(uint32_t edge_us)
+{
+  trig_armed = false;
+  relay_schedule_cancel(trig_clear | trig_set);
+  if (trig_delay_us)
+  {
+    relay_schedule(trig_clear, trig_set, edge_us + trig_delay_us, TRACE_TRIG);
+  }
+  else
+  {
+    relay_update_mask(trig_clear, trig_set, TRACE_TRIG);
+    dac_relay_edge();                           // also when the relays keep their state
+    trig_latency = timer_us() - edge_us;
+  }
+  trig_count++;
+}
+
+// EIC_Handler, flags and in are its EIC flags and PORT input levels
+void trigger_eic(uint32_t flags, uint32_t in)
+{
+  if (!(flags & (1u << trig_extint())) || trig_source != TRIG_SOUR_EXT || !trig_armed)
+  {
+    return;
+  }
+  if (((in >> TRIG_PIN) & 1u) == (trig_negative ? 1u : 0u))
+  {
+    return; // the other slope
+  }
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  trigger_fire(timer_capture());
+  __set_PRIMASK(primask);
+}
+
+// USB488 TRIGGER message
+void trigger_bus(void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (trig_source == TRIG_SOUR_BUS && trig_armed)
+  {
+    trigger_fire(timer_us());
+  }
+  __set_PRIMASK(primask);
+}
+
+void trigger_set_source(uint8_t source)
+{
+  trig_source = source;
+}
+
+uint8_t trigger_get_source(void)
+{
+  return trig_source;
+}
+
+void trigger_set_slope(bool negative)
+{
+  trig_negative = negative;
+}
+
+bool trigger_get_slope(void)
+{
+  return trig_negative;
+}
+
+void trigger_set_delay(uint32_t us)
+{
+  trig_delay_us = us;
+}
+
+uint32_t trigger_get_delay(void)
+{
+  return trig_delay_us;
+}
+
+// TRIG:MASK, channels in scope are turned off, those in set on
+void trigger_set_mask(uint32_t scope, uint32_t set)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  trig_clear = scope;
+  trig_set   = set;
+  __set_PRIMASK(primask);
+}
+
+uint32_t trigger_get_mask(void)
+{
+  return trig_set;
+}
+
+// INIT arms for one trigger, ABOR disarms
+void trigger_arm(bool on)
+{
+  trig_armed = on;
+}
+
+bool trigger_armed(void)
+{
+  return trig_armed;
+}
+
+uint32_t trigger_count(void)
+{
+  return trig_count;
+}
+
+uint32_t trigger_latency(void)
+{
+  return trig_latency;
+}
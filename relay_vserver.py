@@ -0,0 +1,293 @@
+import argparse
+import atexit
+import json
+import os
+import random
+import shutil
+import socket
+import socketserver
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+# Virtual instrument server, any number of virtual relay boards for load
+# tests of host automation without hardware. Every board runs the firmware's
+# own command engine, usbtmc_app.c and the relay_* modules built for the host
+# (host/relay_host.c, one process per board), on its own TCP port and speaks
+# SCPI lines like a raw socket instrument, so pyvisa opens it as
+#   TCPIP0::127.0.0.1::5025::SOCKET   (read_termination "\n")
+# and scripts run unchanged. Queries are answered with the firmware's
+# response, commands with nothing, like pyvisa's write on the real board. A
+# query the firmware does not answer, one that failed to parse for example,
+# gets an empty line where the real board's read would time out.
+#
+# The peripherals are stubs: relays switch, scheduled edges and the frame
+# timebase follow the host clock, the ADC reads 0, inputs and the trigger pin
+# never change, and what the firmware keeps in flash (SYST:PON:MASK,
+# SYST:CHAN:COUN) lasts as long as the board's process. Only the main USBTMC
+# interface is served, the bank interfaces of the 8 channel board are not.
+#
+# A board has a channel count, 2 or 8 for the two firmware trees, a serial
+# number and an injected latency per command (plus random jitter), the USB
+# round trip of the real board. Clients of one board take turns like VISA
+# sessions sharing an instrument, the latency is spent while the board is
+# held. --map writes the serial numbers and their resource strings as JSON,
+# the way a host looks boards up by the serial in their USB resource. The
+# firmware is compiled with $CC (cc) when the server starts.
+#
+#   python3 relay_vserver.py --boards 200 --port 5025 --latency-ms 0.3 --map /tmp/boards.json
+#   python3 relay_vserver.py --board 123456:8:0.5 --board 123457:2:0
+#   python3 relay_vserver.py --selftest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+HOST_DIR = os.path.join(HERE, "host")
+BOARD_TREES = {2: HERE, 8: os.path.join(HERE, "8_channel_relay_board")}
+# left out of the host build: host/relay_host.c takes the place of main.c,
+# TinyUSB's descriptors and relay_nvm.c, usbtmc_bank*.c are not served
+HOST_SKIP = ("main.c", "usb_descriptors.c", "relay_nvm.c")
+
+_build_dir = None
+_binaries = {}
+
+def firmware_binary(channels):
+    # Builds the firmware of a board tree for the host, once per server
+    global _build_dir
+    if channels not in _binaries:
+        if _build_dir is None:
+            _build_dir = tempfile.mkdtemp(prefix="relay_vserver_")
+            atexit.register(shutil.rmtree, _build_dir, True)
+        tree = BOARD_TREES[channels]
+        sources = [os.path.join(tree, name) for name in sorted(os.listdir(tree))
+                   if name.endswith(".c") and name not in HOST_SKIP and not name.startswith("usbtmc_bank")]
+        binary = os.path.join(_build_dir, "relay_host_%dch" % channels)
+        subprocess.run([os.environ.get("CC", "cc"), "-std=gnu99", "-O2", "-w", "-DCFG_TUSB_MCU=0",
+                        "-I", HOST_DIR, "-I", tree, "-o", binary,
+                        os.path.join(HOST_DIR, "relay_host.c")] + sources, check=True)
+        _binaries[channels] = binary
+    return _binaries[channels]
+
+class VirtualBoard:
+    def __init__(self, serial, channels=2, latency_s=0.0, jitter_s=0.0):
+        self.serial = serial
+        self.channels = channels
+        self.latency_s = latency_s
+        self.jitter_s = jitter_s
+        self.process = subprocess.Popen([firmware_binary(channels)], stdin=subprocess.PIPE,
+                                        stdout=subprocess.PIPE)
+        self.lock = threading.Lock()
+        self.commands = 0
+
+    # Returns the response of a query, None for commands
+    def command(self, msg):
+        key = msg.strip().lower()
+        query = key.endswith("?") or "? " in key
+        data = (msg.strip() + "\n").encode("latin-1")
+        with self.lock:
+            delay = self.latency_s + (random.uniform(0, self.jitter_s) if self.jitter_s else 0.0)
+            if delay:
+                time.sleep(delay)
+            self.commands += 1
+            self.process.stdin.write(b"%s %d\n" % (b"Q" if query else b"W", len(data)) + data)
+            self.process.stdin.flush()
+            length = int(self.process.stdout.readline())
+            response = self.process.stdout.read(length)
+        return response if query else None
+
+    def close(self):
+        self.process.stdin.close()
+        self.process.wait()
+
+
+class BoardHandler(socketserver.StreamRequestHandler):
+    disable_nagle_algorithm = True # a response goes out at once, not with the next one
+
+    def handle(self):
+        board = self.server.board
+        for line in self.rfile:
+            msg = line.decode("latin-1").strip()
+            if not msg:
+                continue
+            response = board.command(msg)
+            if response is not None:
+                self.wfile.write(response or b"\n")
+                self.wfile.flush()
+
+
+class BoardServer(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, host, port, board):
+        self.board = board
+        super().__init__((host, port), BoardHandler)
+
+    def resource(self):
+        host, port = self.server_address[:2]
+        return "TCPIP0::%s::%d::SOCKET" % (host, port)
+
+
+def serve(boards, host="127.0.0.1", port=0):
+    # port 0 lets the system pick a free port per board, otherwise they are
+    # numbered from port
+    servers = []
+    for i, board in enumerate(boards):
+        server = BoardServer(host, port + i if port else 0, board)
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+        servers.append(server)
+    return servers
+
+def board_map(servers):
+    return {server.board.serial: {"resource": server.resource(),
+                                  "channels": server.board.channels,
+                                  "latency_ms": server.board.latency_s * 1e3}
+            for server in servers}
+
+def parse_board(text, args):
+    # SERIAL[:CHANNELS[:LATENCY_MS]]
+    fields = text.split(":")
+    channels = int(fields[1]) if len(fields) > 1 and fields[1] else args.channels
+    latency_ms = float(fields[2]) if len(fields) > 2 and fields[2] else args.latency_ms
+    if channels not in BOARD_TREES:
+        raise ValueError("channels of %s, a firmware has %s" % (fields[0], " or ".join(map(str, BOARD_TREES))))
+    return VirtualBoard(fields[0], channels, latency_ms / 1e3, args.jitter_ms / 1e3)
+
+
+class SocketResource:
+    # Same calls as a pyvisa resource, for the self-check without pyvisa
+    def __init__(self, address, timeout_s=5.0):
+        self.sock = socket.create_connection(address, timeout_s)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.rfile = self.sock.makefile("r", encoding="latin-1", newline="\n")
+
+    def write(self, msg):
+        self.sock.sendall((msg.strip() + "\n").encode("ascii"))
+
+    def read(self):
+        return self.rfile.readline()
+
+    def query(self, msg):
+        self.write(msg)
+        return self.read()
+
+    def close(self):
+        self.rfile.close()
+        self.sock.close()
+
+
+def selftest():
+    boards = [VirtualBoard("%06d" % (100000 + i), channels=8 if i % 2 else 2) for i in range(100)]
+    boards[0].latency_s = 0.005
+    servers = serve(boards)
+    mapping = board_map(servers)
+    assert len(mapping) == 100 and mapping["100003"]["channels"] == 8
+
+    # every board keeps its own state, the sequence of test_qtpy_2_channel_relay.py
+    def client(server, results):
+        c = SocketResource(server.server_address)
+        ok = c.query("*IDN?").startswith("RELAY1:EN 1")
+        c.write("RELAY1:EN 1")
+        c.write("RELAY2:EN 1")
+        ok &= c.query("RELAY:MASK?") == "3\n"
+        c.write("RELAY%d:EN 1" % (server.board.channels + 1))
+        ok &= c.query("SYST:ERR?") == '-114,"Header suffix out of range"\n'
+        c.write("*RST")
+        ok &= c.query("RELAY2:EN?") == "0\n"
+        c.close()
+        results.append(ok)
+    results = []
+    threads = [threading.Thread(target=client, args=(server, results)) for server in servers[1:]]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    assert all(results) and len(results) == 99
+
+    # the injected latency is paid per command, clients of a board share it
+    c = SocketResource(servers[0].server_address)
+    other = SocketResource(servers[0].server_address)
+    start = time.perf_counter()
+    other.write("RELAY1:EN 1")
+    assert other.query("RELAY:MASK?") == "1\n"
+    assert c.query("RELAY1:EN?") == "1\n" # the state is the board's, not the connection's
+    assert time.perf_counter() - start >= 0.015
+    # the firmware's command set: saved settings, macros, pulses on the host clock
+    c.write("*SAV 1")
+    c.write('*DMC "BOTH",#212RELAY:MASK 3')
+    c.write("BOTH")
+    assert c.query("RELAY:MASK?") == "3\n"
+    assert c.query('*GMC? "BOTH"') == "#212RELAY:MASK 3\n"
+    c.write("*RCL 1")
+    assert c.query("RELAY:MASK?") == "1\n"
+    c.write("RELAY2:PULS 200")
+    assert c.query("RELAY2:EN?") == "1\n"
+    time.sleep(0.3)
+    assert c.query("RELAY2:EN?") == "0\n"
+    assert c.query("MEAS:CURR? (@1)") == "0.0\n" # the ADC stub reads 0
+    assert c.query("SYST:ERR?") == '0,"No error"\n'
+    # a query that is not answered gets an empty line, its error is queued
+    assert c.query("FOO?") == "\n"
+    assert c.query("SYST:ERR?") == '-113,"Undefined header"\n'
+    c.close()
+    other.close()
+    for server in servers:
+        server.shutdown()
+        server.server_close()
+        server.board.close()
+    print("virtual boards OK")
+
+def main():
+    parser = argparse.ArgumentParser(description="Serve simulated relay boards as raw socket instruments",
+                                     epilog="boards run the firmware's command engine, see README.md")
+    parser.add_argument("--boards", type=int, default=0, help="number of boards with the default settings")
+    parser.add_argument("--board", action="append", default=[], metavar="SERIAL[:CHANNELS[:LATENCY_MS]]",
+                        help="board with its own settings, repeat for more")
+    parser.add_argument("--channels", type=int, default=2, choices=sorted(BOARD_TREES),
+                        help="default relay channels, the 2 or the 8 channel firmware")
+    parser.add_argument("--latency-ms", type=float, default=0.0, help="default latency per command")
+    parser.add_argument("--jitter-ms", type=float, default=0.0, help="random extra latency, 0 to this")
+    parser.add_argument("--serial", type=int, default=123456, help="serial number of the first --boards board")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=5025, help="port of the first board, 0 = any free port")
+    parser.add_argument("--map", metavar="FILE", help="write serial numbers and resources as JSON")
+    parser.add_argument("--stats", type=float, default=0, metavar="S", help="print commands/s every S seconds")
+    parser.add_argument("--selftest", action="store_true", help="check a hundred local boards and exit")
+    args = parser.parse_args()
+
+    if args.selftest:
+        selftest()
+        return 0
+    try:
+        boards = [parse_board(text, args) for text in args.board]
+        boards += [parse_board("%d" % (args.serial + i), args) for i in range(args.boards)]
+    except ValueError as e:
+        parser.error("bad --board: %s" % e)
+    if not boards:
+        parser.error("no board, use --boards N or --board SERIAL")
+    servers = serve(boards, args.host, args.port)
+    mapping = board_map(servers)
+    if args.map:
+        with open(args.map, "w") as f:
+            json.dump(mapping, f, indent=2)
+    else:
+        for serial, entry in mapping.items():
+            print(serial, entry["resource"])
+    try:
+        last = 0
+        while True:
+            time.sleep(args.stats or 3600)
+            if args.stats:
+                total = sum(board.commands for board in boards)
+                print("%d boards, %.1f commands/s" % (len(boards), (total - last) / args.stats))
+                last = total
+    except KeyboardInterrupt:
+        pass
+    for server in servers:
+        server.shutdown()
+        server.server_close()
+        server.board.close()
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
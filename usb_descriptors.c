@@ -0,0 +1,195 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Ha Thach (tinyusb.org),
+ *                    Nathan Conrad
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#define BOARD_SERIAL     "123456"
+
+#include "tusb.h"
+#include "class/usbtmc/usbtmc_device.h"
+#include "usbtmc_app.h"
+
+//--------------------------------------------------------------------+
+// Device Descriptors
+//--------------------------------------------------------------------+
+// The VID/PID are the ones of the TinyUSB USBTMC example, host scripts open
+// USB0::51966::16384::<BOARD_SERIAL>::0::INSTR. bcdDevice changes with the
+// interfaces (HID, bank interfaces), so hosts that cache descriptors read them
+// again.
+tusb_desc_device_t const desc_device =
+{
+    .bLength            = sizeof(tusb_desc_device_t),
+    .bDescriptorType    = TUSB_DESC_DEVICE,
+    .bcdUSB             = 0x0200,
+    .bDeviceClass       = 0x00,
+    .bDeviceSubClass    = 0x00,
+    .bDeviceProtocol    = 0x00,
+    .bMaxPacketSize0    = CFG_TUD_ENDPOINT0_SIZE,
+
+    .idVendor           = 0xCafe,
+    .idProduct          = 0x4000,
+    .bcdDevice          = 0x0102,
+
+    .iManufacturer      = 0x01,
+    .iProduct           = 0x02,
+    .iSerialNumber      = 0x03,
+
+    .bNumConfigurations = 0x01
+};
+
+// Invoked when received GET DEVICE DESCRIPTOR
+// Application return pointer to descriptor
+uint8_t const * tud_descriptor_device_cb(void)
+{
+  return (uint8_t const *) &desc_device;
+}
+
+//--------------------------------------------------------------------+
+// HID Report Descriptor
+//--------------------------------------------------------------------+
+// Vendor usage page, one 8 byte input and one 8 byte output report
+uint8_t const desc_hid_report[] =
+{
+  TUD_HID_REPORT_DESC_GENERIC_INOUT(CFG_TUD_HID_EP_BUFSIZE)
+};
+
+// Invoked when received GET HID REPORT DESCRIPTOR
+uint8_t const * tud_hid_descriptor_report_cb(uint8_t instance)
+{
+  (void) instance;
+  return desc_hid_report;
+}
+
+//--------------------------------------------------------------------+
+// Configuration Descriptor
+//--------------------------------------------------------------------+
+
+#define TUD_USBTMC_DESC_MAIN(_itfnum,_bNumEndpoints,_stridx,_epout,_epin) \
+  TUD_USBTMC_IF_DESCRIPTOR(_itfnum, _bNumEndpoints, _stridx, TUD_USBTMC_PROTOCOL_USB488), \
+  TUD_USBTMC_BULK_DESCRIPTORS(/* OUT = */_epout, /* IN = */ _epin, /* packet size = */USBTMCD_MAX_PACKET_SIZE)
+
+#if CFG_TUD_USBTMC_ENABLE_INT_EP
+// Interrupt endpoint should be 2 bytes on a FS USB link
+#  define TUD_USBTMC_DESC(_itfnum,_stridx,_epout,_epin,_epint) \
+     TUD_USBTMC_DESC_MAIN(_itfnum, /* _epCount = */ 3, _stridx, _epout, _epin), \
+     TUD_USBTMC_INT_DESCRIPTOR(/* INT ep # */ _epint, /* epMaxSize = */ 2, /* bInterval = */16u )
+#  define TUD_USBTMC_DESC_LEN (TUD_USBTMC_IF_DESCRIPTOR_LEN + TUD_USBTMC_BULK_DESCRIPTORS_LEN + TUD_USBTMC_INT_DESCRIPTOR_LEN)
+
+#else
+
+#  define TUD_USBTMC_DESC(_itfnum,_stridx,_epout,_epin,_epint) \
+     TUD_USBTMC_DESC_MAIN(_itfnum, /* _epCount = */ 2u, _stridx, _epout, _epin)
+#  define TUD_USBTMC_DESC_LEN (TUD_USBTMC_IF_DESCRIPTOR_LEN + TUD_USBTMC_BULK_DESCRIPTORS_LEN)
+
+#endif /* CFG_TUD_USBTMC_ENABLE_INT_EP */
+
+#define EPNUM_HID_OUT   0x03
+#define EPNUM_HID_IN    0x83
+
+// Bank interfaces, OUT, IN and interrupt endpoint of bank n
+#define EPNUM_BANK_OUT(n)  (0x02 + 2 * (n))
+#define EPNUM_BANK_IN(n)   (0x82 + 2 * (n))
+#define EPNUM_BANK_INT(n)  (0x83 + 2 * (n))
+#define TUD_USBTMC_BANK_DESC(n) \
+  TUD_USBTMC_DESC(ITF_NUM_BANK1 + (n) - 1, 5 + (n), EPNUM_BANK_OUT(n), EPNUM_BANK_IN(n), EPNUM_BANK_INT(n))
+
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + (1 + BOARD_USBTMC_BANKS) * TUD_USBTMC_DESC_LEN + TUD_HID_INOUT_DESC_LEN)
+
+uint8_t const desc_fs_configuration[] =
+{
+  // Config number, interface count, string index, total length, attribute, power in mA
+  TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
+  TUD_USBTMC_DESC(ITF_NUM_USBTMC, 4, 0x01, 0x81, 0x82),
+  // Interface number, string index, protocol, report descriptor len, EP Out & In address, size & polling interval (ms)
+  TUD_HID_INOUT_DESCRIPTOR(ITF_NUM_HID, 5, HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_report), EPNUM_HID_OUT, EPNUM_HID_IN, CFG_TUD_HID_EP_BUFSIZE, 1),
+#if BOARD_USBTMC_BANKS > 0
+  TUD_USBTMC_BANK_DESC(1),
+#endif
+#if BOARD_USBTMC_BANKS > 1
+  TUD_USBTMC_BANK_DESC(2),
+#endif
+};
+
+// Invoked when received GET CONFIGURATION DESCRIPTOR
+// Application return pointer to descriptor
+// Descriptor contents must exist long enough for transfer to complete
+uint8_t const * tud_descriptor_configuration_cb(uint8_t index)
+{
+  (void) index; // for multiple configurations
+  return desc_fs_configuration;
+}
+
+//--------------------------------------------------------------------+
+// String Descriptors
+//--------------------------------------------------------------------+
+
+// array of pointer to string descriptors
+char const* string_desc_arr [] =
+{
+  (const char[]) { 0x09, 0x04 }, // 0: is supported language is English (0x0409)
+  "TinyUSB",                     // 1: Manufacturer
+  "TinyUSB Device",              // 2: Product
+  BOARD_SERIAL,                  // 3: Serials, should use chip ID
+  "TinyUSB USBTMC",              // 4: USBTMC
+  "Relay mask HID",              // 5: HID
+  "USBTMC bank 1",               // 6: USBTMC bank interfaces
+  "USBTMC bank 2",               // 7
+};
+
+static uint16_t _desc_str[32];
+
+// Invoked when received GET STRING DESCRIPTOR request
+// Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
+uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+  (void) langid;
+
+  uint8_t chr_count;
+
+  if ( index == 0)
+  {
+    memcpy(&_desc_str[1], string_desc_arr[0], 2);
+    chr_count = 1;
+  }else
+  {
+    // Convert ASCII string into UTF-16
+
+    if ( !(index < sizeof(string_desc_arr)/sizeof(string_desc_arr[0])) ) return NULL;
+
+    const char* str = string_desc_arr[index];
+
+    // Cap at max char
+    chr_count = (uint8_t) strlen(str);
+    if ( chr_count > 31 ) chr_count = 31;
+
+    for(uint8_t i=0; i<chr_count; i++)
+    {
+      _desc_str[1+i] = str[i];
+    }
+  }
+
+  // first byte is length (including header), second byte is string type
+  _desc_str[0] = (uint16_t) ((TUSB_DESC_STRING << 8 ) | (2*chr_count + 2));
+
+  return _desc_str;
+}
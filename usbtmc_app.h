@@ -4,10 +4,292 @@
 
 void     usbtmc_app_task_iter(void);
 
+// Interfaces, BOARD_USBTMC_BANKS USBTMC interfaces for channel banks follow
+// the HID one, see USBTMC_CHANNELS in usbtmc_app.c
+enum
+{
+  ITF_NUM_USBTMC,
+  ITF_NUM_HID,
+  ITF_NUM_BANK1,
+  ITF_NUM_TOTAL = ITF_NUM_BANK1 + BOARD_USBTMC_BANKS
+};
+
+// Endpoints of a USBTMC driver instance. TinyUSB's USBTMC driver serves
+// a single interface, the bank interfaces are served by renamed copies of it
+// (usbtmc_bank.h) whose callbacks end up in the usbtmc_app_* functions.
+typedef struct
+{
+  bool (*start_bus_read)(void);
+  bool (*transmit)(const void *data, size_t len, bool endOfMessage, bool usingTermChar);
+#if CFG_TUD_USBTMC_ENABLE_INT_EP
+  bool (*notify)(const void *data, size_t len); // interrupt endpoint
+#endif
+} usbtmc_transport_t;
+
+void     usbtmc_app_open(usbtmc_transport_t const *io, uint8_t interface_id);
+#if (CFG_TUD_USBTMC_ENABLE_488)
+usbtmc_response_capabilities_488_t const * usbtmc_app_capabilities(void);
+#else
+usbtmc_response_capabilities_t const * usbtmc_app_capabilities(void);
+#endif
+bool     usbtmc_app_msg_trigger(usbtmc_transport_t const *io, usbtmc_msg_generic_t *msg);
+bool     usbtmc_app_msgBulkOut_start(usbtmc_transport_t const *io, usbtmc_msg_request_dev_dep_out const *msgHeader);
+bool     usbtmc_app_msg_data(usbtmc_transport_t const *io, void *data, size_t len, bool transfer_complete);
+bool     usbtmc_app_msgBulkIn_complete(usbtmc_transport_t const *io);
+bool     usbtmc_app_msgBulkIn_request(usbtmc_transport_t const *io, usbtmc_msg_request_dev_dep_in const *request);
+bool     usbtmc_app_initiate_clear(usbtmc_transport_t const *io, uint8_t *tmcResult);
+bool     usbtmc_app_check_clear(usbtmc_transport_t const *io, usbtmc_get_clear_status_rsp_t *rsp);
+bool     usbtmc_app_initiate_abort_bulk_in(usbtmc_transport_t const *io, uint8_t *tmcResult);
+bool     usbtmc_app_check_abort_bulk_in(usbtmc_transport_t const *io, usbtmc_check_abort_bulk_rsp_t *rsp);
+bool     usbtmc_app_initiate_abort_bulk_out(usbtmc_transport_t const *io, uint8_t *tmcResult);
+bool     usbtmc_app_check_abort_bulk_out(usbtmc_transport_t const *io, usbtmc_check_abort_bulk_rsp_t *rsp);
+void     usbtmc_app_bulkIn_clearFeature(usbtmc_transport_t const *io);
+void     usbtmc_app_bulkOut_clearFeature(usbtmc_transport_t const *io);
+uint8_t  usbtmc_app_get_stb(usbtmc_transport_t const *io, uint8_t *tmcResult);
+bool     usbtmc_app_indicator_pulse(tusb_control_request_t const *msg, uint8_t *tmcResult);
+
+// Class driver of bank n, the functions are the renamed ones of usbtmc_bank<n>.c
+#define USBTMC_BANK_DECLARE(n) \
+  void     usbtmcd_init_cb_bank##n(void); \
+  void     usbtmcd_reset_cb_bank##n(uint8_t rhport); \
+  uint16_t usbtmcd_open_cb_bank##n(uint8_t rhport, tusb_desc_interface_t const *itf_desc, uint16_t max_len); \
+  bool     usbtmcd_control_xfer_cb_bank##n(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request); \
+  bool     usbtmcd_xfer_cb_bank##n(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes);
+
+#if CFG_TUSB_DEBUG >= 2
+#define USBTMC_BANK_DRIVER_NAME(n) .name = "TMC BANK" #n,
+#else
+#define USBTMC_BANK_DRIVER_NAME(n)
+#endif
+#define USBTMC_BANK_DRIVER(n) \
+  { \
+    USBTMC_BANK_DRIVER_NAME(n) \
+    .init             = usbtmcd_init_cb_bank##n, \
+    .reset            = usbtmcd_reset_cb_bank##n, \
+    .open             = usbtmcd_open_cb_bank##n, \
+    .control_xfer_cb  = usbtmcd_control_xfer_cb_bank##n, \
+    .xfer_cb          = usbtmcd_xfer_cb_bank##n, \
+    .sof              = NULL \
+  }
+
 void     gpio_setup(void);
 void     adc_setup(void);
 void     dac_setup(void);
 
+// Cause of a relay transition, as recorded in the trace ring
+enum
+{
+  TRACE_POWER_ON = 1, // power-on state in gpio_setup
+  TRACE_RST,          // *RST
+  TRACE_EN,           // RELAYn:EN
+  TRACE_PULS,         // switch-on of RELAYn:PULS, RELAY:PULS
+  TRACE_MASK,         // RELAY:MASK
+  TRACE_ROUT,         // ROUT:CLOS, ROUT:OPEN
+  TRACE_HID,          // HID OUT report
+  TRACE_STEP,         // later switch-on step under the power budget
+  TRACE_PULSE_END,    // pulse return edge
+  TRACE_CHAN,         // SYST:CHAN:COUN turned channels off
+  TRACE_TRIG,         // TRIG:MASK applied by a trigger
+  TRACE_AT,           // RELAY:MASK:AT
+  TRACE_RCL,          // *RCL
+};
+
+void     relay_write_mask(uint32_t mask, uint8_t cause);
+void     relay_update_mask(uint32_t clear_mask, uint32_t set_mask, uint8_t cause);
+uint32_t relay_read_mask(void);
+bool     relay_set_mask(uint32_t mask, uint8_t cause);
+
+enum
+{
+  BOOT_GPIO,        // gpio_setup done
+  BOOT_BOARD,       // board_init done
+  BOOT_TUSB,        // tusb_init done
+  BOOT_MOUNT,       // first tud_mount_cb
+  BOOT_FIRST_CMD,   // first command executed
+  BOOT_PHASES
+};
+
+void     timer_setup(void);
+void     timer_clock_dfll(void);
+uint32_t timer_us(void);
+#define TIMER_FRAME_US    1000u  // USB full speed frame
+#define TIMER_FRAME_MASK  0x7FFu // 11 bit frame number
+void     timer_sof_enable(void);
+void     timer_sof(uint32_t frame);
+bool     timer_sof_locked(void);
+void     timer_frame_now(uint16_t *frame, uint16_t *us);
+bool     timer_frame_deadline(uint16_t frame, uint16_t us, uint32_t *deadline);
+void     timer_capture_setup(void);
+uint32_t timer_capture(void);
+void     boot_mark(uint8_t phase);
+uint32_t boot_time(uint8_t phase);
+void     relay_schedule(uint32_t clear, uint32_t set, uint32_t deadline, uint8_t cause);
+void     relay_schedule_cancel(uint32_t mask);
+uint32_t relay_schedule_pending(void);
+uint32_t relay_schedule_pending_set(void);
+bool     relay_schedule_has(uint8_t cause);
+
+void     relay_apply(uint32_t clear, uint32_t set, uint32_t pulse_us, uint8_t cause);
+void     power_set_budget(uint32_t ma);
+uint32_t power_get_budget(void);
+void     power_set_channel(uint8_t channel, uint16_t pull_ma, uint16_t hold_ma, uint32_t pull_us);
+void     power_get_channel(uint8_t channel, uint16_t *pull_ma, uint16_t *hold_ma, uint32_t *pull_us);
+uint8_t  power_last_step_count(void);
+
+void     pwm_setup(void);
+bool     relay_pwm_capable(uint8_t channel);
+void     relay_pwm_set_duty(uint8_t channel, uint16_t duty);
+uint16_t relay_pwm_get_duty(uint8_t channel);
+void     relay_pwm_set_freq(uint8_t channel, uint32_t hz);
+uint32_t relay_pwm_get_freq(uint8_t channel);
+void     relay_pwm_stop(uint32_t mask);
+uint32_t relay_pwm_active(void);
+
+void     hid_task(void);
+
+// DMAC channels, one per user
+enum
+{
+  DMA_CH_ADC,
+  DMA_CH_DAC,
+  DMA_CH_EXP,
+  DMA_CH_SHIFT,
+  DMA_CHANNELS
+};
+
+void     dma_setup(void);
+void *   dma_descriptor(uint8_t channel);   // DmacDescriptor
+void     dma_channel_start(uint8_t channel, uint32_t chctrlb);
+void     dma_channel_stop(uint8_t channel);
+
+// Definite length blocks of FETC?, TRAC:DATA? and INP:DATA? are copied into
+// a buffer of the interface that asked, "#" + digit count + length + data +
+// newline fits in BLOCK_OUT_LEN
+#define BLOCK_OUT_LEN    (2u + 4u + 2048u + 1u)
+
+void     adc_dma_block_done(void);
+uint32_t adc_coil_mask(void);
+uint32_t adc_contact_mask(void);
+uint32_t adc_coil_current(uint8_t channel);
+uint32_t adc_contact_state(void);
+size_t   adc_fetch(uint8_t *block, uint32_t *seq);
+void     adc_verify_set(bool on);
+bool     adc_verify_get(void);
+uint32_t adc_verify_failed(void);
+void     adc_verify_clear(void);
+void     adc_task(void);
+
+#define DAC_WAVE_LEN     1024u          // samples of a SOUR:WAV:DATA block
+
+enum
+{
+  DAC_WAVE_STOPPED,
+  DAC_WAVE_RUNNING,
+  DAC_WAVE_ARMED,     // starts with the next relay transition
+};
+
+void     dac_set_mv(uint32_t mv);
+uint32_t dac_get_mv(void);
+void     dac_reset(void);
+void     dac_wave_begin(uint32_t len);
+void     dac_wave_rx(uint8_t const *data, size_t len);
+bool     dac_wave_end(void);
+bool     dac_wave_ready(void);
+void     dac_wave_load(void);
+uint16_t dac_wave_samples(void);
+void     dac_wave_set_rate(uint32_t hz);
+uint32_t dac_wave_get_rate(void);
+void     dac_wave_set_cont(bool on);
+bool     dac_wave_get_cont(void);
+uint8_t  dac_wave_state(void);
+void     dac_wave_start(bool arm);
+void     dac_wave_stop(void);
+void     dac_relay_edge(void);
+void     dac_dma_block_done(void);
+
+void     trace_record(uint32_t before, uint32_t after, uint8_t cause);
+void     trace_clear(void);
+bool     trace_last(uint32_t *us);
+size_t   trace_block(uint8_t *block);
+
+void     input_setup(void);
+uint8_t  input_count(void);
+uint32_t input_state(void);
+uint32_t input_edges(void);
+void     input_clear(void);
+bool     input_latency(uint8_t input, uint32_t *us);
+size_t   input_block(uint8_t *block);
+
+void     expander_setup(void);
+void     expander_write(uint32_t mask);
+uint32_t expander_failed(void);
+void     expander_dma_done(void);
+
+// PA pins the shift register chain takes, MOSI, SCK, /OE and RCLK (see
+// relay_spi.c), and the expander bus, SDA and SCL (see relay_i2c.c). The
+// modules that put their own pins on PA check them against BUS_PINS, so a
+// bus can not be fitted on top of a relay, input or ADC pin.
+#if BOARD_RELAY_SHIFT_CHANNELS
+#define SHIFT_PINS       (PA_BIT(10) | PA_BIT(11) | PA_BIT(6) | PA_BIT(7))
+#else
+#define SHIFT_PINS       0u
+#endif
+#if BOARD_RELAY_EXPANDERS
+#define EXP_PINS         (PA_BIT(16) | PA_BIT(17))
+#else
+#define EXP_PINS         0u
+#endif
+#define BUS_PINS         (SHIFT_PINS | EXP_PINS)
+
+// Masks of the pin lists of the board blocks: PA_MASK of PA pin numbers,
+// PORT_MASK of PORT_PAxx masks, up to the 11 pins of a QT PY. An empty list
+// is 0.
+#define PA_BIT(n)        ((n) < 32 ? 1u << ((n) & 31u) : 0u)
+#define PA_MASK(...)     PA_MASK_LIST(__VA_ARGS__) // the list macro is expanded here, before ## below
+#define PA_MASK_LIST(...) PA_MASK_(32, ##__VA_ARGS__, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32)
+#define PA_MASK_(z, a, b, c, d, e, f, g, h, i, j, k, ...) \
+  (PA_BIT(a) | PA_BIT(b) | PA_BIT(c) | PA_BIT(d) | PA_BIT(e) | PA_BIT(f) | \
+   PA_BIT(g) | PA_BIT(h) | PA_BIT(i) | PA_BIT(j) | PA_BIT(k))
+#define PORT_MASK(...)   PORT_MASK_LIST(__VA_ARGS__)
+#define PORT_MASK_LIST(...) PORT_MASK_(0u, ##__VA_ARGS__, 0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u)
+#define PORT_MASK_(z, a, b, c, d, e, f, g, h, i, j, k, ...) \
+  ((uint32_t)(a) | (b) | (c) | (d) | (e) | (f) | (g) | (h) | (i) | (j) | (k))
+
+void     shift_setup(void);
+void     shift_write(uint32_t mask);
+void     shift_set_channels(uint8_t channels);
+void     shift_dma_done(void);
+
+enum
+{
+  TRIG_SOUR_BUS,      // USB488 TRIGGER message
+  TRIG_SOUR_EXT,      // trigger pin
+};
+
+void     trigger_setup(void);
+void     trigger_eic(uint32_t flags, uint32_t in);
+void     trigger_bus(void);
+void     trigger_set_source(uint8_t source);
+uint8_t  trigger_get_source(void);
+void     trigger_set_slope(bool negative);
+bool     trigger_get_slope(void);
+void     trigger_set_delay(uint32_t us);
+uint32_t trigger_get_delay(void);
+void     trigger_set_mask(uint32_t scope, uint32_t set);
+uint32_t trigger_get_mask(void);
+void     trigger_arm(bool on);
+bool     trigger_armed(void);
+uint32_t trigger_count(void);
+uint32_t trigger_latency(void);
+
+void     nvm_setup(void);
+uint32_t nvm_power_on_mask(void);
+bool     nvm_power_on_last(void);
+void     nvm_set_power_on(bool last, uint32_t mask);
+uint8_t  nvm_channel_count(void);
+void     nvm_set_channels(uint8_t count);
+void     nvm_task(void);
+
 char * get_value(char *in_string);
 char * get_command(char *in_string, char *ptr_value);
 void samd21_unique_id( char * id_buff );
@@ -0,0 +1,149 @@
+// Second and later USBTMC interfaces. TinyUSB's USBTMC driver keeps its state
+// in file statics and calls fixed callback names, so it serves one interface.
+// usbtmc_bank<n>.c defines USBTMC_BANK and includes this file, which compiles
+// another copy of the driver with every external name given a _bank<n>
+// suffix. The copy's callbacks pass its transport to the usbtmc_app_*
+// functions, usbtmc_app.c registers it as an application class driver.
+#include "tusb_config.h"
+
+#if (USBTMC_BANK <= BOARD_USBTMC_BANKS)
+
+#define BANK_PASTE(name, n)    name##_bank##n
+#define BANK_EXPAND(name, n)   BANK_PASTE(name, n)
+#define BANK_NAME(name)        BANK_EXPAND(name, USBTMC_BANK)
+
+// class driver
+#define usbtmcd_init_cb                        BANK_NAME(usbtmcd_init_cb)
+#define usbtmcd_deinit                         BANK_NAME(usbtmcd_deinit)
+#define usbtmcd_reset_cb                       BANK_NAME(usbtmcd_reset_cb)
+#define usbtmcd_open_cb                        BANK_NAME(usbtmcd_open_cb)
+#define usbtmcd_control_xfer_cb                BANK_NAME(usbtmcd_control_xfer_cb)
+#define usbtmcd_xfer_cb                        BANK_NAME(usbtmcd_xfer_cb)
+// application API
+#define tud_usbtmc_start_bus_read              BANK_NAME(tud_usbtmc_start_bus_read)
+#define tud_usbtmc_transmit_dev_msg_data       BANK_NAME(tud_usbtmc_transmit_dev_msg_data)
+#define tud_usbtmc_transmit_notification_data  BANK_NAME(tud_usbtmc_transmit_notification_data)
+// application callbacks
+#define tud_usbtmc_open_cb                     BANK_NAME(tud_usbtmc_open_cb)
+#define tud_usbtmc_get_capabilities_cb         BANK_NAME(tud_usbtmc_get_capabilities_cb)
+#define tud_usbtmc_msg_trigger_cb              BANK_NAME(tud_usbtmc_msg_trigger_cb)
+#define tud_usbtmc_msgBulkOut_start_cb         BANK_NAME(tud_usbtmc_msgBulkOut_start_cb)
+#define tud_usbtmc_msg_data_cb                 BANK_NAME(tud_usbtmc_msg_data_cb)
+#define tud_usbtmc_msgBulkIn_complete_cb       BANK_NAME(tud_usbtmc_msgBulkIn_complete_cb)
+#define tud_usbtmc_msgBulkIn_request_cb        BANK_NAME(tud_usbtmc_msgBulkIn_request_cb)
+#define tud_usbtmc_initiate_clear_cb           BANK_NAME(tud_usbtmc_initiate_clear_cb)
+#define tud_usbtmc_check_clear_cb              BANK_NAME(tud_usbtmc_check_clear_cb)
+#define tud_usbtmc_initiate_abort_bulk_in_cb   BANK_NAME(tud_usbtmc_initiate_abort_bulk_in_cb)
+#define tud_usbtmc_check_abort_bulk_in_cb      BANK_NAME(tud_usbtmc_check_abort_bulk_in_cb)
+#define tud_usbtmc_initiate_abort_bulk_out_cb  BANK_NAME(tud_usbtmc_initiate_abort_bulk_out_cb)
+#define tud_usbtmc_check_abort_bulk_out_cb     BANK_NAME(tud_usbtmc_check_abort_bulk_out_cb)
+#define tud_usbtmc_bulkIn_clearFeature_cb      BANK_NAME(tud_usbtmc_bulkIn_clearFeature_cb)
+#define tud_usbtmc_bulkOut_clearFeature_cb     BANK_NAME(tud_usbtmc_bulkOut_clearFeature_cb)
+#define tud_usbtmc_get_stb_cb                  BANK_NAME(tud_usbtmc_get_stb_cb)
+#define tud_usbtmc_indicator_pulse_cb          BANK_NAME(tud_usbtmc_indicator_pulse_cb)
+#define tud_usbtmc_notification_complete_cb    BANK_NAME(tud_usbtmc_notification_complete_cb)
+
+#include "tusb.h"
+#include "class/usbtmc/usbtmc_device.c"
+#include "usbtmc_app.h"
+
+static usbtmc_transport_t const bank_io =
+{
+  .start_bus_read = tud_usbtmc_start_bus_read,
+  .transmit       = tud_usbtmc_transmit_dev_msg_data,
+#if CFG_TUD_USBTMC_ENABLE_INT_EP
+  .notify         = tud_usbtmc_transmit_notification_data,
+#endif
+};
+
+void tud_usbtmc_open_cb(uint8_t interface_id)
+{
+  usbtmc_app_open(&bank_io, interface_id);
+}
+
+#if (CFG_TUD_USBTMC_ENABLE_488)
+usbtmc_response_capabilities_488_t const *
+#else
+usbtmc_response_capabilities_t const *
+#endif
+tud_usbtmc_get_capabilities_cb()
+{
+  return usbtmc_app_capabilities();
+}
+
+bool tud_usbtmc_msg_trigger_cb(usbtmc_msg_generic_t* msg)
+{
+  return usbtmc_app_msg_trigger(&bank_io, msg);
+}
+
+bool tud_usbtmc_msgBulkOut_start_cb(usbtmc_msg_request_dev_dep_out const * msgHeader)
+{
+  return usbtmc_app_msgBulkOut_start(&bank_io, msgHeader);
+}
+
+bool tud_usbtmc_msg_data_cb(void *data, size_t len, bool transfer_complete)
+{
+  return usbtmc_app_msg_data(&bank_io, data, len, transfer_complete);
+}
+
+bool tud_usbtmc_msgBulkIn_complete_cb()
+{
+  return usbtmc_app_msgBulkIn_complete(&bank_io);
+}
+
+bool tud_usbtmc_msgBulkIn_request_cb(usbtmc_msg_request_dev_dep_in const * request)
+{
+  return usbtmc_app_msgBulkIn_request(&bank_io, request);
+}
+
+bool tud_usbtmc_initiate_clear_cb(uint8_t *tmcResult)
+{
+  return usbtmc_app_initiate_clear(&bank_io, tmcResult);
+}
+
+bool tud_usbtmc_check_clear_cb(usbtmc_get_clear_status_rsp_t *rsp)
+{
+  return usbtmc_app_check_clear(&bank_io, rsp);
+}
+
+bool tud_usbtmc_initiate_abort_bulk_in_cb(uint8_t *tmcResult)
+{
+  return usbtmc_app_initiate_abort_bulk_in(&bank_io, tmcResult);
+}
+
+bool tud_usbtmc_check_abort_bulk_in_cb(usbtmc_check_abort_bulk_rsp_t *rsp)
+{
+  return usbtmc_app_check_abort_bulk_in(&bank_io, rsp);
+}
+
+bool tud_usbtmc_initiate_abort_bulk_out_cb(uint8_t *tmcResult)
+{
+  return usbtmc_app_initiate_abort_bulk_out(&bank_io, tmcResult);
+}
+
+bool tud_usbtmc_check_abort_bulk_out_cb(usbtmc_check_abort_bulk_rsp_t *rsp)
+{
+  return usbtmc_app_check_abort_bulk_out(&bank_io, rsp);
+}
+
+void tud_usbtmc_bulkIn_clearFeature_cb(void)
+{
+  usbtmc_app_bulkIn_clearFeature(&bank_io);
+}
+
+void tud_usbtmc_bulkOut_clearFeature_cb(void)
+{
+  usbtmc_app_bulkOut_clearFeature(&bank_io);
+}
+
+uint8_t tud_usbtmc_get_stb_cb(uint8_t *tmcResult)
+{
+  return usbtmc_app_get_stb(&bank_io, tmcResult);
+}
+
+bool tud_usbtmc_indicator_pulse_cb(tusb_control_request_t const * msg, uint8_t *tmcResult)
+{
+  return usbtmc_app_indicator_pulse(msg, tmcResult);
+}
+
+#endif